@@ -71,7 +71,7 @@ class BKNode {
         T get() const;
 
         int distance(const BKNode<std::string> &, bool remove_last = false) const;
-        std::vector<T> find(const T &, const int, bool remove_last = false);
+        std::vector<T> find(const T &, const int, bool remove_last = false) const;
         std::set<T> get_nodes() const;
         
         // Mutators
@@ -152,7 +152,7 @@ std::set<T> BKNode<T>::get_nodes() const{
 
 
 template <typename T>
-std::vector<T> BKNode<T>::find(const T &rhs, const int threshold, bool remove_last) {
+std::vector<T> BKNode<T>::find(const T &rhs, const int threshold, bool remove_last) const {
     int dist = distance(rhs, remove_last);
     
     std::vector<T> results=std::vector<T>();
@@ -160,12 +160,22 @@ std::vector<T> BKNode<T>::find(const T &rhs, const int threshold, bool remove_la
     if (dist<=threshold)
         results.push_back(value);
     
-    int dmin=dist-threshold;
-    int dmax=dist+threshold;
+    // The children are keyed by the full distance, so the pruning has to
+    // use it too. Without the last base an entry may be one further away
+    // over the full length and still be within the threshold.
+    int radius = threshold;
+    if (remove_last) {
+        dist = distance(rhs);
+        radius++;
+    }
+    int dmin=dist-radius;
+    int dmax=dist+radius;
     
+    // Lookups only, so that threads can share a tree
     for (int i=dmin; i<=dmax; i++) {
-        if (children.count(i)) {
-            std::vector<T> partial= std::vector<T>(children[i]->find(rhs,threshold, remove_last));
+        auto child = children.find(i);
+        if (child != children.end()) {
+            std::vector<T> partial= std::vector<T>(child->second->find(rhs,threshold, remove_last));
             
             results.insert(results.end(), partial.begin(), partial.end());
         }
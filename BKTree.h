@@ -36,6 +36,7 @@
 #include "boost/archive/text_oarchive.hpp"
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/map.hpp>
+#include <boost/serialization/version.hpp>
 
 template <typename T>
 class BKTree {
@@ -47,6 +48,10 @@ class BKTree {
     protected:
         BKNode<T> *root;
         int node_count;
+        // Smallest distance between two entries, over the full length and
+        // without the last base. Zero when the dictionary was not analyzed.
+        int min_dist;
+        int min_dist_trimmed;
     public:
         BKTree();
         BKTree(BKNode<T> *, int);
@@ -56,6 +61,10 @@ class BKTree {
         std::vector<T> find(const T &, const int, bool remove_last = false) const;
         std::set<T> get_nodes() const;
         int size() const;
+
+        void set_min_distance(int, int);
+        int get_min_distance(bool remove_last = false) const;
+        int safe_cutoff(bool remove_last = false) const;
 };
 
 template <typename T>
@@ -64,18 +73,26 @@ void BKTree<T>::serialize(Archive & ar, const unsigned int version)
 {
     ar & node_count;
     ar & root;
+    if (version > 0) {
+        ar & min_dist;
+        ar & min_dist_trimmed;
+    }
 }
 
 template <typename T>
 BKTree<T>::BKTree(BKNode<T> * r, int nc) {
     root=r;
     node_count=nc;
+    min_dist=0;
+    min_dist_trimmed=0;
 }
 
 template <typename T>
 BKTree<T>::BKTree() {
     root=0;
     node_count=0;
+    min_dist=0;
+    min_dist_trimmed=0;
 }
 
 template <typename T>
@@ -116,4 +133,29 @@ int BKTree<T>::size() const {
     return node_count;
 }
 
+template <typename T>
+void BKTree<T>::set_min_distance(int full, int trimmed) {
+    min_dist=full;
+    min_dist_trimmed=trimmed;
+}
+
+template <typename T>
+int BKTree<T>::get_min_distance(bool remove_last) const {
+    return remove_last ? min_dist_trimmed : min_dist;
+}
+
+// Largest mismatch cutoff for which a query can be within the cutoff of
+// at most one entry, so no tie is possible. -1 if it is not known.
+template <typename T>
+int BKTree<T>::safe_cutoff(bool remove_last) const {
+    int dist = get_min_distance(remove_last);
+    if (dist <= 0) {
+        return -1;
+    }
+    return (dist - 1) / 2;
+}
+
+// Version 1 added the minimum distances.
+BOOST_CLASS_VERSION(BKTree<std::string>, 1)
+
 #endif
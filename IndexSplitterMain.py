@@ -15,6 +15,9 @@ parser.add_argument('--indir', '-i', dest = 'indir', type = str, required = True
 parser.add_argument('--outdir', '-o', dest = 'outdir', type = str, required = True, help = "Output directory")
 parser.add_argument('--dict_file', '-d', dest = 'dictfile', type = str, required = True, help = "p7 index dict file")
 parser.add_argument('--no_qsub', dest = 'use_qsub', action = 'store_false', default = True, help = 'Does not submit qsub jobs.' )
+parser.add_argument('--batch', dest = 'batch', action = 'store_true', default = False, help = 'Submits one index_splitter job for all the prefixes, with a shared dictionary.' )
+parser.add_argument('--threads', dest = 'threads', type = int, default = 8, help = "Prefixes split at the same time by the batch job")
+parser.add_argument('--memory', dest = 'memory', type = int, default = 16, help = "Memory of each job in GB")
 
 args = parser.parse_args()
 
@@ -22,6 +25,9 @@ indir = args.indir
 outdir = args.outdir
 dictfile = args.dictfile
 use_qsub = args.use_qsub
+batch = args.batch
+threads = args.threads
+memory = args.memory
 
 ldelim = '/'
 
@@ -63,6 +69,20 @@ def refine_gz_file(gz_file):
         return gz_file
 
 
+if batch:
+    # index_splitter finds the same prefixes in indir and writes the same
+    # per prefix outputs and logs; the buffer memory is split between the
+    # prefixes running at the same time.
+    allowed_mb = memory * 1024 // (threads + 1)
+    out_log = outdir + ldelim + "index_bcsplit_batch_out.txt"
+    err_log = outdir + ldelim + "index_bcsplit_batch_err.txt"
+    job_str = index_split_cpp + " -d " + dictfile + " --indir " + indir + " --threads " + \
+        str(threads) + " --allowed-mb " + str(allowed_mb) + " -o " + outdir + \
+        " 1> " + out_log + " 2> " + err_log + "\n"
+    print("job_str: " + job_str)
+    jfile.write(job_str)
+    prefix_set = set()
+
 for prefix in prefix_set:
     parts = prefix.split("_")
     lane = parts[0]
@@ -98,7 +118,7 @@ if use_qsub and os.path.exists(UGER_cbp_dir):
 joblist_cmd = UGER_cbp + " --cmds_file " + joblist_path + \
                                 " --batch_size 1" + \
                                 " --queue long" + \
-                                " --memory 16" + \
+                                " --memory " + str(memory) + \
                                 " --tracking_dir " + UGER_cbp_dir + \
                                 " --project_name broad --bash_header /broad/IDP-Dx_work/nirmalya/bash_header"
 
@@ -0,0 +1,423 @@
+#ifndef _BAM_READER_HPP
+#define _BAM_READER_HPP
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <future>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include "bam_writer.hpp"
+#include "fastq_reader.hpp"
+
+// Unaligned BAM input. The read pairs of the file are handed to the
+// engines as FASTQ lines through fastq_readers, one for read 1, one for
+// read 2 and one for the index read, which comes from the BC and QT tags.
+// The BGZF blocks are inflated ahead by the threads of a bgzf_pool.
+
+// The bytes of a BGZF file, read one block ahead per pool thread or so.
+class bgzf_input {
+    public:
+    bgzf_input(const std::string& path, int threads) : path(path), pool(threads, 0) {
+        file.open(path, std::ios_base::in | std::ios_base::binary);
+        if (!file) {
+            throw std::invalid_argument("Could not open " + path + ".");
+        }
+        fill();
+    }
+
+    // Reads n bytes to dst; false at the end of the file, if nothing of
+    // them is there.
+    bool read(char* dst, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            if (pos == block.size()) {
+                if (pending.empty()) {
+                    if (done > 0) {
+                        throw std::invalid_argument(path + " ends in the middle of a record.");
+                    }
+                    return false;
+                }
+                try {
+                    block = pending.front().get();
+                } catch (const std::invalid_argument& e) {
+                    throw std::invalid_argument(path + ": " + e.what());
+                }
+                pending.pop_front();
+                pos = 0;
+                fill();
+                continue;
+            }
+            size_t take = std::min(n - done, block.size() - pos);
+            memcpy(dst + done, block.data() + pos, take);
+            pos += take;
+            done += take;
+        }
+        return true;
+    }
+
+    // Compressed bytes read from the file so far
+    unsigned long file_pos() const {
+        return compressed_pos;
+    }
+
+    private:
+    void fill() {
+        size_t in_flight = 2 * pool.threads() + 1;
+        std::string raw;
+        while (!at_end && pending.size() < in_flight) {
+            if (!read_block(raw)) {
+                at_end = true;
+                break;
+            }
+            pending.push_back(pool.inflate(std::move(raw)));
+            raw = std::string();
+        }
+    }
+
+    // One whole block, its size from the BC field of the gzip header.
+    bool read_block(std::string& raw) {
+        raw.resize(12);
+        file.read(&raw[0], 12);
+        if (file.gcount() == 0) {
+            return false;
+        }
+        if (file.gcount() != 12 || (unsigned char) raw[0] != 31 ||
+            (unsigned char) raw[1] != 139 || ((unsigned char) raw[3] & 4) == 0) {
+            throw std::invalid_argument(path + " is not a BGZF file.");
+        }
+        size_t xlen = bgzf_pool::get_le(raw, 10, 2);
+        raw.resize(12 + xlen);
+        file.read(&raw[12], xlen);
+        size_t bsize = 0;
+        for (size_t i = 12; i + 4 <= raw.size(); ) {
+            size_t slen = bgzf_pool::get_le(raw, i + 2, 2);
+            if (raw[i] == 'B' && raw[i + 1] == 'C' && slen == 2 && i + 6 <= raw.size()) {
+                bsize = bgzf_pool::get_le(raw, i + 4, 2) + 1;
+            }
+            i += 4 + slen;
+        }
+        if (!file || bsize < raw.size() + 8) {
+            throw std::invalid_argument(path + " is not a BGZF file.");
+        }
+        size_t head = raw.size();
+        raw.resize(bsize);
+        file.read(&raw[head], bsize - head);
+        if (!file) {
+            throw std::invalid_argument(path + " ends in the middle of a BGZF block.");
+        }
+        compressed_pos += bsize;
+        return true;
+    }
+
+    std::string path;
+    bgzf_pool pool;
+    std::ifstream file;
+    std::deque<std::future<std::string>> pending;
+    std::string block;
+    size_t pos = 0;
+    bool at_end = false;
+    unsigned long compressed_pos = 0;
+};
+
+// One read of a BAM file. The quality is in FASTQ text, and of the tags
+// only the string (Z) ones are kept.
+struct bam_read {
+    std::string name;
+    std::string seq;
+    std::string qual;
+    uint16_t flag = 0;
+    std::vector<std::pair<std::string, std::string>> tags;
+
+    const std::string* tag(const char* key) const {
+        for (auto const& t : tags) {
+            if (t.first.compare(key) == 0) {
+                return &t.second;
+            }
+        }
+        return NULL;
+    }
+};
+
+// The records of a BAM file after its header.
+class bam_input {
+    public:
+    bam_input(const std::string& path, int threads) : path(path), in(path, threads) {
+        char magic[4];
+        if (!in.read(magic, 4) || memcmp(magic, "BAM\1", 4) != 0) {
+            throw std::invalid_argument(path + " is not a BAM file.");
+        }
+        uint32_t text_len = get_u32();
+        skip(text_len);
+        uint32_t n_ref = get_u32();
+        for (uint32_t i = 0; i < n_ref; i++) {
+            skip(get_u32() + 4);
+        }
+    }
+
+    // The next record, false at the end of the file.
+    bool next(bam_read& read) {
+        char size_bytes[4];
+        if (!in.read(size_bytes, 4)) {
+            return false;
+        }
+        record.resize(bgzf_pool::get_le(std::string(size_bytes, 4), 0, 4));
+        if (record.size() < 32) {
+            throw std::invalid_argument(path + " has a record too short for BAM.");
+        }
+        if (!in.read(&record[0], record.size())) {
+            throw std::invalid_argument(path + " ends in the middle of a record.");
+        }
+
+        size_t name_len = get(8, 1);
+        size_t n_cigar = get(12, 2);
+        read.flag = get(14, 2);
+        size_t seq_len = get(16, 4);
+        size_t p = 32;
+        check(p + name_len + 4 * n_cigar + (seq_len + 1) / 2 + seq_len);
+        read.name.assign(record, p, name_len > 0 ? name_len - 1 : 0);
+        p += name_len + 4 * n_cigar;
+
+        static const char letters[] = "=ACMGRSVTWYHKDBN";
+        read.seq.resize(seq_len);
+        for (size_t i = 0; i < seq_len; i++) {
+            unsigned char packed = record[p + i / 2];
+            read.seq[i] = letters[i % 2 == 0 ? packed >> 4 : packed & 15];
+        }
+        p += (seq_len + 1) / 2;
+        // A missing quality (0xff) is given as Q1, as samtools fastq does.
+        read.qual.resize(seq_len);
+        bool no_qual = seq_len > 0 && (unsigned char) record[p] == 0xff;
+        for (size_t i = 0; i < seq_len; i++) {
+            read.qual[i] = no_qual ? '"' : (char) ((unsigned char) record[p + i] + 33);
+        }
+        p += seq_len;
+
+        read.tags.clear();
+        while (p + 3 <= record.size()) {
+            std::string key = record.substr(p, 2);
+            char type = record[p + 2];
+            p += 3;
+            if (type == 'Z' || type == 'H') {
+                size_t end = record.find('\0', p);
+                if (end == std::string::npos) {
+                    throw std::invalid_argument(path + " has an unterminated " + key + " tag.");
+                }
+                if (type == 'Z') {
+                    read.tags.emplace_back(key, record.substr(p, end - p));
+                }
+                p = end + 1;
+            } else if (type == 'B') {
+                check(p + 5);
+                p += 5 + value_size(record[p], key) * get(p + 1, 4);
+            } else {
+                p += value_size(type, key);
+            }
+        }
+
+        // A read stored reverse complemented is turned back as sequenced.
+        if (read.flag & 16) {
+            std::reverse(read.seq.begin(), read.seq.end());
+            std::reverse(read.qual.begin(), read.qual.end());
+            for (auto& base : read.seq) {
+                base = complement(base);
+            }
+        }
+        return true;
+    }
+
+    unsigned long file_pos() const {
+        return in.file_pos();
+    }
+
+    const std::string& get_path() const {
+        return path;
+    }
+
+    private:
+    uint32_t get_u32() {
+        char bytes[4];
+        if (!in.read(bytes, 4)) {
+            throw std::invalid_argument(path + " has a truncated BAM header.");
+        }
+        return bgzf_pool::get_le(std::string(bytes, 4), 0, 4);
+    }
+
+    void skip(size_t n) {
+        std::string rest(n, '\0');
+        if (n > 0 && !in.read(&rest[0], n)) {
+            throw std::invalid_argument(path + " has a truncated BAM header.");
+        }
+    }
+
+    uint64_t get(size_t pos, int bytes) const {
+        return bgzf_pool::get_le(record, pos, bytes);
+    }
+
+    void check(size_t end) const {
+        if (end > record.size()) {
+            throw std::invalid_argument(path + " has a record longer than its size.");
+        }
+    }
+
+    size_t value_size(char type, const std::string& key) const {
+        switch (type) {
+            case 'A': case 'c': case 'C': return 1;
+            case 's': case 'S': return 2;
+            case 'i': case 'I': case 'f': return 4;
+        }
+        throw std::invalid_argument(path + " has a " + key + " tag of unknown type.");
+    }
+
+    static char complement(char base) {
+        switch (base) {
+            case 'A': return 'T';
+            case 'C': return 'G';
+            case 'G': return 'C';
+            case 'T': return 'A';
+        }
+        return base;
+    }
+
+    std::string path;
+    bgzf_input in;
+    std::string record;
+};
+
+// The read pairs of a BAM file, read 1 followed by its read 2 as
+// bam_writer writes them (or samtools collate), spread over the lines of
+// the readers opened on it. Each read pair is decoded once, and its lines
+// wait in the queue of every open reader until that reader takes them.
+class bam_pairs {
+    public:
+    enum channel {read1, read2, index};
+
+    bam_pairs(const std::string& path, int threads) : input(path, threads) {
+    }
+
+    bool getline(channel ch, std::string& line) {
+        std::deque<std::string>& queue = queues[ch];
+        if (queue.empty() && !next_pair()) {
+            return false;
+        }
+        line = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+
+    unsigned long file_pos() const {
+        return input.file_pos();
+    }
+
+    void open(channel ch) {
+        is_open[ch] = true;
+    }
+
+    private:
+    bool next_pair() {
+        if (!next_primary(r1)) {
+            return false;
+        }
+        if (!next_primary(r2) || (r1.flag & 0x40) == 0 || (r2.flag & 0x80) == 0 ||
+            r1.name.compare(r2.name) != 0) {
+            throw std::invalid_argument(input.get_path() + " is not read pairs one after"
+                " the other, at " + r1.name + ".");
+        }
+        const std::string* bc = r1.tag("BC");
+        if (is_open[read1]) {
+            push(read1, header(r1, bc, '1'), r1.seq, r1.qual);
+        }
+        if (is_open[read2]) {
+            push(read2, header(r2, bc, '2'), r2.seq, r2.qual);
+        }
+        if (is_open[index]) {
+            if (bc == NULL) {
+                throw std::invalid_argument(r1.name + " in " + input.get_path() +
+                    " has no BC tag for the index.");
+            }
+            const std::string* qt = r1.tag("QT");
+            push(index, header(r1, bc, '1'), *bc,
+                qt != NULL && qt->size() == bc->size() ? *qt : std::string(bc->size(), '"'));
+        }
+        return true;
+    }
+
+    // Secondary and supplementary records repeat a read.
+    bool next_primary(bam_read& read) {
+        while (input.next(read)) {
+            if ((read.flag & 0x900) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The Illumina header the read would have had, with the index from BC.
+    static std::string header(const bam_read& read, const std::string* bc, char mate) {
+        std::string text = "@" + read.name;
+        if (bc != NULL) {
+            text += std::string(" ") + mate + ((read.flag & 0x200) ? ":Y:0:" : ":N:0:") + *bc;
+        }
+        return text;
+    }
+
+    void push(channel ch, std::string&& head, const std::string& seq, const std::string& qual) {
+        std::deque<std::string>& queue = queues[ch];
+        queue.push_back(std::move(head));
+        queue.push_back(seq);
+        queue.push_back("+");
+        queue.push_back(qual);
+    }
+
+    bam_input input;
+    bam_read r1;
+    bam_read r2;
+    std::deque<std::string> queues[3];
+    bool is_open[3] = {false, false, false};
+};
+
+class bam_channel : public record_source {
+    public:
+    bam_channel(std::shared_ptr<bam_pairs> pairs, bam_pairs::channel ch, bool has_pos)
+        : pairs(pairs), ch(ch), has_pos(has_pos) {
+
+        pairs->open(ch);
+    }
+
+    bool getline(std::string& line) {
+        return pairs->getline(ch, line);
+    }
+
+    unsigned long file_pos() {
+        return has_pos ? pairs->file_pos() : 0;
+    }
+
+    private:
+    std::shared_ptr<bam_pairs> pairs;
+    bam_pairs::channel ch;
+    bool has_pos;
+};
+
+// A reader per channel, in the order given. The file position is told by
+// the first reader alone, so that a sum over the readers counts it once.
+inline std::vector<std::unique_ptr<fastq_reader>> open_bam_reads(const std::string& path,
+    int threads, const std::vector<bam_pairs::channel>& channels) {
+
+    auto pairs = std::make_shared<bam_pairs>(path, threads);
+    std::vector<std::unique_ptr<fastq_reader>> readers;
+    for (size_t i = 0; i < channels.size(); i++) {
+        std::shared_ptr<record_source> records =
+            std::make_shared<bam_channel>(pairs, channels[i], i == 0);
+        readers.emplace_back(new fastq_reader(path, records));
+    }
+    return readers;
+}
+
+inline bool is_bam_path(const std::string& path) {
+    return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bam") == 0;
+}
+#endif
@@ -0,0 +1,363 @@
+#ifndef _BAM_WRITER_HPP
+#define _BAM_WRITER_HPP
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <stdexcept>
+#include <cstdint>
+#include <zlib.h>
+
+// Unaligned BAM output. The records are encoded by bam_record into a byte
+// buffer, and a bam_writer cuts what it is given into BGZF blocks, which
+// the threads of a bgzf_pool deflate while the splitting goes on.
+
+// Threads that deflate BGZF blocks, shared by all the bam_writers of a run,
+// or inflate the blocks of a BAM input. Without threads a block is done
+// right away by the caller.
+class bgzf_pool {
+    public:
+    bgzf_pool(int threads, int level) : level(level) {
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~bgzf_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // The whole BGZF block of data, at most max_input bytes.
+    std::future<std::string> submit(std::string&& data) {
+        return enqueue([this, data = std::move(data)]() { return deflate_block(data, level); });
+    }
+
+    // A whole BGZF block as read from the file; the future has its data.
+    std::future<std::string> inflate(std::string&& block) {
+        return enqueue([block = std::move(block)]() { return inflate_block(block); });
+    }
+
+    size_t threads() const {
+        return workers.size();
+    }
+
+    // BGZF blocks hold up to 64 KB of compressed data; this much input
+    // always fits, stored if need be.
+    static const size_t max_input = 0xff00;
+
+    static std::string deflate_block(const std::string& data, int level) {
+        std::string block = deflate_raw(data, level);
+        if (block.size() > 65536 - 26) {
+            block = deflate_raw(data, 0);
+        }
+        std::string out;
+        out.reserve(block.size() + 26);
+        const unsigned char head[] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+        out.append((const char*) head, sizeof(head));
+        put_le(out, block.size() + 25, 2);
+        out += block;
+        put_le(out, crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data.data(), data.size()), 4);
+        put_le(out, data.size(), 4);
+        return out;
+    }
+
+    // The empty block that marks the end of a BGZF file, byte for byte the
+    // one readers look for.
+    static std::string eof_block() {
+        const unsigned char eof[] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+            27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        return std::string((const char*) eof, sizeof(eof));
+    }
+
+    static std::string inflate_block(const std::string& block) {
+        size_t xlen = get_le(block, 10, 2);
+        if (block.size() < 12 + xlen + 8) {
+            throw std::invalid_argument("Truncated BGZF block.");
+        }
+        uint32_t crc = get_le(block, block.size() - 8, 4);
+        std::string out(get_le(block, block.size() - 4, 4), '\0');
+        z_stream zs = z_stream();
+        if (inflateInit2(&zs, -15) != Z_OK) {
+            throw std::runtime_error("Could not set up inflate.");
+        }
+        zs.next_in = (Bytef*) block.data() + 12 + xlen;
+        zs.avail_in = block.size() - 12 - xlen - 8;
+        zs.next_out = (Bytef*) &out[0];
+        zs.avail_out = out.size();
+        int ret = ::inflate(&zs, Z_FINISH);
+        size_t total = zs.total_out;
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END || total != out.size() ||
+            crc32(crc32(0L, Z_NULL, 0), (const Bytef*) out.data(), out.size()) != crc) {
+            throw std::invalid_argument("Corrupt BGZF block.");
+        }
+        return out;
+    }
+
+    static uint64_t get_le(const std::string& in, size_t pos, int bytes) {
+        uint64_t value = 0;
+        for (int i = bytes - 1; i >= 0; i--) {
+            value = (value << 8) | (unsigned char) in[pos + i];
+        }
+        return value;
+    }
+
+    static void put_le(std::string& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            out += (char) ((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    private:
+    std::future<std::string> enqueue(std::function<std::string()> work) {
+        auto task = std::make_shared<std::packaged_task<std::string()>>(std::move(work));
+        std::future<std::string> result = task->get_future();
+        if (workers.empty()) {
+            (*task)();
+            return result;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back([task]() { (*task)(); });
+        }
+        cond.notify_one();
+        return result;
+    }
+
+    static std::string deflate_raw(const std::string& data, int level) {
+        z_stream zs = z_stream();
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Could not set up deflate.");
+        }
+        std::string out(deflateBound(&zs, data.size()), '\0');
+        zs.next_in = (Bytef*) data.data();
+        zs.avail_in = data.size();
+        zs.next_out = (Bytef*) &out[0];
+        zs.avail_out = out.size();
+        int ret = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END) {
+            throw std::runtime_error("Could not deflate a BGZF block.");
+        }
+        return out;
+    }
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cond.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    int level;
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+};
+
+// Appends the BAM record of one unaligned read to out. The name is the
+// FASTQ header up to the first space, without the @ and a /1 or /2; tags
+// are SAM Z (string) tags, e.g. {"BC", barcode}.
+inline void bam_record(std::string& out, const std::string& header, const std::string& seq,
+    const std::string& qual, uint16_t flag,
+    const std::vector<std::pair<const char*, std::string>>& tags) {
+
+    size_t name_start = header.size() > 0 && header[0] == '@' ? 1 : 0;
+    size_t name_end = header.find_first_of(" \t", name_start);
+    if (name_end == std::string::npos) {
+        name_end = header.size();
+    }
+    if (name_end - name_start > 2 && header[name_end - 2] == '/' &&
+        (header[name_end - 1] == '1' || header[name_end - 1] == '2')) {
+        name_end -= 2;
+    }
+    size_t name_len = name_end - name_start;
+    if (name_len > 254) {
+        throw std::invalid_argument("Read name longer than BAM allows: " + header);
+    }
+    if (qual.size() != seq.size()) {
+        throw std::invalid_argument("Sequence and quality differ in length for " + header);
+    }
+
+    size_t tags_len = 0;
+    for (auto const& tag : tags) {
+        tags_len += 3 + tag.second.size() + 1;
+    }
+    size_t block_size = 32 + name_len + 1 + (seq.size() + 1) / 2 + seq.size() + tags_len;
+    out.reserve(out.size() + block_size + 4);
+    bgzf_pool::put_le(out, block_size, 4);
+    bgzf_pool::put_le(out, 0xffffffff, 4);    // refID
+    bgzf_pool::put_le(out, 0xffffffff, 4);    // pos
+    bgzf_pool::put_le(out, name_len + 1, 1);
+    bgzf_pool::put_le(out, 0, 1);             // mapq
+    bgzf_pool::put_le(out, 4680, 2);          // bin of an unplaced read
+    bgzf_pool::put_le(out, 0, 2);             // n_cigar_op
+    bgzf_pool::put_le(out, flag, 2);
+    bgzf_pool::put_le(out, seq.size(), 4);
+    bgzf_pool::put_le(out, 0xffffffff, 4);    // next_refID
+    bgzf_pool::put_le(out, 0xffffffff, 4);    // next_pos
+    bgzf_pool::put_le(out, 0, 4);             // tlen
+    out.append(header, name_start, name_len);
+    out += '\0';
+
+    // Two bases a byte in the =ACMGRSVTWYHKDBN code, anything else is N.
+    static const std::vector<unsigned char> code = []() {
+        std::vector<unsigned char> table(256, 15);
+        const std::string letters = "=ACMGRSVTWYHKDBN";
+        for (size_t i = 0; i < letters.size(); i++) {
+            table[(unsigned char) letters[i]] = i;
+            table[(unsigned char) tolower(letters[i])] = i;
+        }
+        return table;
+    }();
+    for (size_t i = 0; i < seq.size(); i += 2) {
+        unsigned char packed = code[(unsigned char) seq[i]] << 4;
+        if (i + 1 < seq.size()) {
+            packed |= code[(unsigned char) seq[i + 1]];
+        }
+        out += (char) packed;
+    }
+    for (char q : qual) {
+        out += (char) (q - 33);
+    }
+    for (auto const& tag : tags) {
+        out.append(tag.first, 2);
+        out += 'Z';
+        out += tag.second;
+        out += '\0';
+    }
+}
+
+// One BAM file, given its records encoded by bam_record. The header has no
+// references, as suits unaligned reads. Between two flushes the writer
+// keeps neither a buffer nor the file open, like the FASTQ writers, so a
+// run with many barcodes is not held back by the descriptor limit. A
+// flush ends the block in progress; a BGZF file is a series of blocks of
+// any size, so a short one in the middle is fine.
+class bam_writer {
+    public:
+    bam_writer(const std::string& path, bgzf_pool& pool, const std::string& header_text)
+        : path(path), pool(pool) {
+
+        open(std::ios_base::trunc);
+        std::string head = "BAM\1";
+        bgzf_pool::put_le(head, header_text.size(), 4);
+        head += header_text;
+        bgzf_pool::put_le(head, 0, 4);
+        write(head);
+    }
+
+    ~bam_writer() {
+        if (!closed) {
+            try {
+                close();
+            } catch (...) {
+            }
+        }
+    }
+
+    void write(const std::string& records) {
+        if (!file.is_open()) {
+            open(std::ios_base::app);
+        }
+        size_t pos = 0;
+        while (pos < records.size()) {
+            size_t take = std::min(records.size() - pos, bgzf_pool::max_input - buffer.size());
+            buffer.append(records, pos, take);
+            pos += take;
+            if (buffer.size() == bgzf_pool::max_input) {
+                submit();
+            }
+        }
+    }
+
+    // Writes what was given so far and closes the file until the next write.
+    void flush() {
+        if (!buffer.empty()) {
+            submit();
+        }
+        while (!pending.empty()) {
+            write_front();
+        }
+        std::string().swap(buffer);
+        if (file.is_open()) {
+            file.close();
+            if (!file) {
+                throw std::invalid_argument("Could not write " + path + ".");
+            }
+        }
+    }
+
+    // Writes the last block and the end of file marker.
+    void close() {
+        flush();
+        open(std::ios_base::app);
+        file << bgzf_pool::eof_block();
+        closed = true;
+        file.close();
+        if (!file) {
+            throw std::invalid_argument("Could not write " + path + ".");
+        }
+    }
+
+    private:
+    void open(std::ios_base::openmode mode) {
+        file.open(path, std::ios_base::out | std::ios_base::binary | mode);
+        if (!file) {
+            throw std::invalid_argument("Could not open " + path + ".");
+        }
+    }
+
+    // Blocks go to the file in order, once deflated. A few blocks per
+    // thread may be in flight before the writer waits.
+    void submit() {
+        pending.push_back(pool.submit(std::move(buffer)));
+        buffer.clear();
+        buffer.reserve(bgzf_pool::max_input);
+        size_t in_flight = 2 * pool.threads() + 1;
+        while (!pending.empty() && (pending.size() > in_flight ||
+            pending.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+            write_front();
+        }
+    }
+
+    void write_front() {
+        file << pending.front().get();
+        pending.pop_front();
+    }
+
+    std::string path;
+    bgzf_pool& pool;
+    std::ofstream file;
+    std::string buffer;
+    std::deque<std::future<std::string>> pending;
+    bool closed = false;
+};
+#endif
@@ -8,9 +8,28 @@
 #include <set>
 #include <cctype>
 #include <memory>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <algorithm>
 
 #include "BKTree.h"
 #include "fastq_reader.hpp"
+#include "quality_matcher.hpp"
+#include "packed_barcode.hpp"
+#include "tree_match.hpp"
+#include "whitelist_index.hpp"
+#include "space_saving.hpp"
+#include "run_metrics.hpp"
+#include "progress_reporter.hpp"
+#include "stage_timer.hpp"
+#include "trace_recorder.hpp"
+#include "lane_reader.hpp"
+#include "shard_reader.hpp"
+#include "stream_output.hpp"
+#include "bam_writer.hpp"
+#include "bam_reader.hpp"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -23,6 +42,7 @@ namespace po = boost::program_options;
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <dirent.h>
 
 struct classcomp {
 	bool operator() (const double lhs, const double rhs) const {
@@ -30,6 +50,34 @@ struct classcomp {
 	}
 };
 
+// A read pair and what the search found for its barcode
+struct read_pair {
+	// The words starting with lword is for read 1
+	std::string lword1;
+	std::string lword2;
+	std::string lword3;
+	std::string lword4;
+
+	// The words starting with rword is for read 2
+	std::string rword1;
+	std::string rword2;
+	std::string rword3;
+	std::string rword4;
+
+	std::string barcode_str;
+	std::string umi_str;
+	// rword1 with the UMI, as written
+	std::string rword1A;
+	packed_barcode packed_str;
+	bool n_rejected = false;
+	bool sampled_out = false;
+
+	int smallest_dist;
+	std::string smallest_barcode;
+	int smallest_count;
+	bool qual_rescued;
+};
+
 class bc_splitter {
 
 	public:
@@ -44,9 +92,39 @@ class bc_splitter {
     	unsigned long totalcap);	
 	void writeMapsToFile();
 	void split_engine();
+	static bool read_pair_from(std::vector<std::unique_ptr<fastq_reader>>& files,
+		read_pair& rec);
+	void extract_barcode(read_pair& rec) const;
+	void match_barcode(read_pair& rec) const;
+	void add_umi(read_pair& rec) const;
+	unsigned long buffer_bam(const read_pair& rec, const std::string& out_barcode);
+	std::string bam_header(const std::string& out_barcode) const;
+	void open_bam(const std::string& out_barcode);
+	void discover_engine();
+	void merge_engine();
+	void write_counters(std::ostream& counters);
+	void read_counters(std::istream& counters);
+	std::string checkpoint_path() const;
+	std::vector<std::string> output_files(const std::string& barcode) const;
+	void write_checkpoint(unsigned long reads, std::vector<std::unique_ptr<fastq_reader>>& files,
+		const std::mt19937_64& rng);
+	unsigned long resume_checkpoint(std::vector<std::unique_ptr<fastq_reader>>& files,
+		std::mt19937_64& rng);
+	std::string shard_dir(int index, int count) const;
+	bool is_discovery() const;
+	bool is_merge() const;
+	bool is_count_only() const;
 	void write_log();
+	void write_metrics(unsigned long total_reads);
+	void publish_progress(unsigned long reads, std::vector<fastq_reader*> readers);
+	void publish_progress(unsigned long reads, unsigned long input_bytes,
+		unsigned long input_file_pos);
+	void write_top_unmatched(std::ofstream& log_freq, unsigned long total_reads);
+	void nearest_search(const std::set<std::string>& nodes, const std::string& query,
+		std::string& nearest, int& nearest_dist, int& ties);
 	BKTree<std::string>& getTree();
 	void initialize();
+	void initialize_whitelist();
 	void print_help();
 	bool isAlpha(const std::string &str);
 	bool isNumber(const std::string& str);
@@ -54,6 +132,8 @@ class bc_splitter {
 	bool load_with_barcode_indices(const std::string& bc_all_file, 
 		const std::string& bc_used_file);
     bool file_exists (const std::string& name);
+	std::string tag_header(const std::string& header, const std::string& tag);
+	void write_barcode_counts();
     void create_other_files();
 
 	private:
@@ -62,6 +142,9 @@ class bc_splitter {
 	std::string dict_file;
 	std::string file1_str;
 	std::string file2_str;
+	// The lanes, from the lists and patterns in file1_str and file2_str
+	std::vector<std::string> file1_list;
+	std::vector<std::string> file2_list;
 	std::string prefix_str;
 	std::string outdirpath;
 	int barcode_start;
@@ -80,6 +163,8 @@ class bc_splitter {
 	std::map<std::string, unsigned long> zero_dist_map;
 	std::map<std::string, unsigned long> one_dist_map;
 	std::map<std::string, unsigned long> higher_dist_map;
+	// Matches that only --qual-assign made
+	std::map<std::string, unsigned long> rescued_map;
     BKTree<std::string> tree;
 	po::options_description desc;
 	std::map<int, int> distmap;
@@ -91,11 +176,104 @@ class bc_splitter {
 	unsigned long  match_total = 0;
 	unsigned long ambiguous_total = 0;
 	unsigned long no_match_total = 0;
+	unsigned long qual_rescued_total = 0;
 
 	bool validUmi = false;
 	bool isBcAll = true;
 	bool isHA = false;
 
+	// Quality-aware rescue of ambiguous and no_match reads
+	bool qual_assign = false;
+	double min_posterior;
+	double null_prior;
+	std::unique_ptr<quality_matcher> qmatcher;
+
+	// Handling of N bases in the barcode
+	std::string n_mode;
+	bool n_wildcard = false;
+	int max_n;
+	unsigned long n_rejected_total = 0;
+
+	// Largest cutoff for which the dictionary guarantees no ties
+	int safe_cutoff = -1;
+
+	// Most frequent barcodes among the ambiguous and no_match reads
+	int top_unmatched;
+	int unmatched_capacity;
+	space_saving<std::string> unmatched_sketch;
+
+	// Machine readable metrics next to the frequency log
+	std::string metrics_format;
+	run_metrics metrics;
+	std::set<std::string> output_paths;
+
+	// Live progress on stderr and/or in a status file
+	double progress_interval;
+	std::string status_file;
+	progress_counters progress;
+	std::unique_ptr<progress_reporter> reporter;
+
+	// Wall time per stage of the splitting loop
+	stage_timer timer;
+	unsigned long perf_every;
+
+	// Chrome trace of the run
+	std::string trace_file;
+	std::unique_ptr<trace_recorder> tracer;
+
+	// Large whitelist dictionaries and what to write for them
+	bool use_whitelist = false;
+	whitelist_index whitelist;
+	std::string wl_output;
+
+	// Whitelist free barcode discovery
+	bool discover = false;
+	std::string discover_file;
+	int discover_capacity;
+
+	// Classification and counts only, optionally of part of the input
+	bool count_only = false;
+	unsigned long max_reads;
+	double sample_fraction;
+	unsigned long sample_seed;
+	unsigned long input_reads_total = 0;
+	unsigned long sampled_out_total = 0;
+
+	// Part i/N of the input (index from 0), or the merge of N such parts
+	std::string shard_spec;
+	int shard_index = 0;
+	int shard_count = 0;
+	int merge_shards;
+	std::string shard_base;
+
+	// A checkpoint after every flush, and picking the run up at the last one
+	bool checkpointing = false;
+	bool resume = false;
+
+	// Inputs that are still being written, and flushes by time
+	bool follow = false;
+	std::string follow_sentinel;
+	double follow_timeout;
+	double flush_seconds;
+	std::chrono::steady_clock::time_point last_flush;
+
+	// Barcodes written to FIFOs or commands instead of files
+	std::string stream_file;
+	std::unique_ptr<stream_outputs> streams;
+
+	// One file per barcode, read 1 and read 2 of each pair in turn
+	bool interleaved = false;
+
+	// Unaligned BAM instead of FASTQ, the records of a flush buffered per
+	// barcode already encoded
+	bool bam_output = false;
+	// Both reads from one unaligned BAM file1 instead of two FASTQ files
+	bool bam_input = false;
+	int bam_threads;
+	std::unique_ptr<bgzf_pool> bam_pool;
+	std::map<std::string, std::unique_ptr<bam_writer>> bam_writer_map;
+	std::map<std::string, std::string> bamQueueMap;
+
 };
 
 class my_exception : public std::exception {
@@ -120,18 +298,62 @@ BKTree<std::string>& bc_splitter::getTree() {
 
 
 void bc_splitter::initialize() {
-	std::ifstream iff(dict_file);
-    boost::archive::text_iarchive iar(iff);
+	auto load_start = std::chrono::steady_clock::now();
+
+	unmatched_sketch = space_saving<std::string>(unmatched_capacity);
+
+	if (whitelist_index::is_whitelist_file(dict_file)) {
+		initialize_whitelist();
+	} else {
+		std::ifstream iff(dict_file);
+		boost::archive::text_iarchive iar(iff);
         
-    iar >> tree;
+		iar >> tree;
+
+		safe_cutoff = tree.safe_cutoff();
+		if (safe_cutoff >= 0) {
+			std::cout << "Dictionary minimum distance is " << tree.get_min_distance()
+				<< ", mismatch up to " << safe_cutoff << " cannot be ambiguous.\n";
+		}
+
+		if (qual_assign) {
+			qmatcher = std::make_unique<quality_matcher>(tree.get_nodes(),
+				min_posterior, null_prior);
+		}
+	}
+
+	auto load_end = std::chrono::steady_clock::now();
+	std::chrono::duration<double> load_time = load_end - load_start;
+	metrics.load_seconds = load_time.count();
+	if (tracer) {
+		tracer->complete("load_dictionary", load_start, load_end, dict_file);
+	}
 
 	struct stat st = {0};
 
+	if (!shard_base.empty() && stat(shard_base.c_str(), &st) == -1) {
+		mkdir(shard_base.c_str(), 0755);
+	}
 	if (stat(outdirpath.c_str(), &st) == -1) {
 		mkdir(outdirpath.c_str(), 0755);
 	}
 }
 
+void bc_splitter::initialize_whitelist() {
+	use_whitelist = true;
+	whitelist.load(dict_file);
+	std::cout << "Whitelist with " << whitelist.size() << " barcodes of length "
+		<< whitelist.length() << ".\n";
+	if (whitelist.length() != barcode_size) {
+		throw std::invalid_argument("Barcode size does not match the whitelist.");
+	}
+	if (n_wildcard || qual_assign) {
+		throw std::invalid_argument("Whitelist dictionaries support neither"
+			" --n-mode wildcard nor --qual-assign.");
+	}
+	whitelist.build_seeds(cutoff);
+}
+
 bool bc_splitter::isAlpha(const std::string& str) {
     for(int i = 0; i < str.size(); i++)
         if(!isalpha(str[i]))
@@ -236,8 +458,12 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 	desc.add_options()
 		("help,h", "produce help message")
 		("dict-file,d", po::value<std::string>(&dict_file), "Dictionary file")
-		("file1", po::value<std::string>(&file1_str), "First file")
-		("file2", po::value<std::string>(&file2_str), "Second file")
+		("file1", po::value<std::string>(&file1_str),
+			"First file, or a comma separated list or glob of lane files, or an unaligned"
+			" BAM of both reads. Lanes are read in parallel and their read pairs come out"
+			" 4096 of each lane in turn, not lane after lane")
+		("file2", po::value<std::string>(&file2_str),
+			"Second file, or the lane files in the same order")
 		("prefix,p", po::value<std::string>(&prefix_str), "Prefix string")
 		("outdir,o", po::value<std::string>(&outdirpath), "Output directory")	
 		("type,t", po::value(&ltype)->default_value("allseq"), "Optional allseq/rnatagseq")
@@ -256,6 +482,76 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 			"Optional/Umi size")
 		("allowed-mb", po::value(&allowed_MB)->default_value(2048),
 			"Optional/Estimated memory requirement in MB.")
+		("qual-assign", "Optional/Use base qualities to assign ambiguous and no_match reads")
+		("min-posterior", po::value(&min_posterior)->default_value(0.99),
+			"Optional/Posterior needed for a quality-aware assignment")
+		("null-prior", po::value(&null_prior)->default_value(0.05),
+			"Optional/Prior that a barcode is not in the dictionary")
+		("metrics", po::value(&metrics_format)->default_value("json"),
+			"Optional/Metrics file format: json/tsv/both/none")
+		("progress", po::value(&progress_interval)->default_value(0),
+			"Optional/Print progress to stderr every this many seconds, 0 to turn off")
+		("status-file", po::value(&status_file),
+			"Optional/JSON file rewritten with the progress, every 60 seconds"
+			" unless --progress is given")
+		("stage-timing", "Optional/Print the time spent in each stage of the splitting loop")
+		("perf-counters", "Optional/Print hardware counters for each stage of the splitting loop")
+		("perf-every", po::value(&perf_every)->default_value(64),
+			"Optional/Read the hardware counters through every this many reads")
+		("trace", po::value(&trace_file),
+			"Optional/Write a Chrome trace of the run to this JSON file")
+		("top-unmatched", po::value(&top_unmatched)->default_value(20),
+			"Optional/Unmatched barcodes listed in the log, 0 to turn off")
+		("unmatched-capacity", po::value(&unmatched_capacity)->default_value(4096),
+			"Optional/Distinct unmatched barcodes tracked for that list")
+		("n-mode", po::value(&n_mode)->default_value("mismatch"),
+			"Optional/N in the barcode counts as mismatch/wildcard")
+		("max-n", po::value(&max_n)->default_value(-1),
+			"Optional/Barcodes with more Ns are no_match, default is --mismatch")
+		("wl-output", po::value(&wl_output)->default_value("counts"),
+			"Optional/Output for whitelist dictionaries: counts/tags/files")
+		("discover", po::value(&discover_file),
+			"Optional/Find the barcodes in file1 and write them as dict_builder input")
+		("discover-capacity", po::value(&discover_capacity)->default_value(100000),
+			"Optional/Distinct barcodes tracked while discovering")
+		("count-only", "Optional/Classify and count the reads for the log and metrics,"
+			" write no FASTQ files")
+		("max-reads", po::value(&max_reads)->default_value(0),
+			"Optional/Stop after this many read pairs, 0 for all")
+		("sample-fraction", po::value(&sample_fraction)->default_value(1.0),
+			"Optional/Classify only this random fraction of the read pairs")
+		("sample-seed", po::value(&sample_seed)->default_value(1),
+			"Optional/Seed of the read sampling")
+		("shard", po::value(&shard_spec),
+			"Optional/Split only part i/N of a plain or BGZF input, into"
+			" <outdir>/shard_i_of_N")
+		("merge-shards", po::value(&merge_shards)->default_value(0),
+			"Optional/Concatenate the outputs of the N shards in outdir and"
+			" write the logs of the whole input")
+		("checkpoint", "Optional/Record the position of the run after every flush,"
+			" in <prefix>_checkpoint.txt")
+		("resume", "Optional/Continue from the checkpoint in outdir if there is one,"
+			" implies --checkpoint")
+		("follow", "Optional/Read file1 and file2 while they are being written, waiting"
+			" for more at their end")
+		("follow-sentinel", po::value(&follow_sentinel),
+			"Optional/With --follow, the inputs end once this file exists")
+		("follow-timeout", po::value(&follow_timeout)->default_value(600),
+			"Optional/With --follow, the inputs end after this many seconds without"
+			" new data, 0 to wait for ever")
+		("flush-seconds", po::value(&flush_seconds)->default_value(0),
+			"Optional/Also write out the buffered reads every this many seconds,"
+			" 0 to turn off")
+		("interleaved", "Optional/Write read 1 and read 2 in turn to one"
+			" <prefix>_<barcode>.fastq per barcode")
+		("bam", "Optional/Write an unaligned BAM per barcode instead of FASTQ, with the"
+			" barcode and the UMI in BC/QT and RX/QX tags")
+		("bam-threads", po::value(&bam_threads)->default_value(2),
+			"Optional/Threads that compress the BAM output or inflate a BAM input")
+		("stream", po::value(&stream_file),
+			"Optional/File of <barcode> <target> lines, the reads of these barcodes go"
+			" to the target FIFO (fifo:<path>[,<path2>]) or command instead of files."
+			" Half of --allowed-mb is then kept for what waits to be streamed")
 	;
 
 	po::variables_map vm;
@@ -303,6 +599,74 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 	std::cout << "Barcode-start is set to " << barcode_start << ".\n";
 	std::cout << "Barcode-size is set to " << barcode_size << ".\n";
 
+	boost::to_lower(n_mode);
+	boost::trim(n_mode);
+	if (n_mode.compare("wildcard") == 0) {
+		n_wildcard = true;
+	} else if (n_mode.compare("mismatch") != 0) {
+		std::cout << "Error: Invalid n-mode option.\n";
+		all_set = false;
+	}
+	if (max_n < 0) {
+		max_n = cutoff;
+	}
+	std::cout << "N-mode is set to " << n_mode << ", max N is set to " << max_n << ".\n";
+
+	boost::to_lower(wl_output);
+	boost::trim(wl_output);
+	if (wl_output.compare("counts") != 0 && wl_output.compare("tags") != 0 &&
+		wl_output.compare("files") != 0) {
+		std::cout << "Error: Invalid wl-output option.\n";
+		all_set = false;
+	}
+
+	boost::to_lower(metrics_format);
+	boost::trim(metrics_format);
+	if (metrics_format.compare("json") != 0 && metrics_format.compare("tsv") != 0 &&
+		metrics_format.compare("both") != 0 && metrics_format.compare("none") != 0) {
+		std::cout << "Error: Invalid metrics option.\n";
+		all_set = false;
+	}
+
+	timer = stage_timer(vm.count("stage-timing") > 0);
+	if (!trace_file.empty()) {
+		tracer = std::make_unique<trace_recorder>();
+		tracer->name_thread("split");
+		timer.attach_trace(tracer.get());
+	}
+	if (vm.count("perf-counters")) {
+		std::string perf_error;
+		if (!timer.enable_counters(perf_every, perf_error)) {
+			std::cout << "Performance counters are not available (" << perf_error
+				<< "), going on without them.\n";
+		}
+	}
+
+	if (progress_interval < 0) {
+		std::cout << "Error: Invalid progress interval.\n";
+		all_set = false;
+	}
+
+	count_only = vm.count("count-only");
+	if (count_only) {
+		std::cout << "Count only, no FASTQ files are written.\n";
+	}
+	if (sample_fraction <= 0 || sample_fraction > 1) {
+		std::cout << "Error: The sample fraction must be in (0, 1].\n";
+		all_set = false;
+	} else if (sample_fraction < 1) {
+		std::cout << "Sample fraction is set to " << sample_fraction << ".\n";
+	}
+	if (max_reads > 0) {
+		std::cout << "Max reads is set to " << max_reads << ".\n";
+	}
+
+	qual_assign = vm.count("qual-assign");
+	if (qual_assign) {
+		std::cout << "Quality-aware assignment is on, min posterior " 
+			<< min_posterior << ", null prior " << null_prior << ".\n";
+	}
+
 	int bc_a = vm.count("bc-all");
 	int bc_u = vm.count("bc-used");
 	isHA = vm.count("ha") ;
@@ -345,18 +709,57 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 
 	if (vm.count("file1")) {
 		std::cout << "First fastq file is set to: " << file1_str << ".\n";
-	} else {
+		file1_list = expand_inputs(file1_str);
+	} else if (merge_shards == 0) {
 		all_set = false;
 		std::cout << "Error: First fastq file is not set.\n";
 	}
 
-	if (vm.count("file2")) {
+	// Discovery only reads the first file and needs no dictionary.
+	discover = vm.count("discover");
+	if (discover) {
+		std::cout << "Discovered barcodes go to " << discover_file << ", tracking "
+			<< discover_capacity << " barcodes.\n";
+		return all_set;
+	}
+
+	// A BAM holds read 2 too.
+	bam_input = std::any_of(file1_list.begin(), file1_list.end(), is_bam_path);
+	if (bam_input) {
+		if (file1_list.size() > 1 || vm.count("file2")) {
+			all_set = false;
+			std::cout << "Error: A BAM input is one file with both reads, not lanes"
+				" and not with --file2.\n";
+		} else {
+			std::cout << "Both reads come from the BAM file " << file1_list[0] << ".\n";
+		}
+	} else if (vm.count("file2")) {
 		std::cout << "Second fastq file is set to: " << file2_str << ".\n";
-	} else {
+		file2_list = expand_inputs(file2_str);
+	} else if (merge_shards == 0) {
 		all_set = false;
 		std::cout << "Error: Second fastq file is not set.\n";
 	}
 
+	// A merge only reads the outputs of the shards.
+	if (merge_shards < 0) {
+		all_set = false;
+		std::cout << "Error: Invalid number of shards to merge.\n";
+	} else if (merge_shards > 0) {
+		std::cout << "Merging " << merge_shards << " shards.\n";
+	} else if (all_set && (file1_list.empty() ||
+		(!bam_input && file1_list.size() != file2_list.size()))) {
+		all_set = false;
+		std::cout << "Error: The first and second files are " << file1_list.size()
+			<< " and " << file2_list.size() << " lanes.\n";
+	} else if (file1_list.size() > 1) {
+		std::cout << file1_list.size() << " lanes are read in parallel, 4096 read pairs"
+			" of each in turn:\n";
+		for (size_t i = 0; i < file1_list.size(); i++) {
+			std::cout << "  " << file1_list[i] << " " << file2_list[i] << "\n";
+		}
+	}
+
 
 	if (vm.count("prefix")) {
 		std::cout << "Prefix string is set to: " << prefix_str << ".\n";
@@ -377,10 +780,108 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 		all_set = false;
 		std::cout << "Error: Outdir is not set.\n";
 	}
+
+	// Shard i/N writes to its own directory, for --merge-shards to pick up.
+	if (vm.count("shard")) {
+		char rest;
+		if (sscanf(shard_spec.c_str(), "%d/%d%c", &shard_index, &shard_count, &rest) != 2 ||
+			shard_index < 1 || shard_index > shard_count) {
+			all_set = false;
+			shard_count = 0;
+			std::cout << "Error: Invalid shard " << shard_spec << ", expected i/N.\n";
+		} else if (file1_list.size() > 1 || merge_shards > 0 || bam_input) {
+			all_set = false;
+			shard_count = 0;
+			std::cout << "Error: A shard is part of one lane of FASTQ files, not of a merge,"
+				" a lane list or a BAM.\n";
+		} else {
+			shard_index--;
+			shard_base = outdirpath;
+			outdirpath = outdirpath + "/" + shard_dir(shard_index, shard_count);
+			std::cout << "Shard " << shard_spec << " goes to " << outdirpath << ".\n";
+		}
+	}
+
+	// A checkpoint holds one position per input file, and is taken at a flush.
+	resume = vm.count("resume");
+	checkpointing = resume || vm.count("checkpoint");
+	if (checkpointing) {
+		if (count_only || merge_shards > 0 || file1_list.size() > 1 || bam_input) {
+			all_set = false;
+			std::cout << "Error: Checkpoints are for a run that writes FASTQ files"
+				" from one pair of FASTQ input files.\n";
+		} else if (resume) {
+			std::cout << "Resuming from the checkpoint in " << outdirpath << ", if any.\n";
+		}
+	}
+
+	// The reads of a followed input are written out whenever it runs dry.
+	follow = vm.count("follow") || vm.count("follow-sentinel");
+	if (follow) {
+		if (merge_shards > 0 || shard_count > 0 || file1_list.size() > 1 || bam_input) {
+			all_set = false;
+			std::cout << "Error: --follow reads one pair of FASTQ files, not lanes, a shard"
+				" or a BAM.\n";
+		} else {
+			std::cout << "Following the input files until " << (follow_sentinel.empty() ?
+				std::string("they stop growing") : follow_sentinel + " exists") << ", timeout "
+				<< follow_timeout << " seconds.\n";
+		}
+	}
+	interleaved = vm.count("interleaved");
+	if (interleaved) {
+		std::cout << "Read 1 and read 2 are interleaved in one file per barcode.\n";
+	}
+	bam_output = vm.count("bam");
+	if (bam_output) {
+		if (interleaved || count_only || checkpointing || vm.count("stream") ||
+			vm.count("shard") || merge_shards > 0) {
+			all_set = false;
+			std::cout << "Error: --bam is not for --interleaved, --count-only, --checkpoint,"
+				" --stream or shards.\n";
+		} else if (bam_threads < 0) {
+			all_set = false;
+			std::cout << "Error: Invalid number of BAM threads.\n";
+		} else {
+			std::cout << "Unaligned BAM output, " << bam_threads << " compression threads.\n";
+		}
+	}
+	if (!stream_file.empty()) {
+		if (checkpointing || count_only) {
+			all_set = false;
+			std::cout << "Error: Streamed outputs are not for --checkpoint or --count-only.\n";
+		} else {
+			std::cout << "Streamed outputs are set in " << stream_file << ".\n";
+		}
+	}
+	if (flush_seconds < 0 || follow_timeout < 0) {
+		all_set = false;
+		std::cout << "Error: Invalid flush or follow timeout seconds.\n";
+	}
 	
 	return all_set;
 }
 
+std::string bc_splitter::shard_dir(int index, int count) const {
+	return "shard_" + std::to_string(index + 1) + "_of_" + std::to_string(count);
+}
+
+std::string bc_splitter::checkpoint_path() const {
+	return outdirpath + "/" + prefix_str + "_checkpoint.txt";
+}
+
+// The outputs of a barcode, read 1 and read 2 or the one interleaved file
+std::vector<std::string> bc_splitter::output_files(const std::string& barcode) const {
+	const std::string base = outdirpath + "/" + prefix_str + "_" + barcode;
+	if (bam_output) {
+		return {base + ".bam"};
+	}
+	if (interleaved) {
+		return {base + ".fastq"};
+	}
+	return {base + "_R1.fastq", base + "_R2.fastq"};
+}
+
 int bc_splitter::distance(std::string source, std::string target) {
 
     const int n = source.length();
@@ -456,12 +957,69 @@ bc_splitter::updateMaps(std::string& barcode_str,
 }
 
 void bc_splitter::writeMapsToFile() {
+
+	metrics.flush_count++;
+	last_flush = std::chrono::steady_clock::now();
+	if (totalcap > metrics.peak_buffered_bytes) {
+		metrics.peak_buffered_bytes = totalcap;
+	}
+	progress.flushes.store(metrics.flush_count, std::memory_order_relaxed);
+
+	// A BAM writer ends its block and closes its file at every flush, as the
+	// FASTQ files are closed.
+	for (auto& kv : bamQueueMap) {
+		trace_scope flush_scope(tracer.get(), "flush_barcode", kv.first);
+		if (bam_writer_map.count(kv.first) == 0) {
+			open_bam(kv.first);
+		}
+		bam_writer_map[kv.first]->write(kv.second);
+		bam_writer_map[kv.first]->flush();
+		metrics.output_bytes += kv.second.size();
+		progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+	}
+	bamQueueMap.clear();
 	
 	for (auto& kv : lQueueMap) {
 	    std::string barcode = kv.first;
+	    trace_scope flush_scope(tracer.get(), "flush_barcode", barcode);
 
-        const std::string file1 = outdirpath + "/" + prefix_str + "_" + barcode + "_R1.fastq";
-        const std::string file2 = outdirpath + "/" + prefix_str + "_" + barcode + "_R2.fastq";
+		// Waits only if the streams hold the whole memory budget already
+		if (streams && streams->has(barcode)) {
+			metrics.output_bytes += streams->write(barcode, kv.second, rQueueMap[barcode]);
+			progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+			continue;
+		}
+
+        // Read 1 and read 2 of each pair one after the other, in one file
+        if (interleaved) {
+            const std::string file = output_files(barcode)[0];
+            std::ofstream ofs;
+            if (outfile_set.count(barcode) > 0) {
+                ofs = std::ofstream(file, std::ofstream::out|std::ofstream::app);
+            } else {
+                ofs = std::ofstream(file, std::ofstream::out|std::ofstream::trunc);
+                outfile_set.insert(barcode);
+                output_paths.insert(file);
+            }
+            std::vector<std::unique_ptr<std::string>> & valSet1 = kv.second;
+            std::vector<std::unique_ptr<std::string>> & valSet2 = rQueueMap[barcode];
+            for (size_t i = 0; i < valSet1.size(); i += 4) {
+                for (size_t j = i; j < i + 4; j++) {
+                    ofs << *valSet1[j] << '\n';
+                    metrics.output_bytes += valSet1[j]->size() + 1;
+                }
+                for (size_t j = i; j < i + 4; j++) {
+                    ofs << *valSet2[j] << '\n';
+                    metrics.output_bytes += valSet2[j]->size() + 1;
+                }
+            }
+            ofs.close();
+            progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+            continue;
+        }
+
+        const std::string file1 = output_files(barcode)[0];
+        const std::string file2 = output_files(barcode)[1];
 
         std::ofstream ofs1;
         std::ofstream ofs2;
@@ -473,6 +1031,8 @@ void bc_splitter::writeMapsToFile() {
             ofs1 = std::ofstream(file1, std::ofstream::out|std::ofstream::trunc);
             ofs2 = std::ofstream(file2, std::ofstream::out|std::ofstream::trunc);
             outfile_set.insert(barcode);
+            output_paths.insert(file1);
+            output_paths.insert(file2);
         }
 
         // Dump the content of the two maps to the two files
@@ -485,6 +1045,7 @@ void bc_splitter::writeMapsToFile() {
         for (auto const& kv1 : valSet1) {
  	        std::string val1 = *kv1;
             ofs1 << val1 << '\n';
+            metrics.output_bytes += val1.size() + 1;
         }
 
         ofs1.close();
@@ -492,9 +1053,11 @@ void bc_splitter::writeMapsToFile() {
 		for (auto const& kv2 : valSet2) {
         	std::string val2 = *kv2;
             ofs2 << val2 << '\n';
+            metrics.output_bytes += val2.size() + 1;
         }
 
         ofs2.close();
+        progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
 	}
 
 	lQueueMap.clear();
@@ -502,81 +1065,322 @@ void bc_splitter::writeMapsToFile() {
 
 } 
 
-void bc_splitter::split_engine() {
+bool bc_splitter::read_pair_from(std::vector<std::unique_ptr<fastq_reader>>& files,
+	read_pair& rec) {
 
-	// The words starting with lword is for read 1
-	std::string lword1;
-	std::string lword2;
-	std::string lword3;
-	std::string lword4;
+	fastq_reader& file1 = *files[0];
+	fastq_reader& file2 = *files[1];
+	if (!file1.getline(rec.lword1)) {return false;}
+	if (!file1.getline(rec.lword2)) {return false;}
+	if (!file1.getline(rec.lword3)) {return false;}
+	if (!file1.getline(rec.lword4)) {return false;}
 
-	// The words starting with rword is for read 2
-	std::string rword1;
-	std::string rword2;
-	std::string rword3;
-	std::string rword4;
+	if (!file2.getline(rec.rword1)) {return false;}
+	if (!file2.getline(rec.rword2)) {return false;}
+	if (!file2.getline(rec.rword3)) {return false;}
+	if (!file2.getline(rec.rword4)) {return false;}
+	return true;
+}
+
+void bc_splitter::extract_barcode(read_pair& rec) const {
+	// The barcode stays at the second line of each four lines of first
+	// read file.
+	rec.barcode_str = rec.lword2.substr(barcode_start, barcode_size);	
+	if (validUmi) {
+		rec.umi_str = rec.lword2.substr(umi_start, umi_size);
+	}
+	// Ns are flagged in the packed barcode. Reads with more of them than
+	// we accept never go to the search.
+	// A barcode longer than the packed encoding holds, or cut short by the
+	// end of the read, goes to the tree as a string.
+	int n_count;
+	if (packed_barcode::fits(rec.barcode_str.length())) {
+		rec.packed_str = packed_barcode::encode(rec.barcode_str);
+		n_count = rec.packed_str.n_count();
+	} else {
+		rec.packed_str = packed_barcode();
+		n_count = string_n_count(rec.barcode_str);
+	}
+	rec.n_rejected = n_count > max_n;
+}
+
+// Only reads the dictionary, so the lane threads run it concurrently.
+void bc_splitter::match_barcode(read_pair& rec) const {
+
+	// calculate the minimum distance between the target and references
+
+	rec.smallest_dist = cutoff + 1;
+	rec.smallest_barcode = "JJJJJJ";
+
+	rec.smallest_count = 0;
+	rec.qual_rescued = false;
+
+	if (rec.n_rejected) {
+		return;
+	} else if (use_whitelist) {
+		int wl_idx = whitelist.find_best(rec.packed_str, rec.smallest_dist, rec.smallest_count);
+		if (wl_idx >= 0) {
+			rec.smallest_barcode = whitelist.get_barcode(wl_idx);
+		}
+	} else {
+		match_in_tree(tree, rec.barcode_str, rec.packed_str, cutoff, safe_cutoff, n_wildcard,
+			rec.smallest_dist, rec.smallest_barcode, rec.smallest_count);
+	}
+
+	// A tie or no match by plain distance may still be resolved by
+	// looking at how confident the mismatching base calls are.
+	if (qual_assign && rec.smallest_count != 1) {
+		std::string qual_str = rec.lword4.substr(barcode_start, barcode_size);
+		double posterior = 0;
+		int qidx = qmatcher->assign(rec.barcode_str, qual_str, posterior);
+		// smallest_dist stays that of the search, which the distance
+		// histogram counts; the rescued reads are counted on their own.
+		if (qidx >= 0) {
+			rec.smallest_barcode = qmatcher->get_barcode(qidx);
+			rec.smallest_count = 1;
+			rec.qual_rescued = true;
+		}
+	}
+}
 
+// The read pair as unaligned BAM records. The barcode and the UMI as read,
+// and their base qualities, go in tags instead of the header. Returns the
+// bytes added to the buffer of the barcode.
+unsigned long bc_splitter::buffer_bam(const read_pair& rec, const std::string& out_barcode) {
+	std::string& buffer = bamQueueMap[out_barcode];
+	size_t before = buffer.size();
+	std::vector<std::pair<const char*, std::string>> tags = {
+		{"BC", rec.barcode_str},
+		{"QT", rec.lword4.substr(barcode_start, barcode_size)}
+	};
+	if (validUmi) {
+		tags.push_back({"RX", rec.umi_str});
+		tags.push_back({"QX", rec.lword4.substr(umi_start, umi_size)});
+	}
+	tags.push_back({"RG", prefix_str + "_" + out_barcode});
+	// Paired, both unmapped, first or second of the pair
+	bam_record(buffer, rec.lword1, rec.lword2, rec.lword4, 77, tags);
+	bam_record(buffer, rec.rword1, rec.rword2, rec.rword4, 141, tags);
+	return buffer.size() - before;
+}
+
+std::string bc_splitter::bam_header(const std::string& out_barcode) const {
+	const std::string group = prefix_str + "_" + out_barcode;
+	return "@HD\tVN:1.6\tSO:unsorted\tGO:query\n"
+		"@RG\tID:" + group + "\tSM:" + group + "\tBC:" + out_barcode + "\n"
+		"@PG\tID:bc_splitter\tPN:bc_splitter\n";
+}
+
+void bc_splitter::open_bam(const std::string& out_barcode) {
+	if (!bam_pool) {
+		bam_pool = std::make_unique<bgzf_pool>(bam_threads, Z_DEFAULT_COMPRESSION);
+	}
+	const std::string path = output_files(out_barcode)[0];
+	bam_writer_map[out_barcode] = std::make_unique<bam_writer>(path, *bam_pool,
+		bam_header(out_barcode));
+	outfile_set.insert(out_barcode);
+	output_paths.insert(path);
+}
+
+// Adding umi_string to the output file.	
+void bc_splitter::add_umi(read_pair& rec) const {
+	if (validUmi) {
+
+		// Split the read one, if there is to split
+		boost::regex expr ("(\\S+)\\s*(\\S*)");
+		boost::smatch what;
+		bool res = boost::regex_search(rec.rword1, what, expr);
+		std::string hpart1;
+		std::string hpart2 = "";
+		if (res) {
+			hpart1 = what[1];
+			hpart2 = what[2];
+
+			if (hpart2.compare("") == 0) {	
+				rec.rword1A = hpart1 + ":umi_" + rec.umi_str;
+			} else {
+				rec.rword1A = hpart1 + ":umi_" + rec.umi_str + " " + hpart2;
+			}
+		} else {
+			std::cout << "Problem in the UMI parser " << rec.rword1 << "\n";
+			throw my_exception("Problem in the UMI parser.");
+		}
+	} else {
+		rec.rword1A = rec.rword1;
+	}
+}
+
+void bc_splitter::split_engine() {
 
 	for (int j = 0; j <= cutoff; j++) {
 		distmap[j] = 0;
 	}   
 	const unsigned long MB_SIZE = 1024 * 1024;
 	unsigned long total_allowed = allowed_MB * MB_SIZE;
+	// With streams, half of it holds the buffered reads and half what is
+	// queued for the streams and not written yet.
+	unsigned long stream_allowed = 0;
+	if (!stream_file.empty()) {
+		stream_allowed = total_allowed / 2;
+		total_allowed -= stream_allowed;
+	}
+	// Reads between two updates of the progress counters, minus one
+	const unsigned long PROGRESS_EVERY = 4095;
 
 	//const std::string logfile_detailed = outdirpath + "/logfile_detailed.txt";
 	//std::ofstream log_detailed(logfile_detailed);
 
 	// We shall start reading the first line. The assumption is that second line 
 	// contains the barcode.
-	fastq_reader file1(file1_str);
-	fastq_reader file2(file2_str);
+	auto split_start = std::chrono::steady_clock::now();
+	last_flush = split_start;
+
+	// A read pair is classified when the draw falls below the threshold.
+	std::mt19937_64 sample_rng(sample_seed);
+	bool sampling = sample_fraction < 1;
+	uint64_t sample_threshold = (uint64_t) (sample_fraction * 18446744073709551615.0);
+
+	// Several lanes are read and classified by a thread each, and come
+	// here a chunk of each lane in turn. One lane, or a shard of it, is
+	// read right here. The UMI goes into the header after the barcode tag, so with tags
+	// it is added here.
+	bool tagging = use_whitelist && wl_output.compare("tags") == 0;
+	unsigned long input_file_total = file_bytes(file1_list) + file_bytes(file2_list);
+	std::vector<std::unique_ptr<fastq_reader>> files;
+	std::unique_ptr<lane_reader<read_pair>> lanes;
+	if (!stream_file.empty()) {
+		streams = std::make_unique<stream_outputs>(stream_file, outdirpath + "/" + prefix_str,
+			stream_allowed);
+		std::cout << streams->size() << " barcodes are streamed.\n";
+	}
+	if (file1_list.size() > 1) {
+		std::vector<std::vector<std::string>> lane_files;
+		std::vector<std::mt19937_64> lane_rngs;
+		for (size_t i = 0; i < file1_list.size(); i++) {
+			lane_files.push_back({file1_list[i], file2_list[i]});
+			lane_rngs.emplace_back(sample_seed + i);
+		}
+		lanes = std::make_unique<lane_reader<read_pair>>(lane_files, read_pair_from,
+			[this, lane_rngs, sampling, sample_threshold, tagging](read_pair& rec,
+				size_t lane) mutable {
+				rec.sampled_out = sampling && lane_rngs[lane]() >= sample_threshold;
+				if (!rec.sampled_out) {
+					extract_barcode(rec);
+					match_barcode(rec);
+					if (!count_only && !tagging && !bam_output) {
+						add_umi(rec);
+					}
+				}
+			});
+	} else if (shard_count > 0) {
+		input_file_total = 0;
+		std::vector<shard_range> ranges = plan_shard({file1_list[0], file2_list[0]},
+			shard_index, shard_count);
+		for (int i = 0; i < 2; i++) {
+			std::string& path = i == 0 ? file1_list[0] : file2_list[0];
+			files.emplace_back(new fastq_reader(path, shard_device(path, ranges[i])));
+			input_file_total += ranges[i].end.block - ranges[i].start.block;
+			std::cout << "Shard of " << path << ": " << ranges[i].start.block << ":"
+				<< ranges[i].start.within << " to " << ranges[i].end.block << ":"
+				<< ranges[i].end.within << "\n";
+		}
+	} else if (follow) {
+		// The files grow, so there is no size to tell the progress by.
+		input_file_total = 0;
+		follow_options options;
+		options.sentinel = follow_sentinel;
+		options.timeout = follow_timeout;
+		options.on_wait = [this]() {
+			if (totalcap > 0) {
+				writeMapsToFile();
+				totalcap = 0;
+			}
+		};
+		files.emplace_back(new fastq_reader(file1_list[0], options));
+		files.emplace_back(new fastq_reader(file2_list[0], options));
+	} else if (bam_input) {
+		files = open_bam_reads(file1_list[0], bam_threads, {bam_pairs::read1, bam_pairs::read2});
+	} else {
+		files.emplace_back(new fastq_reader(file1_list[0]));
+		files.emplace_back(new fastq_reader(file2_list[0]));
+	}
 
-	while (file1.getline(lword1)) {
+	// The counters of a resumed run go on from the checkpoint.
+	unsigned long read_count = 0;
+	if (resume) {
+		read_count = resume_checkpoint(files, sample_rng);
+	}
+	double resumed_seconds = metrics.split_seconds;
+	// Only right after a flush are the outputs and the counters in step.
+	auto checkpoint = [&]() {
+		if (checkpointing) {
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - split_start;
+			metrics.split_seconds = resumed_seconds + elapsed.count();
+			write_checkpoint(read_count, files, sample_rng);
+		}
+	};
 
-		if (!file1.getline(lword2)) {break;}
-		if (!file1.getline(lword3)) {break;}
-		if (!file1.getline(lword4)) {break;}
-		
-		if (!file2.getline(rword1)) {break;}
-		if (!file2.getline(rword2)) {break;}
-		if (!file2.getline(rword3)) {break;}
-		if (!file2.getline(rword4)) {break;}
-
-		// The barcode stays at the second line of each four lines of first
-		// read file.
-		std::string barcode_str = lword2.substr(barcode_start, barcode_size);	
-		std::string umi_str;
-		if (validUmi) {
-			umi_str = lword2.substr(umi_start, umi_size);
-		}
-		std::vector<std::string> results;
-		
-		results = tree.find(barcode_str, cutoff);
+	if (progress_interval > 0 || !status_file.empty()) {
+		reporter = std::make_unique<progress_reporter>(progress, "bc_splitter",
+			progress_interval > 0 ? progress_interval : 60, progress_interval > 0,
+			status_file, input_file_total);
+		reporter->start();
+	}
+	auto publish = [&]() {
+		if (lanes) {
+			publish_progress(read_count, lanes->input_bytes(), lanes->input_file_pos());
+		} else {
+			publish_progress(read_count, {files[0].get(), files[1].get()});
+		}
+	};
 
-		// calculate the minimum distance between the target and references
+	timer.start();
 
-		int smallest_dist = cutoff + 1;
-		std::string smallest_barcode = "JJJJJJ";
+	read_pair single;
+	read_pair* rec = &single;
+	while (max_reads == 0 || read_count < max_reads) {
 
-		std::vector<int> dist_vec;
-		for (auto const& val : results) {
-			int ldist = distance(val, barcode_str);
-			if (ldist < smallest_dist) {
-				smallest_dist = ldist;
-				smallest_barcode = val;
-			}
+		if (lanes) {
+			rec = lanes->next();
+			if (rec == NULL) {break;}
+		} else if (!read_pair_from(files, single)) {
+			break;
+		}
 
-			dist_vec.push_back(ldist);
+		timer.lap(STAGE_READ);
+		timer.next_read();
+		read_count++;
+		if (reporter && (read_count & PROGRESS_EVERY) == 0) {
+			publish();
 		}
 
-		int smallest_count = 0;
-		for (auto const& temp_dist : dist_vec) {
-			if (temp_dist == smallest_dist) {
-				smallest_count++;
+		// The lane threads sample and search themselves, with a draw
+		// sequence per lane.
+		if (lanes) {
+			if (rec->sampled_out) {
+				sampled_out_total++;
+				continue;
 			}
+		} else {
+			if (sampling && sample_rng() >= sample_threshold) {
+				sampled_out_total++;
+				continue;
+			}
+			extract_barcode(single);
+			timer.lap(STAGE_EXTRACT);
+			match_barcode(single);
+		}
+		if (rec->n_rejected) {
+			n_rejected_total++;
 		}
+		if (rec->qual_rescued) {
+			qual_rescued_total++;
+		}
+		int smallest_dist = rec->smallest_dist;
+		int smallest_count = rec->smallest_count;
+		const std::string& smallest_barcode = rec->smallest_barcode;
 
-		//log_detailed << "actual_barcode: " << barcode_str << 
+		//log_detailed << "actual_barcode: " << rec->barcode_str << 
 		//	", smallest barcode: " <<  smallest_barcode <<  
 		//	", sallest dist: " << smallest_dist << 
 		//	", smallest_count: " << smallest_count << "\n";
@@ -588,7 +1392,9 @@ void bc_splitter::split_engine() {
 
 		if (smallest_count == 1) {
 			write_barcode = smallest_barcode;
-			if (smallest_dist == 0) {
+			if (rec->qual_rescued) {
+				rescued_map[write_barcode]++;
+			} else if (smallest_dist == 0) {
 				zero_dist_map[write_barcode]++;
 			} else if (smallest_dist == 1) {                        
 				one_dist_map[write_barcode]++;
@@ -604,72 +1410,250 @@ void bc_splitter::split_engine() {
 			write_barcode = "no_match";
 			no_match_total++;
 		}
+		if (smallest_count != 1 && top_unmatched > 0) {
+			unmatched_sketch.offer(rec->barcode_str);
+		}
 		barcode_set.insert(write_barcode);
-	
-		// Adding umi_string to the output file.	
-		std::string rword1A;
-		if (validUmi) {
-
-			// Split the read one, if there is to split
-			boost::regex expr ("(\\S+)\\s*(\\S*)");
-			boost::smatch what;
-			bool res = boost::regex_search(rword1, what, expr);
-			std::string hpart1;
-			std::string hpart2 = "";
-			if (res) {
-				hpart1 = what[1];
-				hpart2 = what[2];
-
-				if (hpart2.compare("") == 0) {	
-					rword1A = hpart1 + ":umi_" + umi_str;
-				} else {
-					rword1A = hpart1 + ":umi_" + umi_str + " " + hpart2;
-				}
-			} else {
-				std::cout << "Problem in the UMI parser " << rword1 << "\n";
-				throw my_exception("Problem in the UMI parser.");
+		distmap[smallest_dist]++;
+		timer.lap(STAGE_MATCH);
+		if (count_only) {
+			continue;
+		}
+
+		// With a whitelist the per-barcode files are optional. The reads
+		// are either only counted, or tagged with their barcode and all
+		// written to one pair of files.
+		std::string out_barcode = write_barcode;
+		if (use_whitelist) {
+			if (wl_output.compare("counts") == 0) {
+				continue;
+			} else if (wl_output.compare("tags") == 0) {
+				out_barcode = "tagged";
+				rec->lword1 = tag_header(rec->lword1, ":bc_" + write_barcode);
+				rec->rword1 = tag_header(rec->rword1, ":bc_" + write_barcode);
 			}
-		} else {
-			rword1A = rword1;
 		}
 	
-		totalcap = updateMaps(write_barcode, lword1, lword2, lword3, lword4, 
-			rword1A, rword2, rword3, rword4, totalcap);
+		if (bam_output) {
+			totalcap += buffer_bam(*rec, out_barcode);
+			timer.lap(STAGE_BUFFER);
+		} else {
+			if (!lanes || tagging) {
+				add_umi(*rec);
+			}
+			timer.lap(STAGE_HEADER);
+	
+			totalcap = updateMaps(out_barcode, rec->lword1, rec->lword2, rec->lword3, rec->lword4, 
+				rec->rword1A, rec->rword2, rec->rword3, rec->rword4, totalcap);
+			timer.lap(STAGE_BUFFER);
+		}
 			
 		//std::cout << "total cap: " << totalcap << "\n";
 
-		if (totalcap > total_allowed) {
+		bool flush_due = flush_seconds > 0 && (read_count & PROGRESS_EVERY) == 0 &&
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - last_flush).count()
+				>= flush_seconds;
+		if (totalcap > total_allowed || flush_due) {
+			timer.sample_next();
 			writeMapsToFile();
 			// Write all the data in the respective files sequentially
 			totalcap = 0;
+			checkpoint();
+			timer.lap(STAGE_FLUSH);
 		}
-
-		distmap[smallest_dist]++;
 	}
 
 	// final writing to the files
-	writeMapsToFile();
+	if (!count_only) {
+		timer.sample_next();
+		writeMapsToFile();
+		checkpoint();
+		if (streams) {
+			streams->close();
+		}
+		for (auto& kv : bam_writer_map) {
+			kv.second->close();
+		}
+		timer.lap(STAGE_FLUSH);
+	}
+	timer.finish();
+	input_reads_total = read_count;
+	timer.print(std::cout);
+	if (tracer) {
+		tracer->write(trace_file);
+		std::cout << "Trace is written to " << trace_file << " (" << tracer->dropped()
+			<< " events dropped).\n";
+	}
+
+	if (reporter) {
+		publish();
+		progress.buffered_bytes.store(0, std::memory_order_relaxed);
+		reporter->stop();
+	}
+
+	std::chrono::duration<double> split_time = std::chrono::steady_clock::now() - split_start;
+	metrics.split_seconds = resumed_seconds + split_time.count();
+	if (lanes) {
+		metrics.input_bytes = lanes->input_bytes();
+	} else {
+		metrics.input_bytes = files[0]->get_bytes_read() + files[1]->get_bytes_read();
+	}
+	metrics.input_file_bytes = input_file_total;
 
 	//log_detailed.close();
 }
 
+bool bc_splitter::is_discovery() const {
+	return discover;
+}
+
+bool bc_splitter::is_merge() const {
+	return merge_shards > 0;
+}
+
+bool bc_splitter::is_count_only() const {
+	return count_only;
+}
+
+// Whitelist free barcode discovery. The barcode window of every read in
+// file1 is counted in a space-saving sketch of fixed size, so memory does
+// not grow with the number of distinct (mostly erroneous) barcodes. The
+// barcodes ranked above the knee of the log-log rank-count curve are
+// written in the <index> <barcode> format that dict_builder reads.
+void bc_splitter::discover_engine() {
+	space_saving<std::string> sketch(discover_capacity);
+
+	std::string lword1;
+	std::string lword2;
+	std::string lword3;
+	std::string lword4;
+	std::string barcode_str;
+	unsigned long total_reads = 0;
+	unsigned long skipped_reads = 0;
+
+	// The lanes one after the other, the counts do not depend on the order.
+	for (auto& file1_path : file1_list) {
+		std::unique_ptr<fastq_reader> reader = is_bam_path(file1_path) ?
+			std::move(open_bam_reads(file1_path, bam_threads, {bam_pairs::read1})[0]) :
+			std::make_unique<fastq_reader>(file1_path);
+		fastq_reader& file1 = *reader;
+
+		while (file1.getline(lword1)) {
+			if (!file1.getline(lword2)) {break;}
+			if (!file1.getline(lword3)) {break;}
+			if (!file1.getline(lword4)) {break;}
+
+			total_reads++;
+			if (lword2.length() < (size_t) (barcode_start + barcode_size)) {
+				skipped_reads++;
+				continue;
+			}
+			barcode_str.assign(lword2, barcode_start, barcode_size);
+			if (barcode_str.find_first_not_of("ACGT") != std::string::npos) {
+				skipped_reads++;
+				continue;
+			}
+			sketch.offer(barcode_str);
+		}
+	}
+
+	std::vector<space_saving<std::string>::entry> ranked = sketch.top(sketch.size());
+
+	// The knee is the point farthest above the chord from the first to
+	// the last point of the curve. A curve with no point clearly above the
+	// chord, as the counts of clean barcodes without an error tail give,
+	// has no knee, and every rank is kept.
+	const double MIN_KNEE_RISE = 0.1;
+	size_t knee = 0;
+	bool flat = false;
+	if (ranked.size() > 2) {
+		double x0 = 0;
+		double y0 = std::log10((double) ranked.front().count);
+		double x1 = std::log10((double) ranked.size());
+		double y1 = std::log10((double) ranked.back().count);
+		double best = 0;
+		for (size_t i = 0; i < ranked.size(); i++) {
+			double x = std::log10((double) (i + 1));
+			double y = std::log10((double) ranked[i].count);
+			double chord = y0 + (y1 - y0) * (x - x0) / (x1 - x0);
+			if (y - chord > best) {
+				best = y - chord;
+				knee = i;
+			}
+		}
+		if (best < MIN_KNEE_RISE) {
+			flat = true;
+			knee = ranked.size() - 1;
+		}
+	} else if (!ranked.empty()) {
+		knee = ranked.size() - 1;
+	}
+
+	std::ofstream dict_out(discover_file);
+	std::ofstream ranks_out(discover_file + ".ranks.tsv");
+	ranks_out << "rank\tbarcode\tcount\tmax_overcount\n";
+	unsigned long kept_reads = 0;
+	for (size_t i = 0; i < ranked.size(); i++) {
+		ranks_out << i + 1 << "\t" << ranked[i].key << "\t" << ranked[i].count 
+			<< "\t" << ranked[i].error << "\n";
+		if (i <= knee) {
+			dict_out << i + 1 << "\t" << ranked[i].key << "\n";
+			kept_reads += ranked[i].count;
+		}
+	}
+	dict_out.close();
+	ranks_out.close();
+
+	std::cout << "Reads: " << total_reads << ", skipped for N or length: " 
+		<< skipped_reads << "\n";
+	if (flat) {
+		std::cout << "Warning: The rank-count curve has no knee, all " << ranked.size()
+			<< " barcodes are kept.\n";
+	}
+	if (!ranked.empty()) {
+		std::cout << (flat ? "Last rank " : "Knee at rank ") << knee + 1 << " with " << ranked[knee].count 
+			<< " reads. The kept barcodes cover " 
+			<< ((double) kept_reads / (double) total_reads) * 100 << "% of the reads.\n";
+	}
+}
+
 bool bc_splitter::file_exists (const std::string& name) {
   struct stat buffer;   
   return (stat (name.c_str(), &buffer) == 0); 
 }
 
+// Appends the tag to the read name, in front of the comment if any.
+std::string bc_splitter::tag_header(const std::string& header, const std::string& tag) {
+	size_t name_end = header.find_first_of(" \t");
+	if (name_end == std::string::npos) {
+		return header + tag;
+	}
+	return header.substr(0, name_end) + tag + header.substr(name_end);
+}
+
 void bc_splitter::create_other_files() {
 
+	// A whitelist can have millions of barcodes, only the ones with
+	// reads get files.
+	if (use_whitelist) {
+		return;
+	}
+
     std::set<std::string> all_nodes = tree.get_nodes();
 
 	for (const auto& lbarcode : all_nodes) {
-        const std::string file1_str = outdirpath + "/" + prefix_str + "_" + lbarcode + "_R1.fastq";
-        const std::string file2_str = outdirpath + "/" + prefix_str + "_" + lbarcode + "_R2.fastq";
-        if (!file_exists(file1_str)) {
-            std::ofstream file1(file1_str);
-        }
-        if (!file_exists(file2_str)) {
-            std::ofstream file1(file2_str);
+		// A streamed barcode has no files at all.
+		if (streams && streams->has(lbarcode)) {
+			continue;
+		}
+        for (auto const& file_str : output_files(lbarcode)) {
+            // An empty BAM still has its header and end of file block.
+            if (bam_output && !file_exists(file_str)) {
+                open_bam(lbarcode);
+                bam_writer_map[lbarcode]->close();
+            } else if (!file_exists(file_str)) {
+                std::ofstream file1(file_str);
+            }
         }
     }
 }
@@ -687,7 +1671,21 @@ void bc_splitter::write_log() {
 	double ambiguous_percent = ((double) ambiguous_total / (double) total_reads) * 100;
 	double no_match_percent = ((double) no_match_total / (double) total_reads) * 100;
 
+	write_metrics(total_reads);
+	if (shard_count > 0) {
+		std::ofstream counters(outdirpath + "/" + prefix_str + "_counters.txt");
+		write_counters(counters);
+	}
+
 	log_freq << "Total reads: " << total_reads << "\n..................\n";
+	if (sampled_out_total > 0 || max_reads > 0) {
+		log_freq << "Read pairs in the input: " << input_reads_total;
+		if (max_reads > 0) {
+			log_freq << " (stopped at " << max_reads << ")";
+		}
+		log_freq << ", classified: " << total_reads << " (sample fraction "
+			<< sample_fraction << ")\n\n";
+	}
 
 	log_freq << "Ambiguous:\n";
 	log_freq << ".................." << "\n";
@@ -695,7 +1693,34 @@ void bc_splitter::write_log() {
 
 	log_freq << "No match:\n";
     log_freq << ".................." << "\n";
-    log_freq << "Total non-match reads: " << no_match_total << " (" << no_match_percent << "%)\n\n";
+    log_freq << "Total non-match reads: " << no_match_total << " (" << no_match_percent << "%)\n";
+    log_freq << "Non-match reads with more than " << max_n << " Ns: " << n_rejected_total << "\n\n";
+
+	if (top_unmatched > 0) {
+		write_top_unmatched(log_freq, total_reads);
+	}
+
+	if (qual_assign) {
+		double qual_rescued_percent = ((double) qual_rescued_total / (double) total_reads) * 100;
+		log_freq << "Quality rescued:\n";
+		log_freq << ".................." << "\n";
+		log_freq << "Total quality-rescued reads: " << qual_rescued_total << " (" << qual_rescued_percent << "%)\n\n";
+	}
+
+	// For a whitelist the per barcode counts go to a table of the
+	// barcodes that were seen.
+	if (use_whitelist) {
+		write_barcode_counts();
+		unsigned long seen = barcode_set.size() - barcode_set.count("ambiguous") -
+			barcode_set.count("no_match");
+		log_freq << "Matched barcodes: " << seen << " of "
+			<< whitelist.size() << " in the whitelist, counts in "
+			<< prefix_str << "_barcode_counts.tsv\n";
+		log_freq.close();
+		std::cout << "Ambiguous: " << ambiguous_percent << "%\n";
+		std::cout << "No-match: " << no_match_percent << "%\n";
+		return;
+	}
 
     // Add all the barcodes in the tree, even if it does not have any reads
     // overlapped.
@@ -708,13 +1733,16 @@ void bc_splitter::write_log() {
         double higher_dist_percent = 0;
         double barcode_read_percent = 0;
 		unsigned long total_correct_count = 0;
+		unsigned long rescued_count = 0;
 
         if (barcode_set.count(lbarcode) > 0) {	
 		    unsigned long zero_dist_count = zero_dist_map[lbarcode];
 		    unsigned long one_dist_count = one_dist_map[lbarcode];
 		    unsigned long higher_dist_count = higher_dist_map[lbarcode];
+		    rescued_count = rescued_map[lbarcode];
 
-		    total_correct_count = zero_dist_count + one_dist_count + higher_dist_count;
+		    total_correct_count = zero_dist_count + one_dist_count + higher_dist_count +
+		        rescued_count;
 		    zero_dist_percent = ((double)zero_dist_count / (double)total_correct_count) * 100.0;
 		    one_dist_percent = ((double)one_dist_count / (double)total_correct_count) * 100.0;
 		    higher_dist_percent = 100 - zero_dist_percent - one_dist_percent;
@@ -734,6 +1762,9 @@ void bc_splitter::write_log() {
 		log_freq << ".................." << "\n";
 		log_freq << "Zero base mismatch: " << zero_dist_percent << "%\n";
 		log_freq << "One base mismatch: " << one_dist_percent << "%\n";
+		if (qual_assign) {
+			log_freq << "Quality rescued: " << rescued_count << "\n";
+		}
 		log_freq << "Total read for this barcode: " << total_correct_count << 
 			" (percent of total reads: " << barcode_read_percent << "%)\n";
 		log_freq << "\n";
@@ -756,6 +1787,462 @@ void bc_splitter::write_log() {
 }
 
 
+// Everything write_log needs from a shard, one tab separated counter per
+// line, for --merge-shards.
+void bc_splitter::write_counters(std::ostream& counters) {
+	counters << "reads\tinput\t" << input_reads_total << "\n";
+	counters << "reads\tsampled_out\t" << sampled_out_total << "\n";
+	counters << "reads\tmatch\t" << match_total << "\n";
+	counters << "reads\tambiguous\t" << ambiguous_total << "\n";
+	counters << "reads\tno_match\t" << no_match_total << "\n";
+	counters << "reads\tqual_rescued\t" << qual_rescued_total << "\n";
+	counters << "reads\tn_rejected\t" << n_rejected_total << "\n";
+	for (auto const& entry : distmap) {
+		counters << "distance\t" << entry.first << "\t" << entry.second << "\n";
+	}
+	for (auto const& lbarcode : barcode_set) {
+		counters << "barcode\t" << lbarcode << "\t" << zero_dist_map[lbarcode] << "\t"
+			<< one_dist_map[lbarcode] << "\t" << higher_dist_map[lbarcode] << "\t"
+			<< rescued_map[lbarcode] << "\n";
+	}
+	for (auto const& entry : unmatched_sketch.top(unmatched_sketch.size())) {
+		counters << "unmatched\t" << entry.key << "\t" << entry.count << "\t"
+			<< entry.error << "\n";
+	}
+	counters << "metrics\tinput_bytes\t" << metrics.input_bytes << "\n";
+	counters << "metrics\tinput_file_bytes\t" << metrics.input_file_bytes << "\n";
+	counters << "metrics\toutput_bytes\t" << metrics.output_bytes << "\n";
+	counters << "metrics\tflushes\t" << metrics.flush_count << "\n";
+	counters << "metrics\tpeak_buffered_bytes\t" << metrics.peak_buffered_bytes << "\n";
+	counters << "metrics\tsplit_seconds\t" << metrics.split_seconds << "\n";
+}
+
+// Adds the counters of one shard, or of a checkpoint, to this run's.
+void bc_splitter::read_counters(std::istream& counters) {
+	std::string line;
+	while (std::getline(counters, line)) {
+		std::vector<std::string> fields;
+		boost::split(fields, line, boost::is_any_of("\t"));
+		if (fields.size() < 3) {
+			continue;
+		}
+		const std::string& kind = fields[0];
+		const std::string& key = fields[1];
+		unsigned long value = std::stoul(fields[2]);
+		if (kind.compare("reads") == 0) {
+			if (key.compare("input") == 0) {
+				input_reads_total += value;
+			} else if (key.compare("sampled_out") == 0) {
+				sampled_out_total += value;
+			} else if (key.compare("match") == 0) {
+				match_total += value;
+			} else if (key.compare("ambiguous") == 0) {
+				ambiguous_total += value;
+			} else if (key.compare("no_match") == 0) {
+				no_match_total += value;
+			} else if (key.compare("qual_rescued") == 0) {
+				qual_rescued_total += value;
+			} else if (key.compare("n_rejected") == 0) {
+				n_rejected_total += value;
+			}
+		} else if (kind.compare("distance") == 0) {
+			distmap[std::stoi(key)] += value;
+		} else if (kind.compare("barcode") == 0 && (fields.size() == 5 || fields.size() == 6)) {
+			// Counters written before the rescued count have five fields.
+			barcode_set.insert(key);
+			zero_dist_map[key] += value;
+			one_dist_map[key] += std::stoul(fields[3]);
+			higher_dist_map[key] += std::stoul(fields[4]);
+			if (fields.size() == 6) {
+				rescued_map[key] += std::stoul(fields[5]);
+			}
+		} else if (kind.compare("unmatched") == 0 && fields.size() == 4) {
+			unmatched_sketch.merge({key, value, std::stoul(fields[3])});
+		} else if (kind.compare("metrics") == 0) {
+			if (key.compare("input_bytes") == 0) {
+				metrics.input_bytes += value;
+			} else if (key.compare("input_file_bytes") == 0) {
+				metrics.input_file_bytes += value;
+			} else if (key.compare("output_bytes") == 0) {
+				metrics.output_bytes += value;
+			} else if (key.compare("flushes") == 0) {
+				metrics.flush_count += value;
+			} else if (key.compare("peak_buffered_bytes") == 0) {
+				metrics.peak_buffered_bytes = std::max(metrics.peak_buffered_bytes, value);
+			} else if (key.compare("split_seconds") == 0) {
+				metrics.split_seconds += std::stod(fields[2]);
+			}
+		}
+	}
+}
+
+// The shards in outdir put together as if one process had split the
+// whole input: the counters are added up for write_log, and every FASTQ
+// file of the shards is concatenated in shard order into outdir.
+void bc_splitter::merge_engine() {
+	std::vector<std::string> dirs;
+	std::set<std::string> names;
+	for (int i = 0; i < merge_shards; i++) {
+		std::string dir = outdirpath + "/" + shard_dir(i, merge_shards);
+		const std::string counters_file = dir + "/" + prefix_str + "_counters.txt";
+		std::ifstream counters(counters_file);
+		if (!counters) {
+			throw std::invalid_argument("Could not open " + counters_file +
+				", the shard is missing or has not finished.");
+		}
+		read_counters(counters);
+		dirs.push_back(dir);
+
+		DIR* ldir = opendir(dir.c_str());
+		if (ldir == NULL) {
+			continue;
+		}
+		while (struct dirent* entry = readdir(ldir)) {
+			std::string name = entry->d_name;
+			if (boost::ends_with(name, ".fastq")) {
+				names.insert(name);
+			}
+		}
+		closedir(ldir);
+	}
+
+	for (auto const& name : names) {
+		const std::string path = outdirpath + "/" + name;
+		std::ofstream merged(path, std::ios_base::binary);
+		for (auto const& dir : dirs) {
+			std::ifstream part(dir + "/" + name, std::ios_base::binary);
+			// An empty part would set failbit on merged.
+			if (part && part.peek() != std::ifstream::traits_type::eof()) {
+				merged << part.rdbuf();
+			}
+		}
+		if (!merged) {
+			throw std::invalid_argument("Could not write " + path + ".");
+		}
+		output_paths.insert(path);
+	}
+	std::cout << "Merged " << merge_shards << " shards, " << names.size()
+		<< " FASTQ files.\n";
+}
+
+// Where the run is after a flush: the counters, the input position and
+// the length of every output. It is written aside and renamed over the
+// last one, so that a run killed at any point leaves a whole checkpoint.
+void bc_splitter::write_checkpoint(unsigned long reads,
+	std::vector<std::unique_ptr<fastq_reader>>& files, const std::mt19937_64& rng) {
+
+	input_reads_total = reads;
+	metrics.input_bytes = files[0]->get_bytes_read() + files[1]->get_bytes_read();
+
+	const std::string path = checkpoint_path();
+	const std::string temp_path = path + ".tmp";
+	std::ofstream checkpoint(temp_path);
+	write_counters(checkpoint);
+	for (size_t i = 0; i < files.size(); i++) {
+		checkpoint << "input\t" << i << "\t" << files[i]->get_bytes_read() << "\t"
+			<< (i == 0 ? file1_list[0] : file2_list[0]) << "\n";
+	}
+	for (auto const& barcode : outfile_set) {
+		checkpoint << "output\t" << barcode;
+		for (auto const& output : output_files(barcode)) {
+			checkpoint << "\t" << file_bytes(output);
+		}
+		checkpoint << "\n";
+	}
+	checkpoint << "rng\tsample\t" << rng << "\n";
+	checkpoint.close();
+	if (!checkpoint || rename(temp_path.c_str(), path.c_str()) != 0) {
+		throw std::invalid_argument("Could not write the checkpoint " + path + ".");
+	}
+}
+
+// Picks the run up at the checkpoint in outdir. The counters are restored,
+// the outputs cut back to their lengths at the checkpoint (the run may have
+// died in the middle of a flush) and the inputs moved past the reads that
+// are in them. Outputs begun after the checkpoint are removed. Returns the
+// read pairs already split, 0 without a checkpoint.
+unsigned long bc_splitter::resume_checkpoint(std::vector<std::unique_ptr<fastq_reader>>& files,
+	std::mt19937_64& rng) {
+
+	const std::string path = checkpoint_path();
+	std::ifstream checkpoint(path);
+	if (!checkpoint) {
+		std::cout << "No checkpoint in " << outdirpath << ", starting from the beginning.\n";
+		return 0;
+	}
+	std::stringstream content;
+	content << checkpoint.rdbuf();
+	read_counters(content);
+	content.clear();
+	content.seekg(0);
+
+	std::set<std::string> kept;
+	std::string line;
+	while (std::getline(content, line)) {
+		std::vector<std::string> fields;
+		boost::split(fields, line, boost::is_any_of("\t"));
+		if (fields[0].compare("input") == 0 && fields.size() == 4) {
+			size_t idx = std::stoul(fields[1]);
+			unsigned long offset = std::stoul(fields[2]);
+			if (idx >= files.size() ||
+				fields[3].compare(idx == 0 ? file1_list[0] : file2_list[0]) != 0) {
+				throw std::invalid_argument("The checkpoint " + path +
+					" is of other input files.");
+			}
+			if (!files[idx]->skip_to(offset)) {
+				throw std::invalid_argument(fields[3] + " is shorter than at the checkpoint.");
+			}
+		} else if (fields[0].compare("output") == 0) {
+			const std::string& barcode = fields[1];
+			std::vector<std::string> outputs = output_files(barcode);
+			if (fields.size() != outputs.size() + 2) {
+				throw std::invalid_argument("The checkpoint " + path + " is of a run with"
+					" other --interleaved setting.");
+			}
+			for (size_t i = 0; i < outputs.size(); i++) {
+				const std::string& output = outputs[i];
+				unsigned long length = std::stoul(fields[2 + i]);
+				if (file_bytes(output) < length || truncate(output.c_str(), length) != 0) {
+					throw std::invalid_argument(output + " is shorter than at the checkpoint.");
+				}
+				output_paths.insert(output);
+				kept.insert(output);
+			}
+			outfile_set.insert(barcode);
+		} else if (fields[0].compare("rng") == 0 && fields.size() == 3) {
+			std::istringstream state(fields[2]);
+			state >> rng;
+		}
+	}
+
+	// Only our own names, <prefix>_<barcode>_R1.fastq and so on, are removed.
+	const std::string start = prefix_str + "_";
+	DIR* ldir = opendir(outdirpath.c_str());
+	while (ldir != NULL) {
+		struct dirent* entry = readdir(ldir);
+		if (entry == NULL) {
+			closedir(ldir);
+			break;
+		}
+		std::string name = entry->d_name;
+		if (!boost::starts_with(name, start) || !boost::ends_with(name, ".fastq")) {
+			continue;
+		}
+		std::string barcode = name.substr(start.size(), name.size() - start.size() - 6);
+		if (!interleaved) {
+			barcode = barcode.substr(0, barcode.size() < 3 ? 0 : barcode.size() - 3);
+		}
+		std::vector<std::string> outputs = output_files(barcode);
+		const std::string output = outdirpath + "/" + name;
+		if ((barcode.find('_') == std::string::npos || barcode.compare("no_match") == 0) &&
+			std::find(outputs.begin(), outputs.end(), output) != outputs.end() &&
+			kept.count(output) == 0) {
+			remove(output.c_str());
+		}
+	}
+
+	std::cout << "Resuming after " << input_reads_total << " read pairs.\n";
+	return input_reads_total;
+}
+
+void bc_splitter::write_barcode_counts() {
+	const std::string count_file = outdirpath + "/" + prefix_str + "_barcode_counts.tsv";
+	std::ofstream counts(count_file);
+	counts << "barcode\tzero_mismatch\tone_mismatch\thigher_mismatch\ttotal\n";
+	for (const auto& lbarcode : barcode_set) {
+		if (lbarcode.compare("ambiguous") == 0 || lbarcode.compare("no_match") == 0) {
+			continue;
+		}
+		unsigned long zero_dist_count = zero_dist_map[lbarcode];
+		unsigned long one_dist_count = one_dist_map[lbarcode];
+		unsigned long higher_dist_count = higher_dist_map[lbarcode];
+		counts << lbarcode << "\t" << zero_dist_count << "\t" << one_dist_count << "\t"
+			<< higher_dist_count << "\t" 
+			<< zero_dist_count + one_dist_count + higher_dist_count << "\n";
+	}
+	counts.close();
+}
+
+
+// Lists the most frequent barcodes of the ambiguous and no_match reads,
+// each with its closest dictionary barcode, to tell a barcode missing from
+// the sample sheet apart from poor sequencing.
+void bc_splitter::write_top_unmatched(std::ofstream& log_freq, unsigned long total_reads) {
+	std::set<std::string> all_nodes;
+	if (!use_whitelist) {
+		all_nodes = tree.get_nodes();
+	}
+
+	log_freq << "Top unmatched barcodes:\n";
+	log_freq << ".................." << "\n";
+	for (auto const& entry : unmatched_sketch.top(top_unmatched)) {
+		double percent = ((double) entry.count / (double) total_reads) * 100;
+		log_freq << entry.key << ": " << entry.count << " (" << percent << "%)";
+
+		std::string nearest;
+		int nearest_dist = 0;
+		int ties = 0;
+		if (use_whitelist) {
+			int idx = whitelist.nearest(packed_barcode::encode(entry.key), nearest_dist, ties);
+			if (idx >= 0) {
+				nearest = whitelist.get_barcode(idx);
+			}
+		} else {
+			nearest_search(all_nodes, entry.key, nearest, nearest_dist, ties);
+		}
+		if (!nearest.empty()) {
+			log_freq << ", nearest " << nearest << " at distance " << nearest_dist;
+			if (ties > 1) {
+				log_freq << " (" << ties << " tied)";
+			}
+		}
+		log_freq << "\n";
+	}
+	log_freq << "\n";
+}
+
+// The same numbers as the frequency log plus the distance histogram,
+// buffering, timing and byte counters, for jobs that aggregate many runs.
+void bc_splitter::write_metrics(unsigned long total_reads) {
+	if (metrics_format.compare("none") == 0) {
+		return;
+	}
+
+	metrics_table table;
+	table.add("run", "tool", "bc_splitter");
+	table.add("run", "prefix", prefix_str);
+	table.add("run", "type", ltype);
+	table.add("run", "dictionary", dict_file);
+	table.add("run", "mismatch", cutoff);
+	table.add("run", "count_only", count_only ? 1 : 0);
+	table.add("run", "sample_fraction", sample_fraction);
+	table.add("run", "max_reads", max_reads);
+
+	table.add("reads", "total", total_reads);
+	table.add("reads", "input", input_reads_total);
+	table.add("reads", "sampled_out", sampled_out_total);
+	table.add("reads", "matched", match_total);
+	table.add("reads", "ambiguous", ambiguous_total);
+	table.add("reads", "no_match", no_match_total);
+	table.add("reads", "n_rejected", n_rejected_total);
+	table.add("reads", "quality_rescued", qual_rescued_total);
+
+	// The bucket above the cutoff holds the reads the search found no match
+	// for, whether --qual-assign rescued them or not.
+	for (auto const& kv : distmap) {
+		table.add("distance_histogram", std::to_string(kv.first), kv.second);
+	}
+
+	std::set<std::string> barcodes;
+	if (use_whitelist) {
+		for (auto const& lbarcode : barcode_set) {
+			if (lbarcode.compare("ambiguous") != 0 && lbarcode.compare("no_match") != 0) {
+				barcodes.insert(lbarcode);
+			}
+		}
+	} else {
+		barcodes = tree.get_nodes();
+	}
+	auto count_of = [](const std::map<std::string, unsigned long>& counts,
+		const std::string& key) -> unsigned long {
+		auto it = counts.find(key);
+		return it == counts.end() ? 0 : it->second;
+	};
+	for (auto const& lbarcode : barcodes) {
+		table.add("zero_mismatch", lbarcode, count_of(zero_dist_map, lbarcode));
+	}
+	for (auto const& lbarcode : barcodes) {
+		table.add("one_mismatch", lbarcode, count_of(one_dist_map, lbarcode));
+	}
+	for (auto const& lbarcode : barcodes) {
+		table.add("higher_mismatch", lbarcode, count_of(higher_dist_map, lbarcode));
+	}
+	if (qual_assign) {
+		for (auto const& lbarcode : barcodes) {
+			table.add("quality_rescued", lbarcode, count_of(rescued_map, lbarcode));
+		}
+	}
+
+	if (top_unmatched > 0) {
+		for (auto const& entry : unmatched_sketch.top(top_unmatched)) {
+			table.add("top_unmatched", entry.key, entry.count);
+		}
+	}
+
+	unsigned long allowed_bytes = (unsigned long) allowed_MB * 1024 * 1024;
+	table.add("buffer", "flushes", metrics.flush_count);
+	table.add("buffer", "peak_bytes", metrics.peak_buffered_bytes);
+	table.add("buffer", "allowed_bytes", allowed_bytes);
+
+	table.add("timing", "load_seconds", metrics.load_seconds);
+	table.add("timing", "split_seconds", metrics.split_seconds);
+	if (metrics.split_seconds > 0) {
+		table.add("timing", "reads_per_second", total_reads / metrics.split_seconds);
+	}
+
+	for (auto const& path : output_paths) {
+		metrics.output_file_bytes += file_bytes(path);
+	}
+	table.add("io", "input_bytes", metrics.input_bytes);
+	table.add("io", "input_file_bytes", metrics.input_file_bytes);
+	table.add("io", "output_bytes", metrics.output_bytes);
+	table.add("io", "output_file_bytes", metrics.output_file_bytes);
+
+	const std::string metrics_base = outdirpath + "/" + prefix_str + "_metrics";
+	if (metrics_format.compare("json") == 0 || metrics_format.compare("both") == 0) {
+		table.write_json(metrics_base + ".json");
+	}
+	if (metrics_format.compare("tsv") == 0 || metrics_format.compare("both") == 0) {
+		table.write_tsv(metrics_base + ".tsv");
+	}
+}
+
+// Hands the counters of the splitting thread to the progress reporter.
+void bc_splitter::publish_progress(unsigned long reads, std::vector<fastq_reader*> readers) {
+	unsigned long input_bytes = 0;
+	unsigned long input_file_pos = 0;
+	for (auto reader : readers) {
+		input_bytes += reader->get_bytes_read();
+		input_file_pos += reader->get_file_pos();
+	}
+	publish_progress(reads, input_bytes, input_file_pos);
+}
+
+void bc_splitter::publish_progress(unsigned long reads, unsigned long input_bytes,
+	unsigned long input_file_pos) {
+
+	progress.reads.store(reads, std::memory_order_relaxed);
+	progress.input_bytes.store(input_bytes, std::memory_order_relaxed);
+	progress.input_file_pos.store(input_file_pos, std::memory_order_relaxed);
+	progress.buffered_bytes.store(totalcap, std::memory_order_relaxed);
+	progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+}
+
+void bc_splitter::nearest_search(const std::set<std::string>& nodes,
+	const std::string& query, std::string& nearest, int& nearest_dist, int& ties) {
+
+	// Packed when the encoding holds the barcodes, as strings otherwise
+	bool packed = packed_barcode::fits(query.length());
+	packed_barcode packed_query = packed ? packed_barcode::encode(query) : packed_barcode();
+	nearest_dist = query.length() + 1;
+	ties = 0;
+	for (auto const& node : nodes) {
+		if (node.length() != query.length()) {
+			continue;
+		}
+		int dist = packed ? packed_distance(packed_barcode::encode(node), packed_query) :
+			string_distance(node, query);
+		if (dist < nearest_dist) {
+			nearest_dist = dist;
+			nearest = node;
+			ties = 1;
+		} else if (dist == nearest_dist) {
+			ties++;
+		}
+	}
+}
+
+
 int main(int argc, char* argv[]) { 
 
 	bc_splitter lbs;
@@ -788,9 +2275,23 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
-	lbs.initialize();
+	if (lbs.is_discovery()) {
+		try {
+			lbs.discover_engine();
+		} catch(std::invalid_argument& e) {
+			std::cerr << "error: " << e.what() << "\n";
+			return 1;
+		}
+		return 0;
+	}
+
 	try {
-		lbs.split_engine();
+		lbs.initialize();
+		if (lbs.is_merge()) {
+			lbs.merge_engine();
+		} else {
+			lbs.split_engine();
+		}
 	} catch(std::invalid_argument& e) {
         std::cerr << "error: " << e.what() << "\n";
 		//lbs.print_help();
@@ -798,7 +2299,9 @@ int main(int argc, char* argv[]) {
     }
 
 	lbs.write_log();
-    lbs.create_other_files();
+	if (!lbs.is_count_only()) {
+		lbs.create_other_files();
+	}
         
     return 0;
 }
@@ -0,0 +1,331 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <cstdint>
+
+#include "fastq_writer.hpp"
+#include "synth_random.hpp"
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace po = boost::program_options;
+
+// Deterministic synthetic data for the benchmarks: a barcode dictionary and
+// the FASTQ files of one of the layouts the splitters read. The same seed
+// and options give the same bytes on every platform, so the output
+// checksums of the benchmark runs can be compared between builds.
+//
+// Layouts (barcode position in read 1 unless noted):
+//   allseq     UMI at 0, 6 bases; barcode at 6, 6 bases
+//   rnatagseq  barcode at 0, 8 bases
+//   rts        barcode at 0, 9 bases
+//   rts_se     as rts, read 1 only
+//   index      barcode as the whole index read, 8 bases
+
+class fastq_gen {
+	public:
+	bool parse_args(int argc, char* argv[]);
+	void print_help();
+	bool generate();
+
+	private:
+	std::string random_bases(int len);
+	void make_barcodes();
+	// Sequencing errors and Ns on a read, with matching base qualities
+	void add_errors(std::string& seq, std::string& qual);
+	std::string quality(int len);
+	void write_record(fastq_writer& writer, const std::string& name,
+		const std::string& seq, const std::string& qual);
+
+	po::options_description desc;
+	std::string layout;
+	std::string outdir;
+	std::string prefix;
+	std::string dict_in;
+	unsigned long reads;
+	unsigned long seed;
+	int barcode_count;
+	int bc_len;
+	int bc_start;
+	int umi_start;
+	int umi_size;
+	int min_dist;
+	int read_len;
+	double error_rate;
+	double n_rate;
+	double foreign_rate;
+	bool gzip = false;
+
+	std::vector<std::string> barcodes;
+	std::unique_ptr<synth_random> rng;
+};
+
+void fastq_gen::print_help() {
+	std::cout << desc << "\n";
+	std::cout << "Usage: fastq_gen --layout <layout> -n <reads> -o <outdir> -p <prefix>\n\n";
+}
+
+bool fastq_gen::parse_args(int argc, char* argv[]) {
+	bool all_set = true;
+	desc.add_options()
+		("help,h", "produce help message")
+		("layout,l", po::value(&layout)->default_value("allseq"),
+			"allseq/rnatagseq/rts/rts_se/index")
+		("reads,n", po::value(&reads)->default_value(100000), "Number of reads")
+		("outdir,o", po::value<std::string>(&outdir), "Output directory")
+		("prefix,p", po::value(&prefix)->default_value("synth"), "Prefix of the output files")
+		("seed", po::value(&seed)->default_value(1), "Optional/Random seed")
+		("dict", po::value<std::string>(&dict_in),
+			"Optional/Use the barcodes of this <index> <barcode> file")
+		("barcodes", po::value(&barcode_count)->default_value(96),
+			"Optional/Number of barcodes to generate")
+		("bc-len", po::value(&bc_len)->default_value(0),
+			"Optional/Barcode length, default from the layout")
+		("bc-start", po::value(&bc_start)->default_value(-1),
+			"Optional/Barcode position in read 1, default from the layout")
+		("umi-start", po::value(&umi_start)->default_value(0), "Optional/UMI position (allseq)")
+		("umi-size", po::value(&umi_size)->default_value(6), "Optional/UMI length (allseq)")
+		("min-dist", po::value(&min_dist)->default_value(3),
+			"Optional/Minimum Hamming distance between generated barcodes")
+		("read-len", po::value(&read_len)->default_value(50), "Optional/Read length")
+		("error-rate", po::value(&error_rate)->default_value(0.01),
+			"Optional/Substitution rate per base")
+		("n-rate", po::value(&n_rate)->default_value(0.001), "Optional/N rate per base")
+		("foreign-rate", po::value(&foreign_rate)->default_value(0.05),
+			"Optional/Fraction of reads with a barcode not in the dictionary")
+		("gzip", "Optional/Write gzipped FASTQ")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		return false;
+	}
+
+	boost::to_lower(layout);
+	int default_len = 0;
+	int default_start = 0;
+	if (layout.compare("allseq") == 0) {
+		default_len = 6;
+		default_start = 6;
+	} else if (layout.compare("rnatagseq") == 0 || layout.compare("index") == 0) {
+		default_len = 8;
+		umi_size = 0;
+	} else if (layout.compare("rts") == 0 || layout.compare("rts_se") == 0) {
+		default_len = 9;
+		umi_size = 0;
+	} else {
+		std::cout << "Error: Invalid layout.\n";
+		all_set = false;
+	}
+	if (bc_len <= 0) {
+		bc_len = default_len;
+	}
+	if (bc_start < 0) {
+		bc_start = default_start;
+	}
+	if (layout.compare("index") == 0) {
+		bc_start = 0;
+	} else if (bc_start + bc_len > read_len || umi_start + umi_size > read_len) {
+		std::cout << "Error: Barcode or UMI does not fit in the read.\n";
+		all_set = false;
+	}
+
+	if (!vm.count("outdir")) {
+		std::cout << "Outdir not set.\n";
+		all_set = false;
+	}
+	gzip = vm.count("gzip");
+	rng = std::make_unique<synth_random>(seed);
+	return all_set;
+}
+
+std::string fastq_gen::random_bases(int len) {
+	static const char bases[] = "ACGT";
+	std::string str(len, 'A');
+	for (int i = 0; i < len; i++) {
+		str[i] = bases[rng->below(4)];
+	}
+	return str;
+}
+
+void fastq_gen::make_barcodes() {
+	if (!dict_in.empty()) {
+		std::ifstream words(dict_in);
+		std::string lstr;
+		while (std::getline(words, lstr)) {
+			std::vector<std::string> parts;
+			boost::split(parts, lstr, boost::is_any_of(" \t"), boost::token_compress_on);
+			if (!parts.empty() && !parts.back().empty()) {
+				barcodes.push_back(parts.back());
+			}
+		}
+		if (!barcodes.empty()) {
+			bc_len = barcodes[0].length();
+		}
+		return;
+	}
+
+	// Rejection sampling for the minimum distance; it gives up on the
+	// distance after many failures rather than loop forever.
+	std::set<std::string> seen;
+	int failures = 0;
+	while ((int) barcodes.size() < barcode_count) {
+		std::string candidate = random_bases(bc_len);
+		bool ok = seen.count(candidate) == 0;
+		for (size_t i = 0; ok && failures < 100000 && i < barcodes.size(); i++) {
+			int dist = 0;
+			for (int j = 0; j < bc_len; j++) {
+				dist += candidate[j] != barcodes[i][j];
+			}
+			ok = dist >= min_dist;
+		}
+		if (!ok) {
+			failures++;
+			continue;
+		}
+		seen.insert(candidate);
+		barcodes.push_back(candidate);
+	}
+	if (failures >= 100000) {
+		std::cout << "Warning: could not keep the minimum distance for all barcodes.\n";
+	}
+}
+
+std::string fastq_gen::quality(int len) {
+	std::string qual(len, 'I');
+	for (int i = 0; i < len; i++) {
+		qual[i] = (char) (33 + 30 + rng->below(11));
+	}
+	return qual;
+}
+
+void fastq_gen::add_errors(std::string& seq, std::string& qual) {
+	static const char bases[] = "ACGT";
+	for (size_t i = 0; i < seq.length(); i++) {
+		double r = rng->uniform();
+		if (r < n_rate) {
+			seq[i] = 'N';
+			qual[i] = (char) (33 + 2);
+		} else if (r < n_rate + error_rate) {
+			char base = bases[rng->below(3)];
+			seq[i] = base == seq[i] ? 'T' : base;
+			qual[i] = (char) (33 + 2 + rng->below(18));
+		}
+	}
+}
+
+void fastq_gen::write_record(fastq_writer& writer, const std::string& name,
+	const std::string& seq, const std::string& qual) {
+
+	std::string line = name;
+	writer.putline(line);
+	line = seq;
+	writer.putline(line);
+	line = "+";
+	writer.putline(line);
+	line = qual;
+	writer.putline(line);
+}
+
+bool fastq_gen::generate() {
+	make_barcodes();
+	if (barcodes.empty()) {
+		std::cout << "Error: no barcodes.\n";
+		return false;
+	}
+
+	struct stat st = {0};
+	if (stat(outdir.c_str(), &st) == -1) {
+		mkdir(outdir.c_str(), 0755);
+	}
+
+	std::ofstream dict_out(outdir + "/" + prefix + "_dict.txt");
+	for (size_t i = 0; i < barcodes.size(); i++) {
+		dict_out << i + 1 << "\t" << barcodes[i] << "\n";
+	}
+	dict_out.close();
+
+	const std::string ext = gzip ? ".fastq.gz" : ".fastq";
+	bool paired = layout.compare("rts_se") != 0;
+	bool index = layout.compare("index") == 0;
+	std::string file1 = outdir + "/" + prefix + "_R1" + ext;
+	std::string file2 = outdir + "/" + prefix + "_R2" + ext;
+	std::string file_index = outdir + "/" + prefix + "_I1" + ext;
+	fastq_writer r1(file1);
+	std::unique_ptr<fastq_writer> r2;
+	std::unique_ptr<fastq_writer> i1;
+	if (paired) {
+		r2 = std::make_unique<fastq_writer>(file2);
+	}
+	if (index) {
+		i1 = std::make_unique<fastq_writer>(file_index);
+	}
+
+	for (unsigned long n = 0; n < reads; n++) {
+		std::string barcode;
+		if (rng->uniform() < foreign_rate) {
+			barcode = random_bases(bc_len);
+		} else {
+			barcode = barcodes[rng->below(barcodes.size())];
+		}
+		std::string name = "@SYNTH:1:FC0001:1:" + std::to_string(1101 + n / 1000000) + ":" +
+			std::to_string(n % 1000000) + ":" + std::to_string(n % 7919);
+
+		std::string seq1 = random_bases(read_len);
+		if (index) {
+			std::string ind_seq = barcode;
+			std::string ind_qual = quality(bc_len);
+			add_errors(ind_seq, ind_qual);
+			write_record(*i1, name + " 1:N:0:" + ind_seq, ind_seq, ind_qual);
+			name += " 1:N:0:" + ind_seq;
+		} else {
+			seq1.replace(bc_start, bc_len, barcode);
+			name += " 1:N:0:1";
+		}
+		std::string qual1 = quality(read_len);
+		add_errors(seq1, qual1);
+		write_record(r1, name, seq1, qual1);
+
+		if (paired) {
+			std::string seq2 = random_bases(read_len);
+			std::string qual2 = quality(read_len);
+			add_errors(seq2, qual2);
+			std::string name2 = name;
+			size_t space = name2.find(' ');
+			if (space != std::string::npos && space + 1 < name2.length()) {
+				name2[space + 1] = '2';
+			}
+			write_record(*r2, name2, seq2, qual2);
+		}
+	}
+
+	std::cout << "Wrote " << reads << " reads of layout " << layout << " with "
+		<< barcodes.size() << " barcodes of length " << bc_len << " to " << outdir << ".\n";
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	fastq_gen gen;
+	bool all_set = true;
+	try {
+		all_set = gen.parse_args(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << "error: " << e.what() << "\n";
+		return 1;
+	}
+	if (!all_set) {
+		gen.print_help();
+		return 1;
+	}
+	return gen.generate() ? 0 : 1;
+}
@@ -0,0 +1,488 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+
+#include "run_metrics.hpp"
+#include "matcher_engines.hpp"
+#include "synth_random.hpp"
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+
+namespace po = boost::program_options;
+
+// Nanoseconds and heap allocations per query of each barcode matcher, on
+// dictionaries of several sizes, at every cutoff and with and without
+// remove_last. The queries are dictionary entries, or foreign barcodes,
+// with substitutions and Ns thrown in at the given rates, as they come
+// off the sequencer. The result is one JSON document, so runs can be kept
+// and compared over time.
+
+// Every allocation of the process goes through here, so the benchmark can
+// count those made by the matchers.
+static std::atomic<unsigned long> alloc_count(0);
+
+void* operator new(size_t size) {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void* ptr = malloc(size > 0 ? size : 1);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+// The memory of the operator new above comes from malloc, so free is the
+// matching release. GCC only sees a pointer from operator new going to
+// free once both are inlined, and warns.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+class matcher_bench {
+	public:
+	bool parse_args(int argc, char* argv[]);
+	void print_help();
+	bool run();
+
+	private:
+	struct dictionary {
+		std::string name;
+		std::vector<std::string> barcodes;
+	};
+
+	struct case_result {
+		std::string engine;
+		std::string dict;
+		size_t size;
+		int bc_len;
+		int cutoff;
+		bool remove_last;
+		double build_seconds;
+		unsigned long queries;
+		double ns_per_query;
+		double allocs_per_query;
+		double matched;
+		double ambiguous;
+	};
+
+	bool load_dictionary(const std::string& path, dictionary& dict);
+	void make_dictionary(size_t size, dictionary& dict);
+	int auto_length(size_t size);
+	std::vector<std::string> make_queries(const std::vector<std::string>& barcodes);
+	std::string random_bases(int len);
+	void measure(matcher_engine& engine, const std::vector<std::string>& queries,
+		case_result& result);
+	void write_json(std::ostream& out, const std::vector<case_result>& results);
+	void print_table(const std::vector<case_result>& results);
+
+	po::options_description desc;
+	std::vector<std::string> dict_files;
+	std::string sizes_str;
+	std::string mismatch_str;
+	std::string engines_str;
+	std::string remove_last_str;
+	std::string out_file;
+	unsigned long seed;
+	int bc_len;
+	unsigned long query_count;
+	unsigned long max_queries;
+	double min_time;
+	double error_rate;
+	double n_rate;
+	double foreign_rate;
+
+	std::vector<size_t> sizes;
+	std::vector<int> cutoffs;
+	std::vector<bool> remove_last_modes;
+	std::vector<std::string> engine_names;
+	std::unique_ptr<synth_random> rng;
+};
+
+void matcher_bench::print_help() {
+	std::cout << desc << "\n";
+	std::cout << "Usage: matcher_bench [--dict <file> ...] [--sizes 96,384,10000] -o <json>\n\n";
+}
+
+bool matcher_bench::parse_args(int argc, char* argv[]) {
+	bool all_set = true;
+	desc.add_options()
+		("help,h", "produce help message")
+		("dict,d", po::value<std::vector<std::string>>(&dict_files),
+			"Optional/<index> <barcode> dictionary file, may be repeated; "
+			"replaces the generated dictionaries")
+		("sizes", po::value(&sizes_str)->default_value("96,384,10000,1000000"),
+			"Optional/Sizes of the generated dictionaries")
+		("bc-len", po::value(&bc_len)->default_value(0),
+			"Optional/Length of the generated barcodes, default from the size")
+		("mismatch,m", po::value(&mismatch_str)->default_value("0,1,2,3"),
+			"Optional/Cutoffs to measure")
+		("remove-last", po::value(&remove_last_str)->default_value("both"),
+			"Optional/off/on/both")
+		("engines", po::value(&engines_str)->default_value("bktree,whitelist,brute_force"),
+			"Optional/Matchers to measure")
+		("queries", po::value(&query_count)->default_value(100000),
+			"Optional/Distinct queries per dictionary, replayed in a loop")
+		("min-time", po::value(&min_time)->default_value(0.5),
+			"Optional/Seconds to spend on each case")
+		("max-queries", po::value(&max_queries)->default_value(10000000),
+			"Optional/Upper limit of the queries of each case")
+		("error-rate", po::value(&error_rate)->default_value(0.01),
+			"Optional/Substitution rate per base of the queries")
+		("n-rate", po::value(&n_rate)->default_value(0.001), "Optional/N rate per base")
+		("foreign-rate", po::value(&foreign_rate)->default_value(0.05),
+			"Optional/Fraction of queries not drawn from the dictionary")
+		("seed", po::value(&seed)->default_value(1), "Optional/Random seed")
+		("out,o", po::value<std::string>(&out_file),
+			"Optional/Write the JSON here and a table to stdout, instead of the JSON to stdout")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		return false;
+	}
+
+	std::vector<std::string> parts;
+	if (dict_files.empty()) {
+		boost::split(parts, sizes_str, boost::is_any_of(","), boost::token_compress_on);
+		for (auto const& part : parts) {
+			long size = atol(part.c_str());
+			if (size <= 0) {
+				std::cout << "Error: Invalid dictionary size " << part << ".\n";
+				all_set = false;
+			} else {
+				sizes.push_back(size);
+			}
+		}
+	}
+
+	boost::split(parts, mismatch_str, boost::is_any_of(","), boost::token_compress_on);
+	for (auto const& part : parts) {
+		int cutoff = atoi(part.c_str());
+		if (part.empty() || cutoff < 0 || cutoff > 3) {
+			std::cout << "Error: The cutoffs must be between 0 and 3.\n";
+			all_set = false;
+		} else {
+			cutoffs.push_back(cutoff);
+		}
+	}
+
+	boost::to_lower(remove_last_str);
+	if (remove_last_str.compare("off") == 0 || remove_last_str.compare("both") == 0) {
+		remove_last_modes.push_back(false);
+	}
+	if (remove_last_str.compare("on") == 0 || remove_last_str.compare("both") == 0) {
+		remove_last_modes.push_back(true);
+	}
+	if (remove_last_modes.empty()) {
+		std::cout << "Error: --remove-last must be off, on or both.\n";
+		all_set = false;
+	}
+
+	boost::split(engine_names, engines_str, boost::is_any_of(","), boost::token_compress_on);
+	for (auto const& name : engine_names) {
+		if (name.compare("bktree") != 0 && name.compare("whitelist") != 0 &&
+			name.compare("brute_force") != 0) {
+			std::cout << "Error: Unknown engine " << name << ".\n";
+			all_set = false;
+		}
+	}
+
+	if (query_count == 0 || min_time < 0) {
+		std::cout << "Error: Invalid query count or time.\n";
+		all_set = false;
+	}
+	rng = std::make_unique<synth_random>(seed);
+	return all_set;
+}
+
+std::string matcher_bench::random_bases(int len) {
+	static const char bases[] = "ACGT";
+	std::string str(len, 'A');
+	for (int i = 0; i < len; i++) {
+		str[i] = bases[rng->below(4)];
+	}
+	return str;
+}
+
+bool matcher_bench::load_dictionary(const std::string& path, dictionary& dict) {
+	std::ifstream words(path);
+	if (!words) {
+		std::cout << "Error: Cannot open " << path << ".\n";
+		return false;
+	}
+	std::set<std::string> seen;
+	std::string lstr;
+	while (std::getline(words, lstr)) {
+		std::vector<std::string> parts;
+		boost::trim(lstr);
+		boost::split(parts, lstr, boost::is_any_of(" \t"), boost::token_compress_on);
+		if (!parts.empty() && !parts.back().empty() && seen.insert(parts.back()).second) {
+			dict.barcodes.push_back(parts.back());
+		}
+	}
+	dict.name = path;
+	if (dict.barcodes.empty()) {
+		std::cout << "Error: No barcodes in " << path << ".\n";
+		return false;
+	}
+	return true;
+}
+
+// Enough bases that the dictionary fills about one in 64 of the possible
+// barcodes, and no fewer than six.
+int matcher_bench::auto_length(size_t size) {
+	int len = 3;
+	while ((1ULL << (2 * len)) < size * 64) {
+		len++;
+	}
+	return len < 6 ? 6 : len;
+}
+
+// Distinct random barcodes. A minimum distance is not enforced; at a
+// million entries that would take longer than the benchmark.
+void matcher_bench::make_dictionary(size_t size, dictionary& dict) {
+	int len = bc_len > 0 ? bc_len : auto_length(size);
+	if (len > 31 || (len < 16 && size > (1ULL << (2 * len)) / 2)) {
+		throw std::invalid_argument("Barcode length " + std::to_string(len) +
+			" does not fit " + std::to_string(size) + " barcodes.");
+	}
+	std::set<std::string> seen;
+	while (dict.barcodes.size() < size) {
+		std::string candidate = random_bases(len);
+		if (seen.insert(candidate).second) {
+			dict.barcodes.push_back(candidate);
+		}
+	}
+	dict.name = "random_" + std::to_string(size);
+}
+
+std::vector<std::string> matcher_bench::make_queries(const std::vector<std::string>& barcodes) {
+	static const char bases[] = "ACGT";
+	int len = barcodes[0].length();
+	std::vector<std::string> queries;
+	queries.reserve(query_count);
+	for (unsigned long q = 0; q < query_count; q++) {
+		std::string query;
+		if (rng->uniform() < foreign_rate) {
+			query = random_bases(len);
+		} else {
+			query = barcodes[rng->below(barcodes.size())];
+		}
+		for (int i = 0; i < len; i++) {
+			double r = rng->uniform();
+			if (r < n_rate) {
+				query[i] = 'N';
+			} else if (r < n_rate + error_rate) {
+				char base = bases[rng->below(3)];
+				query[i] = base == query[i] ? 'T' : base;
+			}
+		}
+		queries.push_back(query);
+	}
+	return queries;
+}
+
+// The queries are replayed in batches until min_time has passed, after a
+// short warm up that is not counted. The batches start at one query and
+// grow, so that a slow case stops soon after min_time too.
+void matcher_bench::measure(matcher_engine& engine, const std::vector<std::string>& queries,
+	case_result& result) {
+
+	typedef std::chrono::steady_clock clock;
+	size_t pos = 0;
+	unsigned long matched = 0;
+	unsigned long ambiguous = 0;
+
+	clock::time_point begin = clock::now();
+	for (size_t q = 0; q < queries.size() && q < 1000; q++) {
+		engine.classify(queries[q]);
+		if (std::chrono::duration<double>(clock::now() - begin).count() > min_time / 10) {
+			break;
+		}
+	}
+
+	unsigned long done = 0;
+	size_t batch = 1;
+	unsigned long allocs_before = alloc_count.load();
+	begin = clock::now();
+	double elapsed = 0;
+	do {
+		for (size_t q = 0; q < batch; q++) {
+			match_result match = engine.classify(queries[pos]);
+			if (match.count == 1) {
+				matched++;
+			} else if (match.count > 1) {
+				ambiguous++;
+			}
+			if (++pos == queries.size()) {
+				pos = 0;
+			}
+		}
+		done += batch;
+		if (batch < 64) {
+			batch *= 2;
+		}
+		elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+	} while (elapsed < min_time && done < max_queries);
+	unsigned long allocs = alloc_count.load() - allocs_before;
+
+	result.queries = done;
+	result.ns_per_query = elapsed * 1e9 / done;
+	result.allocs_per_query = (double) allocs / done;
+	result.matched = (double) matched / done;
+	result.ambiguous = (double) ambiguous / done;
+}
+
+void matcher_bench::write_json(std::ostream& out, const std::vector<case_result>& results) {
+	char date[32];
+	time_t now = time(nullptr);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+	json_writer json(out);
+	json.begin_object();
+	json.field("benchmark", "matcher_bench");
+	json.field("date", std::string(date));
+	json.field("seed", seed);
+	json.field("queries_per_dictionary", query_count);
+	json.field("error_rate", error_rate);
+	json.field("n_rate", n_rate);
+	json.field("foreign_rate", foreign_rate);
+	json.field("min_time", min_time);
+	json.begin_array("results");
+	for (auto const& result : results) {
+		json.begin_object();
+		json.field("engine", result.engine);
+		json.field("dictionary", result.dict);
+		json.field("size", result.size);
+		json.field("bc_len", result.bc_len);
+		json.field("mismatch", result.cutoff);
+		json.field("remove_last", result.remove_last);
+		json.field("build_seconds", result.build_seconds);
+		json.field("queries", result.queries);
+		json.field("ns_per_query", result.ns_per_query);
+		json.field("allocs_per_query", result.allocs_per_query);
+		json.field("matched", result.matched);
+		json.field("ambiguous", result.ambiguous);
+		json.end_object();
+	}
+	json.end_array();
+	json.end_object();
+	out << "\n";
+}
+
+void matcher_bench::print_table(const std::vector<case_result>& results) {
+	std::cout << std::left << std::setw(13) << "engine" << std::right
+		<< std::setw(9) << "size" << std::setw(5) << "len" << std::setw(4) << "m"
+		<< std::setw(4) << "rl" << std::setw(12) << "ns/query" << std::setw(13) << "allocs/query"
+		<< std::setw(9) << "matched" << "\n";
+	std::cout << std::fixed;
+	for (auto const& result : results) {
+		std::cout << std::left << std::setw(13) << result.engine << std::right
+			<< std::setw(9) << result.size << std::setw(5) << result.bc_len
+			<< std::setw(4) << result.cutoff << std::setw(4) << (result.remove_last ? "y" : "n")
+			<< std::setw(12) << std::setprecision(1) << result.ns_per_query
+			<< std::setw(13) << std::setprecision(2) << result.allocs_per_query
+			<< std::setw(9) << std::setprecision(3) << result.matched << "\n";
+	}
+}
+
+bool matcher_bench::run() {
+	typedef std::chrono::steady_clock clock;
+	std::vector<dictionary> dicts;
+	for (auto const& path : dict_files) {
+		dicts.emplace_back();
+		if (!load_dictionary(path, dicts.back())) {
+			return false;
+		}
+	}
+	for (auto size : sizes) {
+		dicts.emplace_back();
+		make_dictionary(size, dicts.back());
+	}
+
+	std::vector<case_result> results;
+	for (auto const& dict : dicts) {
+		std::vector<std::string> queries = make_queries(dict.barcodes);
+		for (auto const& name : engine_names) {
+			clock::time_point begin = clock::now();
+			std::vector<std::string> one(1, name);
+			std::unique_ptr<matcher_engine> engine = std::move(make_engines(dict.barcodes, one)[0]);
+			double build_seconds = std::chrono::duration<double>(clock::now() - begin).count();
+			std::cerr << "Built " << name << " on " << dict.name << " in " << build_seconds << " s\n";
+
+			for (bool remove_last : remove_last_modes) {
+				for (int cutoff : cutoffs) {
+					if (!engine->supports(cutoff, remove_last)) {
+						continue;
+					}
+					engine->prepare(cutoff, remove_last);
+					case_result result;
+					result.engine = name;
+					result.dict = dict.name;
+					result.size = dict.barcodes.size();
+					result.bc_len = dict.barcodes[0].length();
+					result.cutoff = cutoff;
+					result.remove_last = remove_last;
+					result.build_seconds = build_seconds;
+					measure(*engine, queries, result);
+					results.push_back(result);
+				}
+			}
+		}
+	}
+
+	if (out_file.empty()) {
+		write_json(std::cout, results);
+	} else {
+		std::ofstream out(out_file);
+		write_json(out, results);
+		print_table(results);
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	matcher_bench bench;
+	bool all_set = true;
+	try {
+		all_set = bench.parse_args(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << "error: " << e.what() << "\n";
+		return 1;
+	}
+	if (!all_set) {
+		bench.print_help();
+		return 1;
+	}
+	try {
+		return bench.run() ? 0 : 1;
+	} catch (std::exception& e) {
+		std::cerr << "error: " << e.what() << "\n";
+		return 1;
+	}
+}
@@ -0,0 +1,185 @@
+#ifndef _MATCHER_ENGINES_HPP
+#define _MATCHER_ENGINES_HPP
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+#include "BKTree.h"
+#include "packed_barcode.hpp"
+#include "tree_match.hpp"
+#include "whitelist_index.hpp"
+
+// The barcode matchers behind one interface, for the benchmarks and the
+// differential tests. Every engine gives the decision split_engine makes:
+// the smallest distance within the cutoff, how many entries are at that
+// distance, and the entry when there is exactly one. A new engine is one
+// more subclass and one more line in make_engines().
+
+struct match_result {
+    // cutoff + 1 when nothing is within the cutoff
+    int dist;
+    // Entries at dist; 1 is a match, more is ambiguous, 0 no match
+    int count;
+    std::string barcode;
+};
+
+class matcher_engine {
+    public:
+    virtual ~matcher_engine() {
+    }
+
+    virtual const char* name() const = 0;
+
+    // False when the engine cannot serve this cutoff and mode at all.
+    virtual bool supports(int cutoff, bool remove_last, bool n_wildcard = false) const = 0;
+
+    // Called once per cutoff and mode before the queries.
+    virtual void prepare(int cutoff, bool remove_last, bool n_wildcard = false) {
+        this -> cutoff = cutoff;
+        this -> remove_last = remove_last;
+        this -> n_wildcard = n_wildcard;
+    }
+
+    virtual match_result classify(const std::string& query) const = 0;
+
+    protected:
+    int cutoff = 0;
+    bool remove_last = false;
+    bool n_wildcard = false;
+};
+
+// Linear scan over the packed dictionary. Slow, but simple enough to be
+// the reference for the others.
+class brute_force_engine : public matcher_engine {
+    public:
+    explicit brute_force_engine(const std::vector<std::string>& barcodes) {
+        for (auto const& barcode : barcodes) {
+            codes.push_back(packed_barcode::encode(barcode));
+        }
+        this -> barcodes = barcodes;
+    }
+
+    const char* name() const {
+        return "brute_force";
+    }
+
+    bool supports(int, bool, bool) const {
+        return true;
+    }
+
+    match_result classify(const std::string& query) const {
+        match_result result{cutoff + 1, 0, ""};
+        packed_barcode packed = packed_barcode::encode(query);
+        int best = -1;
+        for (size_t i = 0; i < codes.size(); i++) {
+            int dist = packed_distance(codes[i], packed, n_wildcard, remove_last);
+            if (dist > cutoff) {
+                continue;
+            }
+            if (dist < result.dist) {
+                result.dist = dist;
+                result.count = 1;
+                best = i;
+            } else if (dist == result.dist) {
+                result.count++;
+            }
+        }
+        if (result.count == 1) {
+            result.barcode = barcodes[best];
+        }
+        return result;
+    }
+
+    private:
+    std::vector<std::string> barcodes;
+    std::vector<packed_barcode> codes;
+};
+
+// The tree search of the splitters, match_in_tree. safe_cutoff is the one
+// the splitters would take from the dictionary; -1 always counts the ties.
+class bktree_engine : public matcher_engine {
+    public:
+    explicit bktree_engine(const std::vector<std::string>& barcodes, int safe_cutoff = -1) {
+        for (auto const& barcode : barcodes) {
+            tree.insert(barcode);
+        }
+        this -> safe_cutoff = safe_cutoff;
+    }
+
+    const char* name() const {
+        return "bktree";
+    }
+
+    bool supports(int, bool, bool) const {
+        return true;
+    }
+
+    match_result classify(const std::string& query) const {
+        match_result result{cutoff + 1, 0, ""};
+        match_in_tree(tree, query, packed_barcode::encode(query), cutoff, safe_cutoff,
+            n_wildcard, result.dist, result.barcode, result.count, remove_last);
+        if (result.count != 1) {
+            result.barcode.clear();
+        }
+        return result;
+    }
+
+    private:
+    BKTree<std::string> tree;
+    int safe_cutoff;
+};
+
+// Packed whitelist with its seed tables. It has no remove_last or
+// wildcard mode.
+class whitelist_engine : public matcher_engine {
+    public:
+    explicit whitelist_engine(const std::vector<std::string>& barcodes, int threads = 1) {
+        index.build(barcodes, threads);
+    }
+
+    const char* name() const {
+        return "whitelist";
+    }
+
+    bool supports(int cutoff, bool remove_last, bool n_wildcard) const {
+        return !remove_last && !n_wildcard && cutoff <= whitelist_index::MAX_MISMATCH &&
+            (cutoff == 0 || index.length() >= cutoff + 2);
+    }
+
+    void prepare(int cutoff, bool remove_last, bool n_wildcard = false) {
+        matcher_engine::prepare(cutoff, remove_last, n_wildcard);
+        index.build_seeds(cutoff);
+    }
+
+    match_result classify(const std::string& query) const {
+        match_result result{cutoff + 1, 0, ""};
+        int idx = index.find_best(packed_barcode::encode(query), result.dist, result.count);
+        if (result.count == 1) {
+            result.barcode = index.get_barcode(idx);
+        }
+        return result;
+    }
+
+    private:
+    whitelist_index index;
+};
+
+inline std::vector<std::unique_ptr<matcher_engine>> make_engines(
+    const std::vector<std::string>& barcodes, const std::vector<std::string>& names) {
+
+    std::vector<std::unique_ptr<matcher_engine>> engines;
+    for (auto const& name : names) {
+        if (name.compare("brute_force") == 0) {
+            engines.push_back(std::unique_ptr<matcher_engine>(new brute_force_engine(barcodes)));
+        } else if (name.compare("bktree") == 0) {
+            engines.push_back(std::unique_ptr<matcher_engine>(new bktree_engine(barcodes)));
+        } else if (name.compare("whitelist") == 0) {
+            engines.push_back(std::unique_ptr<matcher_engine>(new whitelist_engine(barcodes)));
+        } else {
+            throw std::invalid_argument("Unknown matcher engine: " + name);
+        }
+    }
+    return engines;
+}
+#endif
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+
+# End to end throughput benchmark of the splitters. For every case the
+# synthetic data is generated with fastq_gen (deterministic for a seed), the
+# dictionary is built with dict_builder and the tool is run once or more.
+# The result is one JSON document with, per case, reads/s, input MB/s,
+# wall time, peak RSS and an md5 over the decompressed outputs, so two
+# builds can be compared for speed and for identical output.
+
+import argparse
+import gzip
+import hashlib
+import json
+import os
+import os.path
+import platform
+import shutil
+import subprocess
+import sys
+import time
+
+parser = argparse.ArgumentParser(description = "Run the splitter benchmarks", formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('--bindir', '-b', dest = 'bindir', type = str, default = '.', help = "Directory of the built tools")
+parser.add_argument('--gen', dest = 'gen', type = str, default = None, help = "fastq_gen binary, default bench/fastq_gen next to this script")
+parser.add_argument('--workdir', '-w', dest = 'workdir', type = str, default = 'bench_out', help = "Scratch directory for data and outputs")
+parser.add_argument('--out', '-o', dest = 'out', type = str, default = None, help = "Write the JSON here instead of stdout")
+parser.add_argument('--reads', '-n', dest = 'reads', type = int, default = 200000, help = "Reads per case")
+parser.add_argument('--repeat', '-r', dest = 'repeat', type = int, default = 1, help = "Runs per case, the fastest is reported")
+parser.add_argument('--cases', dest = 'cases', type = str, default = None, help = "Comma separated case names to run, default all")
+parser.add_argument('--plain', dest = 'gzip', action = 'store_false', default = True, help = "Plain instead of gzipped input")
+parser.add_argument('--keep', dest = 'keep', action = 'store_true', default = False, help = "Keep the data and outputs")
+
+args = parser.parse_args()
+
+ldelim = '/'
+script_dir = os.path.dirname(os.path.realpath(__file__))
+gen_bin = args.gen if args.gen else script_dir + ldelim + "fastq_gen"
+
+# name: (tool, layout, generator options, tool options). Tool options may
+# use {dict}, {r1}, {r2}, {i1}, {out} and {prefix}.
+CASES = [
+    ("allseq", "bc_splitter", "allseq", [],
+        ["-d", "{dict}", "--file1", "{r1}", "--file2", "{r2}", "-p", "{prefix}", "-o", "{out}", "-t", "allseq"]),
+    ("rnatagseq", "bc_splitter", "rnatagseq", [],
+        ["-d", "{dict}", "--file1", "{r1}", "--file2", "{r2}", "-p", "{prefix}", "-o", "{out}", "-t", "rnatagseq"]),
+    ("rts", "bc_splitter_rts", "rts", [],
+        ["-d", "{dict}", "--file1", "{r1}", "--file2", "{r2}", "-p", "{prefix}", "-o", "{out}"]),
+    ("rts_se", "bc_splitter_rts_se", "rts_se", [],
+        ["-d", "{dict}", "-f", "{r1}", "-p", "{prefix}", "-o", "{out}"]),
+    ("index", "index_splitter", "index", [],
+        ["-d", "{dict}", "-i", "{i1}", "--file1", "{r1}", "--file2", "{r2}", "-p", "{prefix}", "-o", "{out}"]),
+    ("index_384_m2", "index_splitter", "index", ["--barcodes", "384", "--bc-len", "10", "--min-dist", "5"],
+        ["-d", "{dict}", "-i", "{i1}", "--file1", "{r1}", "--file2", "{r2}", "-p", "{prefix}", "-o", "{out}", "-m", "2"]),
+]
+
+
+def run(cmd, log_path):
+    # Wall time and peak RSS (KB) of the command. wait4 gives the rusage of
+    # this child alone.
+    with open(log_path, "w") as log:
+        start = time.time()
+        proc = subprocess.Popen(cmd, stdout = log, stderr = subprocess.STDOUT)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.time() - start
+    if status != 0:
+        raise RuntimeError("Command failed (status " + str(status) + "), see " + log_path + ": " + " ".join(cmd))
+    peak_kb = usage.ru_maxrss
+    if sys.platform == "darwin":
+        peak_kb = peak_kb // 1024
+    return wall, peak_kb
+
+
+def file_md5(path):
+    md5 = hashlib.md5()
+    opener = gzip.open if path.endswith(".gz") else open
+    with opener(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 20), b""):
+            md5.update(chunk)
+    return md5.hexdigest()
+
+
+def output_checksums(outdir):
+    # FASTQ outputs only; logs and metrics carry timings.
+    sums = {}
+    for lfile in sorted(os.listdir(outdir)):
+        if ".fastq" in lfile or lfile.endswith(".fq") or lfile.endswith(".fq.gz"):
+            sums[lfile] = file_md5(outdir + ldelim + lfile)
+    combined = hashlib.md5()
+    for name in sorted(sums):
+        combined.update((name + " " + sums[name] + "\n").encode())
+    return combined.hexdigest(), sums
+
+
+def run_case(case):
+    name, tool, layout, gen_opts, tool_opts = case
+    case_dir = args.workdir + ldelim + name
+    data_dir = case_dir + ldelim + "data"
+    if os.path.exists(case_dir):
+        shutil.rmtree(case_dir)
+    os.makedirs(data_dir)
+
+    gen_cmd = [gen_bin, "--layout", layout, "-n", str(args.reads), "-o", data_dir, "-p", "synth"] + gen_opts
+    if args.gzip:
+        gen_cmd.append("--gzip")
+    run(gen_cmd, case_dir + ldelim + "gen.log")
+
+    ext = ".fastq.gz" if args.gzip else ".fastq"
+    files = {
+        "dict": data_dir + ldelim + "synth.dict",
+        "r1": data_dir + ldelim + "synth_R1" + ext,
+        "r2": data_dir + ldelim + "synth_R2" + ext,
+        "i1": data_dir + ldelim + "synth_I1" + ext,
+        "prefix": "bench",
+    }
+    run([args.bindir + ldelim + "dict_builder", "-i", data_dir + ldelim + "synth_dict.txt",
+        "-o", files["dict"]], case_dir + ldelim + "dict.log")
+
+    input_files = [files[k] for k in ("r1", "r2", "i1") if os.path.isfile(files[k])]
+    input_bytes = sum(os.path.getsize(f) for f in input_files)
+
+    best = None
+    for rep in range(args.repeat):
+        files["out"] = case_dir + ldelim + "out"
+        if os.path.exists(files["out"]):
+            shutil.rmtree(files["out"])
+        cmd = [args.bindir + ldelim + tool] + [opt.format(**files) for opt in tool_opts]
+        wall, peak_kb = run(cmd, case_dir + ldelim + "run" + str(rep) + ".log")
+        if best is None or wall < best[0]:
+            best = (wall, peak_kb)
+
+    checksum, sums = output_checksums(files["out"])
+    wall, peak_kb = best
+    result = {
+        "tool": tool,
+        "layout": layout,
+        "reads": args.reads,
+        "input_bytes": input_bytes,
+        "wall_seconds": round(wall, 4),
+        "reads_per_second": round(args.reads / wall, 1),
+        "input_mb_per_second": round(input_bytes / wall / (1024 * 1024), 3),
+        "peak_rss_kb": peak_kb,
+        "output_checksum": checksum,
+        "output_files": sums,
+    }
+    if not args.keep:
+        shutil.rmtree(case_dir)
+    return result
+
+
+selected = set(args.cases.split(",")) if args.cases else None
+results = {}
+for case in CASES:
+    if selected is not None and case[0] not in selected:
+        continue
+    print("Running " + case[0], file = sys.stderr)
+    results[case[0]] = run_case(case)
+
+report = {
+    "host": platform.node(),
+    "machine": platform.machine(),
+    "gzip_input": args.gzip,
+    "reads_per_case": args.reads,
+    "cases": results,
+}
+text = json.dumps(report, indent = 2, sort_keys = True)
+if args.out:
+    with open(args.out, "w") as f:
+        f.write(text + "\n")
+else:
+    print(text)
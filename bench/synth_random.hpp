@@ -0,0 +1,31 @@
+#ifndef _SYNTH_RANDOM_HPP
+#define _SYNTH_RANDOM_HPP
+#include <cstdint>
+
+// splitmix64, so that no standard library distribution is involved
+class synth_random {
+    public:
+    explicit synth_random(uint64_t seed) : state(seed) {
+    }
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, n)
+    uint64_t below(uint64_t n) {
+        return next() % n;
+    }
+
+    // Uniform in [0, 1)
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    private:
+    uint64_t state;
+};
+#endif
@@ -6,8 +6,14 @@
 #include <iostream>
 #include <cstdlib> 
 #include <cstring>
+#include <set>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
 
 #include "BKTree.h"
+#include "packed_barcode.hpp"
+#include "whitelist_index.hpp"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -21,8 +27,11 @@ class dict_builder{
 	public:
 	bool parse_args(int argc, char* argv[]);
 	bool build_data();
+	bool build_whitelist();
+	void analyze_data();
 	void save_data();
 	std::string& get_type();
+	bool is_whitelist() const;
 	void print_help();
 	dict_builder();
 	~dict_builder();
@@ -32,6 +41,11 @@ class dict_builder{
 	std::string infile;
 	std::string outfile;
 	std::string ltype;
+	bool analyze = true;
+	bool edit_analysis = false;
+	bool whitelist_mode = false;
+	int threads;
+	whitelist_index whitelist;
     po::options_description desc;
 
 };
@@ -59,6 +73,10 @@ std::string& dict_builder::get_type() {
 	return ltype;
 }
 
+bool dict_builder::is_whitelist() const {
+	return whitelist_mode;
+}
+
 dict_builder::~dict_builder() {
 	// Nothing yet	
 }
@@ -88,7 +106,195 @@ bool dict_builder::build_data() {
 	return true;
 }
 
+// Large whitelists skip the BK-tree. The input is one barcode per line,
+// or the usual <index> <barcode> lines; the last word of the line is taken.
+bool dict_builder::build_whitelist() {
+	std::ifstream words(infile);
+	if (!words.is_open()) {
+		std::cerr << "The infile cannot be open!\n";
+		return false;
+	}
+
+	std::vector<std::string> barcodes;
+	std::string lstr;
+	while (std::getline(words, lstr)) {
+		size_t end = lstr.find_last_not_of(" \t\r");
+		if (end == std::string::npos) {
+			continue;
+		}
+		size_t begin = lstr.find_last_of(" \t", end);
+		begin = (begin == std::string::npos) ? 0 : begin + 1;
+		barcodes.push_back(lstr.substr(begin, end - begin + 1));
+	}
+
+	whitelist.build(barcodes, threads);
+	std::cout << "Loaded " << whitelist.size() << " distinct entries of length " 
+		<< whitelist.length() << " (" << barcodes.size() << " lines)" << std::endl;
+	return true;
+}
+
+// Myers' bit-parallel edit distance, one machine word holds the whole
+// column of the DP matrix. Both strings have to be at most 64 long.
+static int edit_distance(const std::string& a, const std::string& b) {
+	const int m = a.length();
+	uint64_t peq[256] = {0};
+	for (int i = 0; i < m; i++) {
+		peq[(unsigned char) a[i]] |= 1ULL << i;
+	}
+	uint64_t pv = ~0ULL;
+	uint64_t mv = 0;
+	uint64_t high = 1ULL << (m - 1);
+	int score = m;
+	for (size_t j = 0; j < b.length(); j++) {
+		uint64_t eq = peq[(unsigned char) b[j]];
+		uint64_t xv = eq | mv;
+		uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+		if (ph & high) {
+			score++;
+		} else if (mh & high) {
+			score--;
+		}
+		ph = (ph << 1) | 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+	}
+	return score;
+}
+
+// Find how close the barcodes are to each other. If no two barcodes are
+// within 2k of each other, a read can be within k of at most one of them,
+// so the splitters can skip the tie counting for --mismatch up to k.
+// The minimum is stored in the tree for that purpose.
+void dict_builder::analyze_data() {
+	if (!analyze) {
+		return;
+	}
+	std::set<std::string> nodes = tree.get_nodes();
+	std::vector<std::string> barcodes(nodes.begin(), nodes.end());
+	const size_t n = barcodes.size();
+	if (n == 0) {
+		return;
+	}
+
+	const int len = barcodes[0].length();
+	bool packable = len <= packed_barcode::MAX_LEN;
+	for (auto const& barcode : barcodes) {
+		if ((int) barcode.length() != len) {
+			throw my_exception("Barcodes in the dictionary have different length.\n");
+		}
+		if (packable && packed_barcode::encode(barcode).nmask != 0) {
+			packable = false;
+		}
+	}
+
+	// A single barcode can never be ambiguous; any distance above twice
+	// its length says so.
+	int dmin = 2 * len + 1;
+	int dmin_trimmed = 2 * len - 1;
+
+	// The closest pairs are named as the minimum is found: a smaller
+	// distance restarts the list, an equal one adds to it.
+	const size_t max_listed = 10;
+	unsigned long closest_count = 0;
+	std::vector<std::pair<std::string, std::string>> closest;
+	auto note_pair = [&](size_t i, size_t j, int d) {
+		if (d < dmin) {
+			dmin = d;
+			closest_count = 0;
+			closest.clear();
+		}
+		closest_count++;
+		if (closest.size() < max_listed) {
+			closest.push_back(std::make_pair(barcodes[i], barcodes[j]));
+		}
+	};
+
+	if (packable) {
+		// Word parallel kernel, each pair is one xor and a popcount. Only
+		// the pairs at or below the minimum so far take the branch.
+		std::vector<uint64_t> bits(n);
+		for (size_t i = 0; i < n; i++) {
+			bits[i] = packed_barcode::encode(barcodes[i]).bits;
+		}
+		const uint64_t full = packed_barcode::slot_mask(len);
+		const uint64_t trimmed = packed_barcode::slot_mask(len - 1);
+		for (size_t i = 0; i < n; i++) {
+			const uint64_t bi = bits[i];
+			int row_min_trimmed = dmin_trimmed;
+			for (size_t j = i + 1; j < n; j++) {
+				uint64_t x = bi ^ bits[j];
+				uint64_t diff = x | (x >> 1);
+				int d = __builtin_popcountll(diff & full);
+				int dt = __builtin_popcountll(diff & trimmed);
+				if (d <= dmin) {
+					note_pair(i, j, d);
+				}
+				row_min_trimmed = dt < row_min_trimmed ? dt : row_min_trimmed;
+			}
+			dmin_trimmed = std::min(dmin_trimmed, row_min_trimmed);
+		}
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			for (size_t j = i + 1; j < n; j++) {
+				int d = 0;
+				int dt = 0;
+				for (int k = 0; k < len; k++) {
+					if (barcodes[i][k] != barcodes[j][k]) {
+						d++;
+						if (k < len - 1) {
+							dt++;
+						}
+					}
+				}
+				if (d <= dmin) {
+					note_pair(i, j, d);
+				}
+				dmin_trimmed = std::min(dmin_trimmed, dt);
+			}
+		}
+	}
+
+	tree.set_min_distance(dmin, dmin_trimmed);
+
+	if (n == 1) {
+		std::cout << "Single barcode, no pairwise distance.\n";
+	} else {
+		std::cout << "Minimum pairwise distance: " << dmin << " (" 
+			<< closest_count << " pairs)\n";
+		for (auto const& pair : closest) {
+			std::cout << "\t" << pair.first << " " << pair.second << "\n";
+		}
+		std::cout << "Minimum pairwise distance without the last base: "
+			<< dmin_trimmed << "\n";
+	}
+	std::cout << "Largest mismatch cutoff without ambiguity: " 
+		<< tree.safe_cutoff() << " (" << tree.safe_cutoff(true) 
+		<< " without the last base)\n";
+
+	if (edit_analysis && n > 1) {
+		if (len > 64) {
+			std::cout << "Barcodes are too long for the edit distance analysis.\n";
+		} else {
+			int edit_min = len;
+			for (size_t i = 0; i < n; i++) {
+				for (size_t j = i + 1; j < n; j++) {
+					edit_min = std::min(edit_min, edit_distance(barcodes[i], barcodes[j]));
+				}
+			}
+			std::cout << "Minimum pairwise edit distance: " << edit_min << "\n";
+		}
+	}
+}
+
 void dict_builder::save_data() {
+
+	if (whitelist_mode) {
+		whitelist.save(outfile);
+		return;
+	}
     
 	std::ofstream ofs(outfile);
     boost::archive::text_oarchive oa(ofs);
@@ -105,6 +311,11 @@ bool dict_builder::parse_args(int argc, char* argv[]) {
         ("help,h", "produce help mesage")
         ("infile,i", po::value<std::string>(&infile), "Input file")
         ("outfile,o", po::value<std::string>(&outfile), "Output file")
+        ("no-analysis", "Optional/Skip the pairwise distance analysis")
+        ("edit-distance", "Optional/Also report the minimum pairwise edit distance")
+        ("whitelist", "Optional/Build a packed dictionary for large whitelists")
+        ("threads", po::value<int>(&threads)->default_value(std::thread::hardware_concurrency()),
+            "Optional/Threads used to build a whitelist")
     ;
 
     po::variables_map vm;
@@ -134,6 +345,13 @@ bool dict_builder::parse_args(int argc, char* argv[]) {
         std::cout << "Outfile is set to: " << outfile << ".\n";
     }
 
+    analyze = !vm.count("no-analysis");
+    edit_analysis = vm.count("edit-distance");
+    whitelist_mode = vm.count("whitelist");
+    if (whitelist_mode) {
+        std::cout << "Building a whitelist dictionary with " << threads << " threads.\n";
+    }
+
 
 	return all_set;
 }
@@ -161,7 +379,20 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
-	ldict.build_data();
+	if (ldict.is_whitelist()) {
+		try {
+			if (!ldict.build_whitelist()) {
+				return 1;
+			}
+		} catch(std::invalid_argument& e) {
+			std::cerr << "error: " << e.what() << "\n";
+			return 1;
+		}
+	} else {
+		ldict.build_data();
+
+		ldict.analyze_data();
+	}
 
 	ldict.save_data();
         
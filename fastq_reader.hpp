@@ -4,8 +4,124 @@
 #include <boost/iostreams/filter/gzip.hpp>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 namespace bio = boost::iostreams;
 
+// How a file that is still being written is followed: at the end of the
+// data so far the reader waits for more, looking every poll seconds, until
+// the sentinel file exists or nothing came for timeout seconds (0 waits
+// for ever). on_wait is called when a wait begins, e.g. to write out what
+// is buffered.
+struct follow_options {
+    std::string sentinel;
+    double timeout = 600;
+    double poll = 1;
+    std::function<void()> on_wait;
+};
+
+// A file or FIFO read while it grows. The end of the data so far is not
+// the end of the input, so a record cut off there is completed by a later
+// read, and a gzip stream is inflated as far as it has been written.
+class follow_device {
+    public:
+    typedef char char_type;
+    typedef bio::source_tag category;
+
+    follow_device(const std::string& path, const follow_options& options)
+        : state(std::make_shared<follow_state>()) {
+
+        state->path = path;
+        state->options = options;
+    }
+
+    std::streamsize read(char* s, std::streamsize n) {
+        follow_state& st = *state;
+        bool waiting = false;
+        auto wait_start = std::chrono::steady_clock::now();
+        while (true) {
+            if (st.fd < 0) {
+                // Nonblocking, so that a FIFO without a writer yet opens too.
+                st.fd = ::open(st.path.c_str(), O_RDONLY | O_NONBLOCK);
+            }
+            if (st.fd >= 0) {
+                ssize_t got = ::read(st.fd, s, n);
+                if (got > 0) {
+                    st.pos += got;
+                    return got;
+                }
+                if (got < 0 && errno != EAGAIN && errno != EINTR) {
+                    throw std::ios_base::failure("Could not read " + st.path + ".");
+                }
+            }
+            if (st.done) {
+                return -1;
+            }
+
+            // Once the sentinel is there, what is left is read to the end.
+            struct stat buffer;
+            if (!st.options.sentinel.empty() &&
+                stat(st.options.sentinel.c_str(), &buffer) == 0) {
+                st.done = true;
+                continue;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (!waiting) {
+                waiting = true;
+                wait_start = now;
+                if (st.options.on_wait) {
+                    st.options.on_wait();
+                }
+            } else if (st.options.timeout > 0 &&
+                std::chrono::duration<double>(now - wait_start).count() >= st.options.timeout) {
+                std::cerr << "No new data in " << st.path << " for " << st.options.timeout
+                    << " seconds, taking it as the end.\n";
+                st.done = true;
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::duration<double>(st.options.poll));
+        }
+    }
+
+    // Bytes of the file read so far
+    unsigned long position() const {
+        return state->pos;
+    }
+
+    private:
+    struct follow_state {
+        ~follow_state() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        std::string path;
+        follow_options options;
+        int fd = -1;
+        unsigned long pos = 0;
+        bool done = false;
+    };
+
+    std::shared_ptr<follow_state> state;
+};
+
+// Reads that do not come as FASTQ text, e.g. from a BAM file, handed out
+// as the four lines of a FASTQ record each.
+class record_source {
+    public:
+    virtual ~record_source() {}
+    virtual bool getline(std::string& line) = 0;
+    // Position in the file on disk
+    virtual unsigned long file_pos() = 0;
+};
+
 
 class fastq_reader {
     public:
@@ -16,12 +132,42 @@ class fastq_reader {
         file = std::ifstream(infile_str, mode);
         if (has_suffix(infile_str, ".gz")) {
             in.push(bio::gzip_decompressor());
-        } 
+        } else {
+            seekable = true;
+        }
         in.push(file);
     }
 
+    // Reads from a boost iostreams source instead, e.g. a shard_device
+    // for a part of a file.
+    template <typename Source>
+    fastq_reader(const std::string& infile_str, const Source& source) {
+        this -> infile_str = infile_str;
+        in.push(source);
+    }
+
+    // Follows a file that is still being written, see follow_options.
+    fastq_reader(const std::string& infile_str, const follow_options& follow) {
+        this -> infile_str = infile_str;
+        follower = std::make_unique<follow_device>(infile_str, follow);
+        if (has_suffix(infile_str, ".gz")) {
+            in.push(bio::gzip_decompressor());
+        }
+        in.push(*follower);
+    }
+
+    // Takes the lines from a record_source; the pointer is of that type so
+    // that the Source constructor does not take it.
+    fastq_reader(const std::string& infile_str, const std::shared_ptr<record_source>& records) {
+        this -> infile_str = infile_str;
+        this -> records = records;
+    }
+
     bool getline(std::string& line) {
-      if(std::getline(in, line)) {
+      if (records ? records->getline(line) : (bool) std::getline(in, line)) {
+          // The last line of a file may have no newline, and then the
+          // stream is at its end.
+          bytes_read += line.size() + (!records && in.eof() ? 0 : 1);
           return true;
       } else {
           return false;
@@ -29,6 +175,50 @@ class fastq_reader {
     }
 
 
+    // Starts at offset bytes into the (uncompressed) text, e.g. where a
+    // checkpoint left off; to be called before the first getline. A plain
+    // file is sought, anything else is read through. False if the input
+    // is shorter than that.
+    bool skip_to(unsigned long offset) {
+        if (records) {
+            return false;
+        }
+        if (seekable) {
+            // Nothing is buffered yet, so the file can be moved under the chain.
+            file.seekg(0, std::ios_base::end);
+            std::streampos size = file.tellg();
+            if (size < 0 || (unsigned long) size < offset) {
+                return false;
+            }
+            file.seekg(offset);
+        } else {
+            in.ignore(offset);
+            if ((unsigned long) in.gcount() != offset) {
+                return false;
+            }
+        }
+        bytes_read = offset;
+        return true;
+    }
+
+    // Bytes of (uncompressed) text returned so far, newlines included.
+    unsigned long get_bytes_read() const {
+        return bytes_read;
+    }
+
+    // Position in the file on disk, i.e. compressed bytes consumed for a
+    // gzip input. A system call, so not something to ask for every line.
+    unsigned long get_file_pos() {
+        if (follower) {
+            return follower->position();
+        }
+        if (records) {
+            return records->file_pos();
+        }
+        std::streampos pos = file.tellg();
+        return pos < 0 ? 0 : (unsigned long) pos;
+    }
+
    bool has_suffix(const std::string &str, const std::string &suffix) {
        return str.size() >= suffix.size() &&
            str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
@@ -38,6 +228,10 @@ class fastq_reader {
     std::string infile_str;
     bio::filtering_istream in;
     std::ifstream file;
+    unsigned long bytes_read = 0;
+    bool seekable = false;
+    std::unique_ptr<follow_device> follower;
+    std::shared_ptr<record_source> records;
 
 
 };
@@ -8,10 +8,28 @@
 #include <set>
 #include <cctype>
 #include <memory>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <sstream>
 
 #include "BKTree.h"
 #include "fastq_reader.hpp"
 #include "fastq_writer.hpp"
+#include "quality_matcher.hpp"
+#include "packed_barcode.hpp"
+#include "tree_match.hpp"
+#include "space_saving.hpp"
+#include "run_metrics.hpp"
+#include "progress_reporter.hpp"
+#include "stage_timer.hpp"
+#include "trace_recorder.hpp"
+#include "lane_reader.hpp"
+#include "stream_output.hpp"
+#include "bam_writer.hpp"
+#include "bam_reader.hpp"
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -22,6 +40,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <dirent.h>
 
 namespace po = boost::program_options;
 
@@ -31,6 +50,49 @@ struct classcomp {
 	}
 };
 
+// The index read and the read pair, and what the search found for the
+// index
+struct indexed_pair {
+	// The words starting with indword
+	std::string indword1;
+	std::string indword2;
+	std::string indword3;
+	std::string indword4;
+ 
+	// The words starting with lword is for read 1
+	std::string lword1;
+	std::string lword2;
+	std::string lword3;
+	std::string lword4;
+
+	// The words starting with rword is for read 2
+	std::string rword1;
+	std::string rword2;
+	std::string rword3;
+	std::string rword4;
+
+	packed_barcode packed_str;
+	bool n_rejected = false;
+	bool sampled_out = false;
+
+	int smallest_dist;
+	std::string smallest_barcode;
+	int smallest_count;
+	bool qual_rescued;
+};
+
+// One sample of a batch: the prefix of its outputs and its three inputs,
+// as given and as expanded into files
+struct sample_files {
+	std::string prefix;
+	std::string index_file;
+	std::string file1;
+	std::string file2;
+	std::vector<std::string> index_list;
+	std::vector<std::string> file1_list;
+	std::vector<std::string> file2_list;
+};
+
 
 class bc_splitter {
 
@@ -49,10 +111,32 @@ class bc_splitter {
     	unsigned long totalcap);	
 
 	void writeMapsToFile();
+	unsigned long buffer_bam(const indexed_pair& rec, const std::string& write_barcode);
 	void split_engine();
+	static bool read_indexed_pair(std::vector<std::unique_ptr<fastq_reader>>& files,
+		indexed_pair& rec);
+	static bool read_header_indexed_pair(std::vector<std::unique_ptr<fastq_reader>>& files,
+		indexed_pair& rec, bool check);
+	void extract_barcode(indexed_pair& rec) const;
+	void match_barcode(indexed_pair& rec) const;
 	void write_log();
-	BKTree<std::string>& getTree();
-	void initialize();
+	void write_metrics(unsigned long total_reads);
+	void publish_progress(unsigned long reads, std::vector<fastq_reader*> readers);
+	void publish_progress(unsigned long reads, unsigned long input_bytes,
+		unsigned long input_file_pos);
+	void write_top_unmatched(std::ofstream& log_freq, unsigned long total_reads);
+	void nearest_search(const std::set<std::string>& nodes, const std::string& query,
+		std::string& nearest, int& nearest_dist, int& ties);
+	const BKTree<std::string>& getTree() const;
+	void initialize(std::shared_ptr<const BKTree<std::string>> shared_tree = nullptr);
+	static std::shared_ptr<const BKTree<std::string>> load_tree(const std::string& dict_file);
+	void set_output(std::ostream& out, const std::string& tool_name);
+	bool is_batch() const;
+	int batch_engine();
+	bool collect_samples(std::vector<sample_files>& samples);
+	bool run_sample(const sample_files& sample,
+		std::shared_ptr<const BKTree<std::string>> shared_tree);
+	void set_inputs(const sample_files& sample);
 	void print_help();
     bool has_suffix(const std::string &str, const std::string &suffix);
     std::unique_ptr<bio::filtering_istream> get_instream(std::string infile_str);
@@ -64,6 +148,10 @@ class bc_splitter {
     std::string indfile_str;
 	std::string file1_str;
 	std::string file2_str;
+	// The lanes, from the lists and patterns in the three above
+	std::vector<std::string> indfile_list;
+	std::vector<std::string> file1_list;
+	std::vector<std::string> file2_list;
 	std::string prefix_str;
 	std::string outdirpath;
 	int allowed_MB;
@@ -78,7 +166,10 @@ class bc_splitter {
 	std::map<std::string, unsigned long> zero_dist_map;
 	std::map<std::string, unsigned long> one_dist_map;
 	std::map<std::string, unsigned long> higher_dist_map;
-    BKTree<std::string> tree;
+	// Matches that only --qual-assign made
+	std::map<std::string, unsigned long> rescued_map;
+    // Shared, read only, by the samples of a batch
+    std::shared_ptr<const BKTree<std::string>> tree;
 	po::options_description desc;
 	std::map<int, int> distmap;
 	std::multimap<double, std::string, classcomp> bar_map;
@@ -92,7 +183,96 @@ class bc_splitter {
 	unsigned long  match_total = 0;
 	unsigned long ambiguous_total = 0;
 	unsigned long no_match_total = 0;
-
+	unsigned long qual_rescued_total = 0;
+
+	// Quality-aware rescue of ambiguous and no_match reads
+	bool qual_assign = false;
+	double min_posterior;
+	double null_prior;
+	std::unique_ptr<quality_matcher> qmatcher;
+
+	// Handling of N bases in the barcode
+	std::string n_mode;
+	bool n_wildcard = false;
+	int max_n;
+	unsigned long n_rejected_total = 0;
+
+	// Largest cutoff for which the dictionary guarantees no ties
+	int safe_cutoff = -1;
+
+	// Most frequent barcodes among the ambiguous and no_match reads
+	int top_unmatched;
+	int unmatched_capacity;
+	space_saving<std::string> unmatched_sketch;
+
+	// Machine readable metrics next to the frequency log
+	std::string metrics_format;
+	run_metrics metrics;
+	std::set<std::string> output_paths;
+
+	// Live progress on stderr and/or in a status file
+	double progress_interval;
+	std::string status_file;
+	progress_counters progress;
+	std::unique_ptr<progress_reporter> reporter;
+
+	// Wall time per stage of the splitting loop
+	stage_timer timer;
+	unsigned long perf_every;
+
+	// Chrome trace of the run
+	std::string trace_file;
+	std::unique_ptr<trace_recorder> tracer;
+
+	// Classification and counts only, optionally of part of the input
+	bool count_only = false;
+	unsigned long max_reads;
+	double sample_fraction;
+	unsigned long sample_seed;
+	unsigned long input_reads_total = 0;
+	unsigned long sampled_out_total = 0;
+
+	// Barcodes written to FIFOs or commands instead of files
+	std::string stream_file;
+	std::unique_ptr<stream_outputs> streams;
+
+	// Read 1 and read 2, and maybe the index read, of each read in turn in
+	// one file per barcode
+	bool interleaved = false;
+	bool interleave_index = false;
+
+	// Unaligned BAM instead of FASTQ, the records of a flush buffered per
+	// output already encoded
+	bool bam_output = false;
+	// Both reads from one unaligned BAM file1, the index from its BC and QT
+	// tags, instead of three FASTQ files
+	bool bam_input = false;
+	int bam_threads;
+
+	// The index from the comment of the read 1 header instead of an index
+	// file, optionally checked against the read 2 header
+	bool index_from_header = false;
+	bool check_header_index = false;
+	std::unique_ptr<bgzf_pool> bam_pool;
+	std::map<std::string, std::unique_ptr<bam_writer>> bam_writer_map;
+	std::map<std::string, std::string> bamQueueMap;
+
+	// Console output, the per sample _out.txt in a batch
+	std::ostream* out = &std::cout;
+	std::string tool_name = "index_splitter";
+
+	// Batch of samples from a manifest or an input directory
+	bool batch = false;
+	std::string manifest_file;
+	std::string indir;
+	int threads;
+	// The command line options the samples of a batch share
+	std::vector<std::string> sample_args;
+	// The memory of a sample, the batch's over the samples split at a time
+	int sample_allowed_MB;
+	// The input lists of a sample come from the batch, already expanded:
+	// glob is not for the worker threads.
+	bool inputs_set = false;
 
 };
 
@@ -106,25 +286,57 @@ class my_exception : public std::exception {
 
 
 void bc_splitter::print_help() {
-    std::cout << desc << "\n";
-	std::cout << "Usage: bc_splitter_rts -d <dict_file> "
+    *out << desc << "\n";
+	*out << "Usage: bc_splitter_rts -d <dict_file> "
         "-i <index-file> --file1 <file1> --file2 <file2> "
         "-p <prefix_str> -o <outdir>\n\n";
 }
 
 
-BKTree<std::string>& bc_splitter::getTree() {
-	return tree;
+const BKTree<std::string>& bc_splitter::getTree() const {
+	return *tree;
 }
 
-
-void bc_splitter::initialize() {
+std::shared_ptr<const BKTree<std::string>> bc_splitter::load_tree(const std::string& dict_file) {
+	auto ltree = std::make_shared<BKTree<std::string>>();
 	std::ifstream iff(dict_file);
     boost::archive::text_iarchive iar(iff);
-        
-    iar >> tree;
+    iar >> *ltree;
+	return ltree;
+}
+
+void bc_splitter::set_output(std::ostream& out, const std::string& tool_name) {
+	this -> out = &out;
+	this -> tool_name = tool_name;
+}
+
+// A batch loads the dictionary once and hands it to every sample.
+void bc_splitter::initialize(std::shared_ptr<const BKTree<std::string>> shared_tree) {
+	auto load_start = std::chrono::steady_clock::now();
+
+	tree = shared_tree ? shared_tree : load_tree(dict_file);
     // Get all the nodes
-    all_nodes = tree.get_nodes();
+    all_nodes = tree->get_nodes();
+
+	unmatched_sketch = space_saving<std::string>(unmatched_capacity);
+
+	safe_cutoff = tree->safe_cutoff();
+	if (safe_cutoff >= 0) {
+		*out << "Dictionary minimum distance is " << tree->get_min_distance()
+			<< ", mismatch up to " << safe_cutoff << " cannot be ambiguous.\n";
+	}
+
+	if (qual_assign) {
+		qmatcher = std::make_unique<quality_matcher>(all_nodes,
+			min_posterior, null_prior);
+	}
+
+	auto load_end = std::chrono::steady_clock::now();
+	std::chrono::duration<double> load_time = load_end - load_start;
+	metrics.load_seconds = load_time.count();
+	if (tracer) {
+		tracer->complete("load_dictionary", load_start, load_end, dict_file);
+	}
 
 	struct stat st = {0};
 
@@ -138,19 +350,85 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 	desc.add_options()
 		("help,h", "produce help message")
 		("dict-file,d", po::value<std::string>(&dict_file), "Dictionary file")
-		("index-file,i", po::value<std::string>(&indfile_str), "P7 index file")
-		("file1", po::value<std::string>(&file1_str), "First file")
-		("file2", po::value<std::string>(&file2_str), "Second file")
+		("index-file,i", po::value<std::string>(&indfile_str),
+			"P7 index file, or a comma separated list or glob of lane files")
+		("file1", po::value<std::string>(&file1_str),
+			"First file, or the lane files, or an unaligned BAM of both reads and the index."
+			" Lanes are read in parallel and their read pairs come out 4096 of each lane in"
+			" turn, not lane after lane")
+		("file2", po::value<std::string>(&file2_str), "Second file, or the lane files")
 		("prefix,p", po::value<std::string>(&prefix_str), "Prefix string")
 		("outdir,o", po::value<std::string>(&outdirpath), "Output directory")	
 		("mismatch,m", po::value(&cutoff)->default_value(1), 
 			"Optional/Maximum allowed mismatches.")
 		("allowed-mb", po::value(&allowed_MB)->default_value(2048),
-			"Optional/Estimated memory requirement in MB.")
+			"Optional/Estimated memory requirement in MB. A batch shares it between the"
+			" samples split at the same time")
+		("qual-assign", "Optional/Use base qualities to assign ambiguous and no_match reads")
+		("min-posterior", po::value(&min_posterior)->default_value(0.99),
+			"Optional/Posterior needed for a quality-aware assignment")
+		("null-prior", po::value(&null_prior)->default_value(0.05),
+			"Optional/Prior that a barcode is not in the dictionary")
+		("metrics", po::value(&metrics_format)->default_value("json"),
+			"Optional/Metrics file format: json/tsv/both/none")
+		("progress", po::value(&progress_interval)->default_value(0),
+			"Optional/Print progress to stderr every this many seconds, 0 to turn off")
+		("status-file", po::value(&status_file),
+			"Optional/JSON file rewritten with the progress, every 60 seconds"
+			" unless --progress is given")
+		("stage-timing", "Optional/Print the time spent in each stage of the splitting loop")
+		("perf-counters", "Optional/Print hardware counters for each stage of the splitting loop")
+		("perf-every", po::value(&perf_every)->default_value(64),
+			"Optional/Read the hardware counters through every this many reads")
+		("trace", po::value(&trace_file),
+			"Optional/Write a Chrome trace of the run to this JSON file")
+		("top-unmatched", po::value(&top_unmatched)->default_value(20),
+			"Optional/Unmatched barcodes listed in the log, 0 to turn off")
+		("unmatched-capacity", po::value(&unmatched_capacity)->default_value(4096),
+			"Optional/Distinct unmatched barcodes tracked for that list")
+		("n-mode", po::value(&n_mode)->default_value("mismatch"),
+			"Optional/N in the barcode counts as mismatch/wildcard")
+		("max-n", po::value(&max_n)->default_value(-1),
+			"Optional/Barcodes with more Ns are no_match, default is --mismatch")
+		("count-only", "Optional/Classify and count the reads for the log and metrics,"
+			" write no FASTQ files")
+		("max-reads", po::value(&max_reads)->default_value(0),
+			"Optional/Stop after this many reads, 0 for all")
+		("sample-fraction", po::value(&sample_fraction)->default_value(1.0),
+			"Optional/Classify only this random fraction of the reads")
+		("sample-seed", po::value(&sample_seed)->default_value(1),
+			"Optional/Seed of the read sampling")
+		("interleaved", "Optional/Write read 1 and read 2 in turn to one"
+			" <prefix>.<barcode>.unmapped.fastq.gz per barcode")
+		("interleave-index", "Optional/Like --interleaved, with the index read"
+			" after read 2 instead of in its own file")
+		("bam", "Optional/Write an unaligned BAM per barcode instead of FASTQ, with the"
+			" index read in BC/QT tags")
+		("bam-threads", po::value(&bam_threads)->default_value(2),
+			"Optional/Threads that compress the BAM output or inflate a BAM input")
+		("stream", po::value(&stream_file),
+			"Optional/File of <barcode> <target> lines, read 1 and 2 of these barcodes go"
+			" to the target FIFO (fifo:<path>[,<path2>]) or command instead of files."
+			" Half of --allowed-mb is then kept for what waits to be streamed")
+		("index-from-header", "Optional/Take the index from the read 1 headers,"
+			" <name> 1:N:0:<index>[+<index2>], instead of an index file. The headers are"
+			" written unchanged and there are no barcode_1 outputs")
+		("check-header-index", "Optional/With --index-from-header, stop where the read 2"
+			" header has another index")
+		("manifest", po::value(&manifest_file),
+			"Optional/Split every sample of this file, one"
+			" <prefix> <index-file> <file1> <file2> per line (index-file unused with"
+			" --index-from-header)")
+		("indir", po::value(&indir),
+			"Optional/Split every sample of this directory, named"
+			" <prefix>.<lane>.{barcode_1,1,2}.fastq.gz")
+		("threads", po::value(&threads)->default_value(1),
+			"Optional/Samples of a batch split at the same time")
 	;
 
 	po::variables_map vm;
-    po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::parsed_options parsed = po::parse_command_line(argc, argv, desc);
+    po::store(parsed, vm);
     po::notify(vm);
 
 	
@@ -162,42 +440,218 @@ bool bc_splitter::parse_args(int argc, char* argv[]) {
 	}
 
 
-	std::cout << "Max mismatch is set to " << cutoff << ".\n";
+	*out << "Max mismatch is set to " << cutoff << ".\n";
+
+	boost::to_lower(n_mode);
+	boost::trim(n_mode);
+	if (n_mode.compare("wildcard") == 0) {
+		n_wildcard = true;
+	} else if (n_mode.compare("mismatch") != 0) {
+		*out << "Error: Invalid n-mode option.\n";
+		all_set = false;
+	}
+	if (max_n < 0) {
+		max_n = cutoff;
+	}
+	*out << "N-mode is set to " << n_mode << ", max N is set to " << max_n << ".\n";
+
+	boost::to_lower(metrics_format);
+	boost::trim(metrics_format);
+	if (metrics_format.compare("json") != 0 && metrics_format.compare("tsv") != 0 &&
+		metrics_format.compare("both") != 0 && metrics_format.compare("none") != 0) {
+		*out << "Error: Invalid metrics option.\n";
+		all_set = false;
+	}
+
+	timer = stage_timer(vm.count("stage-timing") > 0);
+	if (!trace_file.empty()) {
+		tracer = std::make_unique<trace_recorder>();
+		tracer->name_thread("split");
+		timer.attach_trace(tracer.get());
+	}
+	if (vm.count("perf-counters")) {
+		std::string perf_error;
+		if (!timer.enable_counters(perf_every, perf_error)) {
+			*out << "Performance counters are not available (" << perf_error
+				<< "), going on without them.\n";
+		}
+	}
+
+	if (progress_interval < 0) {
+		*out << "Error: Invalid progress interval.\n";
+		all_set = false;
+	}
+
+	count_only = vm.count("count-only");
+	if (count_only) {
+		*out << "Count only, no FASTQ files are written.\n";
+	}
+	if (sample_fraction <= 0 || sample_fraction > 1) {
+		*out << "Error: The sample fraction must be in (0, 1].\n";
+		all_set = false;
+	} else if (sample_fraction < 1) {
+		*out << "Sample fraction is set to " << sample_fraction << ".\n";
+	}
+	interleave_index = vm.count("interleave-index");
+	interleaved = interleave_index || vm.count("interleaved");
+	if (interleaved) {
+		*out << "Read 1 and read 2" << (interleave_index ? " and the index read" : "")
+			<< " are interleaved in one file per barcode.\n";
+	}
+	bam_output = vm.count("bam");
+	if (bam_output) {
+		if (interleaved || count_only || !stream_file.empty()) {
+			*out << "Error: --bam is not for --interleaved, --count-only or --stream.\n";
+			all_set = false;
+		} else if (bam_threads < 0) {
+			*out << "Error: Invalid number of BAM threads.\n";
+			all_set = false;
+		} else {
+			*out << "Unaligned BAM output, " << bam_threads << " compression threads.\n";
+		}
+	}
+	if (!stream_file.empty()) {
+		if (count_only) {
+			*out << "Error: Streamed outputs are not for --count-only.\n";
+			all_set = false;
+		} else {
+			*out << "Streamed outputs are set in " << stream_file << ".\n";
+		}
+	}
+	if (max_reads > 0) {
+		*out << "Max reads is set to " << max_reads << ".\n";
+	}
+
+	qual_assign = vm.count("qual-assign");
+	if (qual_assign) {
+		*out << "Quality-aware assignment is on, min posterior " 
+			<< min_posterior << ", null prior " << null_prior << ".\n";
+	}
+
+	// The index quality is not in the header, so there is none to weigh.
+	index_from_header = vm.count("index-from-header");
+	check_header_index = vm.count("check-header-index");
+	if (index_from_header) {
+		if (qual_assign) {
+			*out << "Error: --qual-assign needs the index qualities, not --index-from-header.\n";
+			all_set = false;
+		} else if (interleave_index) {
+			*out << "Error: --interleave-index needs an index read, not --index-from-header.\n";
+			all_set = false;
+		} else {
+			*out << "The index comes from the read 1 headers" << (check_header_index ?
+				", checked against read 2" : "") << ".\n";
+		}
+	} else if (check_header_index) {
+		*out << "Error: --check-header-index is for --index-from-header.\n";
+		all_set = false;
+	}
+
+	// In a batch every sample is run with the shared options plus its own
+	// inputs and prefix, so its outputs are those of a run of its own.
+	batch = vm.count("manifest") || vm.count("indir");
+	if (batch) {
+		if (vm.count("manifest") && vm.count("indir")) {
+			*out << "Error: Set either --manifest or --indir.\n";
+			all_set = false;
+		}
+		if (vm.count("index-file") || vm.count("file1") || vm.count("file2") ||
+			vm.count("prefix")) {
+			*out << "Error: The input files and the prefix come from the batch.\n";
+			all_set = false;
+		}
+		if (!trace_file.empty() || !status_file.empty() || !stream_file.empty()) {
+			*out << "Error: --trace, --status-file and --stream are for single runs.\n";
+			all_set = false;
+		}
+		if (threads < 1) {
+			*out << "Error: Invalid number of threads.\n";
+			all_set = false;
+		}
+		if (!vm.count("dict-file") || !vm.count("outdir")) {
+			*out << "Error: Dict_file and outdir are needed.\n";
+			all_set = false;
+		}
+		const std::set<std::string> batch_keys = {"manifest", "indir", "threads", "allowed-mb"};
+		for (auto const& opt : parsed.options) {
+			if (batch_keys.count(opt.string_key) == 0) {
+				sample_args.insert(sample_args.end(), opt.original_tokens.begin(),
+					opt.original_tokens.end());
+			}
+		}
+		*out << "Batch of samples from " << (vm.count("manifest") ? manifest_file : indir)
+			<< ", " << threads << " threads.\n";
+		return all_set;
+	}
 
 
 	if (vm.count("file1")) {
-		std::cout << "First fastq file is set to: " << file1_str << ".\n";
+		*out << "First fastq file is set to: " << file1_str << ".\n";
 	} else {
 		all_set = false;
-		std::cout << "Error: First fastq file is not set.\n";
+		*out << "Error: First fastq file is not set.\n";
 	}
 
 	if (vm.count("file2")) {
-		std::cout << "Second fastq file is set to: " << file2_str << ".\n";
-	} else {
+		*out << "Second fastq file is set to: " << file2_str << ".\n";
+	} else if (!(vm.count("file1") && is_bam_path(file1_str))) {
 		all_set = false;
-		std::cout << "Error: Second fastq file is not set.\n";
+		*out << "Error: Second fastq file is not set.\n";
 	}
 
 
 	if (vm.count("prefix")) {
-		std::cout << "Prefix string is set to: " << prefix_str << ".\n";
+		*out << "Prefix string is set to: " << prefix_str << ".\n";
 	} else {
-		std::cout << "Error: Prefix string is not set.\n";
+		*out << "Error: Prefix string is not set.\n";
+	}
+
+	// The index and read files of lane i are the i-th of each list.
+	if (!inputs_set) {
+		indfile_list = expand_inputs(indfile_str);
+		file1_list = expand_inputs(file1_str);
+		file2_list = expand_inputs(file2_str);
+	}
+	// A BAM holds read 2 and the index too.
+	bam_input = std::any_of(file1_list.begin(), file1_list.end(), is_bam_path);
+	if (bam_input) {
+		if (file1_list.size() > 1 || !indfile_list.empty() || !file2_list.empty() ||
+			index_from_header) {
+			all_set = false;
+			*out << "Error: A BAM input is one file with both reads and the index, not lanes"
+				" and not with --file2, -i or --index-from-header.\n";
+		} else {
+			*out << "Both reads and the index come from the BAM file " << file1_list[0] << ".\n";
+		}
+	} else if (index_from_header && !indfile_list.empty()) {
+		all_set = false;
+		*out << "Error: The index comes from the headers, -i is not for --index-from-header.\n";
+	} else if (all_set && ((!index_from_header && indfile_list.size() != file1_list.size()) ||
+		file1_list.size() != file2_list.size())) {
+		all_set = false;
+		*out << "Error: The index, first and second files are " << indfile_list.size()
+			<< ", " << file1_list.size() << " and " << file2_list.size() << " lanes.\n";
+	} else if (file1_list.size() > 1) {
+		*out << file1_list.size() << " lanes are read in parallel, 4096 read pairs"
+			" of each in turn:\n";
+		for (size_t i = 0; i < file1_list.size(); i++) {
+			*out << "  " << (index_from_header ? std::string() : indfile_list[i] + " ")
+				<< file1_list[i] << " " << file2_list[i] << "\n";
+		}
 	}
 
 	if (vm.count("dict-file")) {
-		std::cout << "Dict_file is set to " << dict_file << ".\n";
+		*out << "Dict_file is set to " << dict_file << ".\n";
 	} else {
 		all_set = false;
-		std::cout << "Error: Dict_file is not set.\n";
+		*out << "Error: Dict_file is not set.\n";
 	}
 
 	if (vm.count("outdir")) {
-		std::cout << "Outdir is set to: " << outdirpath << ".\n";
+		*out << "Outdir is set to: " << outdirpath << ".\n";
 	} else {
 		all_set = false;
-		std::cout << "Error: Outdir is not set.\n";
+		*out << "Error: Outdir is not set.\n";
 	}
 	
 	return all_set;
@@ -252,10 +706,13 @@ bc_splitter::updateMaps(std::string& barcode_str,
 	// them into the two maps.
 
 	
-    int bccap1 = bcword1.capacity();
-    int bccap2 = bcword2.capacity();
-    int bccap3 = bcword3.capacity();
-    int bccap4 = bcword4.capacity();
+    // Without an index read (--index-from-header) there is nothing for
+    // the barcode_1 files.
+    bool index_read = !index_from_header;
+    int bccap1 = index_read ? bcword1.capacity() : 0;
+    int bccap2 = index_read ? bcword2.capacity() : 0;
+    int bccap3 = index_read ? bcword3.capacity() : 0;
+    int bccap4 = index_read ? bcword4.capacity() : 0;
 
 	int lcap1 = lword1.capacity();
 	int lcap2 = lword2.capacity();
@@ -272,10 +729,12 @@ bc_splitter::updateMaps(std::string& barcode_str,
 
 	totalcap += allcap;
 
-    bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword1));
-    bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword2));
-    bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword3));
-    bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword4));
+    if (index_read) {
+        bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword1));
+        bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword2));
+        bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword3));
+        bcQueueMap[barcode_str].push_back(std::make_unique<std::string>(bcword4));
+    }
 
 	lQueueMap[barcode_str].push_back(std::make_unique<std::string>(lword1));
 	lQueueMap[barcode_str].push_back(std::make_unique<std::string>(lword2));
@@ -292,17 +751,61 @@ bc_splitter::updateMaps(std::string& barcode_str,
 }
 
 void bc_splitter::writeMapsToFile() {
+
+	metrics.flush_count++;
+	if (totalcap > metrics.peak_buffered_bytes) {
+		metrics.peak_buffered_bytes = totalcap;
+	}
+	progress.flushes.store(metrics.flush_count, std::memory_order_relaxed);
+
+	// A BAM writer ends its block and closes its file at every flush, as the
+	// FASTQ files are closed. no_match and ambiguous share the unmatched file.
+	for (auto& kv : bamQueueMap) {
+		trace_scope flush_scope(tracer.get(), "flush_barcode", kv.first);
+		bool unmatched = kv.first.compare("no_match") == 0 || kv.first.compare("ambiguous") == 0;
+		std::string writer_key = unmatched ? "unmatched" : kv.first;
+		if (bam_writer_map.count(writer_key) == 0) {
+			if (!bam_pool) {
+				bam_pool = std::make_unique<bgzf_pool>(bam_threads, Z_DEFAULT_COMPRESSION);
+			}
+			const std::string path = outdirpath + "/" + prefix_str + "." +
+				(unmatched ? "unmatched" : kv.first + ".unmapped") + ".bam";
+			const std::string group = prefix_str + "." + writer_key;
+			bam_writer_map[writer_key] = std::make_unique<bam_writer>(path, *bam_pool,
+				"@HD\tVN:1.6\tSO:unsorted\tGO:query\n"
+				"@RG\tID:" + group + "\tSM:" + group + "\n"
+				"@PG\tID:index_splitter\tPN:index_splitter\n");
+			outfile_set.insert(writer_key);
+			output_paths.insert(path);
+		}
+		bam_writer_map[writer_key]->write(kv.second);
+		bam_writer_map[writer_key]->flush();
+		metrics.output_bytes += kv.second.size();
+		progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+	}
+	bamQueueMap.clear();
 	
 	for (auto& kv : lQueueMap) {
 	    std::string barcode = kv.first;
+	    trace_scope flush_scope(tracer.get(), "flush_barcode", barcode);
 
+		// The index read is not streamed, aligners have no use for it.
+		if (streams && streams->has(barcode)) {
+			metrics.output_bytes += streams->write(barcode, kv.second, rQueueMap[barcode]);
+			progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+			continue;
+		}
 
         // Here we shall create three files for each of the barcodes.
         //  barcode.unmapped.1.fastq, barcode.unmapped.2.fastq and barcode.unmapped.barcode_1.fastq
         std::string file1 = "";
         std::string file2 = "";
         std::string bcfile = "";
+        // no_match and ambiguous reads share the unmatched files, so they
+        // have to share the writers too.
+        std::string writer_key = barcode;
         if (barcode.compare("no_match") == 0 || barcode.compare("ambiguous") == 0 ) {
+            writer_key = "unmatched";
             file1 = outdirpath + "/" + prefix_str + ".unmatched.1.fastq.gz";
             file2 = outdirpath + "/" + prefix_str + ".unmatched.2.fastq.gz";
             bcfile = outdirpath + "/" + prefix_str + ".unmatched.barcode_1.fastq.gz";
@@ -313,12 +816,30 @@ void bc_splitter::writeMapsToFile() {
         }
 
 
-        if (outfile_set.count(barcode) == 0) {
-            outfile_set.insert(barcode); 
+        // The interleaved file takes the place of the read 1 file.
+        if (interleaved) {
+            file1 = file1.substr(0, file1.size() - 11) + ".fastq.gz";
+        }
 
-            read1_writer_map[barcode] = std::make_unique<fastq_writer>(file1);
-            read2_writer_map[barcode] = std::make_unique<fastq_writer>(file2);
-            barcode_writer_map[barcode] = std::make_unique<fastq_writer>(bcfile);
+        if (outfile_set.count(writer_key) == 0 && interleaved) {
+            outfile_set.insert(writer_key);
+            read1_writer_map[writer_key] = std::make_unique<fastq_writer>(file1);
+            output_paths.insert(file1);
+            if (!interleave_index && !index_from_header) {
+                barcode_writer_map[writer_key] = std::make_unique<fastq_writer>(bcfile);
+                output_paths.insert(bcfile);
+            }
+        } else if (outfile_set.count(writer_key) == 0) {
+            outfile_set.insert(writer_key); 
+
+            read1_writer_map[writer_key] = std::make_unique<fastq_writer>(file1);
+            read2_writer_map[writer_key] = std::make_unique<fastq_writer>(file2);
+            output_paths.insert(file1);
+            output_paths.insert(file2);
+            if (!index_from_header) {
+                barcode_writer_map[writer_key] = std::make_unique<fastq_writer>(bcfile);
+                output_paths.insert(bcfile);
+            }
         } 
  
         //fastq_writer read1_writer = *(read1_writer_map[barcode]);
@@ -331,22 +852,54 @@ void bc_splitter::writeMapsToFile() {
         std::vector<std::unique_ptr<std::string>> & valSet2 = rQueueMap[barcode];
         std::vector<std::unique_ptr<std::string>> & valSet_bc = bcQueueMap[barcode];
 
+        if (interleaved) {
+            fastq_writer& writer = *read1_writer_map[writer_key];
+            for (size_t i = 0; i < valSet1.size(); i += 4) {
+                for (size_t j = i; j < i + 4; j++) {
+                    writer.putline(*valSet1[j]);
+                    metrics.output_bytes += valSet1[j]->size() + 1;
+                }
+                for (size_t j = i; j < i + 4; j++) {
+                    writer.putline(*valSet2[j]);
+                    metrics.output_bytes += valSet2[j]->size() + 1;
+                }
+                if (interleave_index) {
+                    for (size_t j = i; j < i + 4; j++) {
+                        writer.putline(*valSet_bc[j]);
+                        metrics.output_bytes += valSet_bc[j]->size() + 1;
+                    }
+                }
+            }
+            if (!interleave_index) {
+                for (auto const& kv_bc : valSet_bc) {
+                    barcode_writer_map[writer_key]->putline(*kv_bc);
+                    metrics.output_bytes += kv_bc->size() + 1;
+                }
+            }
+            progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+            continue;
+        }
+
 
         for (auto const& kv1 : valSet1) {
  	        std::string val1 = *kv1;
-            read1_writer_map[barcode]->putline(val1);
+            read1_writer_map[writer_key]->putline(val1);
+            metrics.output_bytes += val1.size() + 1;
         }
 
 
 		for (auto const& kv2 : valSet2) {
         	std::string val2 = *kv2;
-            read2_writer_map[barcode]->putline(val2);
+            read2_writer_map[writer_key]->putline(val2);
+            metrics.output_bytes += val2.size() + 1;
         }
 
 		for (auto const& kv_bc : valSet_bc) {
         	std::string val_bc = *kv_bc;
-            barcode_writer_map[barcode]->putline(val_bc);
+            barcode_writer_map[writer_key]->putline(val_bc);
+            metrics.output_bytes += val_bc.size() + 1;
         }
+        progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
 
 	}
 
@@ -356,98 +909,306 @@ void bc_splitter::writeMapsToFile() {
 
 } 
 
+// Encodes a read pair into the BAM buffer of its barcode; returns the bytes
+unsigned long bc_splitter::buffer_bam(const indexed_pair& rec, const std::string& write_barcode) {
+	std::string& buffer = bamQueueMap[write_barcode];
+	size_t before = buffer.size();
+	bool unmatched = write_barcode.compare("no_match") == 0 ||
+		write_barcode.compare("ambiguous") == 0;
+	std::vector<std::pair<const char*, std::string>> tags = {{"BC", rec.indword2}};
+	// An index from the headers has no qualities.
+	if (!index_from_header) {
+		tags.push_back({"QT", rec.indword4});
+	}
+	tags.push_back({"RG", prefix_str + "." + (unmatched ? std::string("unmatched") : write_barcode)});
+	// Paired, both unmapped, first or second of the pair
+	bam_record(buffer, rec.lword1, rec.lword2, rec.lword4, 77, tags);
+	bam_record(buffer, rec.rword1, rec.rword2, rec.rword4, 141, tags);
+	return buffer.size() - before;
+}
 
-void bc_splitter::split_engine() {
 
-    // The words starting with indword
-    std::string indword1;
-    std::string indword2;
-    std::string indword3;
-    std::string indword4;
- 
-	// The words starting with lword is for read 1
-	std::string lword1;
-	std::string lword2;
-	std::string lword3;
-	std::string lword4;
+bool bc_splitter::read_indexed_pair(std::vector<std::unique_ptr<fastq_reader>>& files,
+	indexed_pair& rec) {
 
-	// The words starting with rword is for read 2
-	std::string rword1;
-	std::string rword2;
-	std::string rword3;
-	std::string rword4;
+	fastq_reader& indfile = *files[0];
+	fastq_reader& file1 = *files[1];
+	fastq_reader& file2 = *files[2];
+	if (!indfile.getline(rec.indword1)) {return false;}
+	if (!indfile.getline(rec.indword2)) {return false;}
+	if (!indfile.getline(rec.indword3)) {return false;}
+	if (!indfile.getline(rec.indword4)) {return false;}
+
+	if (!file1.getline(rec.lword1)) {return false;}
+	if (!file1.getline(rec.lword2)) {return false;}
+	if (!file1.getline(rec.lword3)) {return false;}
+	if (!file1.getline(rec.lword4)) {return false;}
+	
+	if (!file2.getline(rec.rword1)) {return false;}
+	if (!file2.getline(rec.rword2)) {return false;}
+	if (!file2.getline(rec.rword3)) {return false;}
+	if (!file2.getline(rec.rword4)) {return false;}
+	return true;
+}
 
+// Where the index starts in an Illumina header, "@<name> <read>:<Y|N>:<control>:<index>",
+// checked field by field rather than searched for. npos without one.
+static size_t header_index_start(const std::string& header) {
+	size_t pos = header.find(' ');
+	if (pos == std::string::npos || header.size() < pos + 7 ||
+		!isdigit(header[pos + 1]) || header[pos + 2] != ':' ||
+		(header[pos + 3] != 'N' && header[pos + 3] != 'Y') || header[pos + 4] != ':') {
+		return std::string::npos;
+	}
+	pos += 5;
+	while (pos < header.size() && isdigit(header[pos])) {
+		pos++;
+	}
+	return pos < header.size() && header[pos] == ':' ? pos + 1 : std::string::npos;
+}
+
+// A read pair whose index is in the read 1 header: the first index (before
+// a +) stands in for the index read. With check, the read 2 header must
+// carry the same index field.
+bool bc_splitter::read_header_indexed_pair(std::vector<std::unique_ptr<fastq_reader>>& files,
+	indexed_pair& rec, bool check) {
+
+	fastq_reader& file1 = *files[0];
+	fastq_reader& file2 = *files[1];
+	if (!file1.getline(rec.lword1)) {return false;}
+	if (!file1.getline(rec.lword2)) {return false;}
+	if (!file1.getline(rec.lword3)) {return false;}
+	if (!file1.getline(rec.lword4)) {return false;}
+
+	if (!file2.getline(rec.rword1)) {return false;}
+	if (!file2.getline(rec.rword2)) {return false;}
+	if (!file2.getline(rec.rword3)) {return false;}
+	if (!file2.getline(rec.rword4)) {return false;}
+
+	size_t start = header_index_start(rec.lword1);
+	if (start == std::string::npos) {
+		throw std::invalid_argument("No index in the header " + rec.lword1 + ".");
+	}
+	size_t end = rec.lword1.find('+', start);
+	if (end == std::string::npos) {
+		end = rec.lword1.size();
+	}
+	if (check) {
+		size_t start2 = header_index_start(rec.rword1);
+		if (start2 == std::string::npos ||
+			rec.rword1.compare(start2, std::string::npos, rec.lword1, start, std::string::npos) != 0) {
+			throw std::invalid_argument("The headers of read 1 and read 2 differ in the index: " +
+				rec.lword1 + ", " + rec.rword1 + ".");
+		}
+	}
+
+	// There is no index read, only its bases.
+	rec.indword2.assign(rec.lword1, start, end - start);
+	return true;
+}
+
+void bc_splitter::extract_barcode(indexed_pair& rec) const {
+	// For P7 index, the entire 8 bases of the second line of the index
+	// read are used as barcode_str.
+
+	// Ns are flagged in the packed barcode. Reads with more of them than
+	// we accept never go to the tree.
+	// A barcode longer than the packed encoding holds, or cut short by the
+	// end of the read, goes to the tree as a string.
+	int n_count;
+	if (packed_barcode::fits(rec.indword2.length())) {
+		rec.packed_str = packed_barcode::encode(rec.indword2);
+		n_count = rec.packed_str.n_count();
+	} else {
+		rec.packed_str = packed_barcode();
+		n_count = string_n_count(rec.indword2);
+	}
+	rec.n_rejected = n_count > max_n;
+}
+
+// Only reads the tree, so the lane threads run it concurrently.
+void bc_splitter::match_barcode(indexed_pair& rec) const {
+	const std::string& barcode_str = rec.indword2;
+
+	// calculate the minimum dIstance between the target and references
+
+	rec.smallest_dist = cutoff + 1;
+
+	// The smallest_barcode initialization could technically be anything
+	// since we overwrite this variable.
+
+	rec.smallest_barcode = "JJJJJJJJ";
+
+	rec.smallest_count = 0;
+	rec.qual_rescued = false;
+
+	if (rec.n_rejected) {
+		return;
+	}
+	match_in_tree(*tree, barcode_str, rec.packed_str, cutoff, safe_cutoff, n_wildcard,
+		rec.smallest_dist, rec.smallest_barcode, rec.smallest_count);
+
+	// A tie or no match by plain distance may still be resolved by
+	// looking at how confident the mismatching base calls are.
+	if (qual_assign && rec.smallest_count != 1) {
+		double posterior = 0;
+		int qidx = qmatcher->assign(barcode_str, rec.indword4, posterior);
+		// smallest_dist stays that of the search, which the distance
+		// histogram counts; the rescued reads are counted on their own.
+		if (qidx >= 0) {
+			rec.smallest_barcode = qmatcher->get_barcode(qidx);
+			rec.smallest_count = 1;
+			rec.qual_rescued = true;
+		}
+	}
+}
+
+void bc_splitter::split_engine() {
 
 	for (int j = 0; j <= cutoff; j++) {
 		distmap[j] = 0;
 	}   
 	const unsigned long MB_SIZE = 1024 * 1024;
 	unsigned long total_allowed = allowed_MB * MB_SIZE;
+	// With streams, half of it holds the buffered reads and half what is
+	// queued for the streams and not written yet.
+	unsigned long stream_allowed = 0;
+	if (!stream_file.empty()) {
+		stream_allowed = total_allowed / 2;
+		total_allowed -= stream_allowed;
+	}
+	// Reads between two updates of the progress counters, minus one
+	const unsigned long PROGRESS_EVERY = 4095;
 
 	//const std::string logfile_detailed = outdirpath + "/logfile_detailed.txt";
 	//std::ofstream log_detailed(logfile_detailed);
 
 	// We shall start reading the first line. The assumption is that second line 
 	// contains the barcode.
-    fastq_reader indfile(indfile_str);
-    fastq_reader file1(file1_str);
-    fastq_reader file2(file2_str);
-
-    /* std::cout << "Here we are too!\n"; */
-
-	while (indfile.getline(indword1)) {
-
-		if (!indfile.getline(indword2)) {break;}
-		if (!indfile.getline(indword3)) {break;}
-		if (!indfile.getline(indword4)) {break;}
-
-		if (!file1.getline(lword1)) {break;}
-		if (!file1.getline(lword2)) {break;}
-		if (!file1.getline(lword3)) {break;}
-		if (!file1.getline(lword4)) {break;}
-		
-		if (!file2.getline(rword1)) {break;}
-		if (!file2.getline(rword2)) {break;}
-		if (!file2.getline(rword3)) {break;}
-		if (!file2.getline(rword4)) {break;}
-
-		// The barcode stays at the second line of each four lines of first
-		// read file.
-       
-        // For P7 index, the entire 8 bases are used as barcode_str 
-		std::string barcode_str = indword2;
-		std::vector<std::string> results;
-		
-		results = tree.find(barcode_str, cutoff);
+	auto split_start = std::chrono::steady_clock::now();
+
+	// A read is classified when the draw falls below the threshold.
+	std::mt19937_64 sample_rng(sample_seed);
+	bool sampling = sample_fraction < 1;
+	uint64_t sample_threshold = (uint64_t) (sample_fraction * 18446744073709551615.0);
+
+	// Several lanes are read and classified by a thread each, and come
+	// here a chunk of each lane in turn. One lane is read right here.
+	std::vector<std::unique_ptr<fastq_reader>> files;
+	if (!stream_file.empty()) {
+		streams = std::make_unique<stream_outputs>(stream_file, outdirpath + "/" + prefix_str,
+			stream_allowed);
+		*out << streams->size() << " barcodes are streamed.\n";
+	}
+	std::unique_ptr<lane_reader<indexed_pair>> lanes;
+	lane_reader<indexed_pair>::read_fn read_fn = read_indexed_pair;
+	if (index_from_header) {
+		bool check = check_header_index;
+		read_fn = [check](std::vector<std::unique_ptr<fastq_reader>>& files, indexed_pair& rec) {
+			return read_header_indexed_pair(files, rec, check);
+		};
+	}
+	if (file1_list.size() > 1) {
+		std::vector<std::vector<std::string>> lane_files;
+		std::vector<std::mt19937_64> lane_rngs;
+		for (size_t i = 0; i < file1_list.size(); i++) {
+			if (index_from_header) {
+				lane_files.push_back({file1_list[i], file2_list[i]});
+			} else {
+				lane_files.push_back({indfile_list[i], file1_list[i], file2_list[i]});
+			}
+			lane_rngs.emplace_back(sample_seed + i);
+		}
+		lanes = std::make_unique<lane_reader<indexed_pair>>(lane_files, read_fn,
+			[this, lane_rngs, sampling, sample_threshold](indexed_pair& rec,
+				size_t lane) mutable {
+				rec.sampled_out = sampling && lane_rngs[lane]() >= sample_threshold;
+				if (!rec.sampled_out) {
+					extract_barcode(rec);
+					match_barcode(rec);
+				}
+			});
+	} else if (bam_input) {
+		files = open_bam_reads(file1_list[0], bam_threads,
+			{bam_pairs::index, bam_pairs::read1, bam_pairs::read2});
+	} else {
+		if (!index_from_header) {
+			files.emplace_back(new fastq_reader(indfile_list[0]));
+		}
+		files.emplace_back(new fastq_reader(file1_list[0]));
+		files.emplace_back(new fastq_reader(file2_list[0]));
+	}
 
-		// calculate the minimum dIstance between the target and references
+	unsigned long input_file_total = file_bytes(indfile_list) + file_bytes(file1_list) +
+		file_bytes(file2_list);
+	if (progress_interval > 0 || !status_file.empty()) {
+		reporter = std::make_unique<progress_reporter>(progress, tool_name,
+			progress_interval > 0 ? progress_interval : 60, progress_interval > 0,
+			status_file, input_file_total);
+		reporter->start();
+	}
+	unsigned long read_count = 0;
+	auto publish = [&]() {
+		if (lanes) {
+			publish_progress(read_count, lanes->input_bytes(), lanes->input_file_pos());
+		} else {
+			std::vector<fastq_reader*> readers;
+			for (auto& file : files) {
+				readers.push_back(file.get());
+			}
+			publish_progress(read_count, readers);
+		}
+	};
 
-		int smallest_dist = cutoff + 1;
+	timer.start();
 
-		// The smallest_barcode initialization could technically be anything
-		// since we overwrite this variable.
+    /* *out << "Here we are too!\n"; */
 
-		std::string smallest_barcode = "JJJJJJJJ";
+	indexed_pair single;
+	indexed_pair* rec = &single;
+	while (max_reads == 0 || read_count < max_reads) {
 
-		std::vector<int> dist_vec;
-		for (auto const& val : results) {
-			int ldist = distance(val, barcode_str);
-			if (ldist < smallest_dist) {
-				smallest_dist = ldist;
-				smallest_barcode = val;
-			}
+		if (lanes) {
+			rec = lanes->next();
+			if (rec == NULL) {break;}
+		} else if (!read_fn(files, single)) {
+			break;
+		}
 
-			dist_vec.push_back(ldist);
+		timer.lap(STAGE_READ);
+		timer.next_read();
+		read_count++;
+		if (reporter && (read_count & PROGRESS_EVERY) == 0) {
+			publish();
 		}
 
-		int smallest_count = 0;
-		for (auto const& temp_dist : dist_vec) {
-			if (temp_dist == smallest_dist) {
-				smallest_count++;
+		// The lane threads sample and search themselves, with a draw
+		// sequence per lane.
+		if (lanes) {
+			if (rec->sampled_out) {
+				sampled_out_total++;
+				continue;
+			}
+		} else {
+			if (sampling && sample_rng() >= sample_threshold) {
+				sampled_out_total++;
+				continue;
 			}
+			extract_barcode(single);
+			timer.lap(STAGE_EXTRACT);
+			match_barcode(single);
+		}
+		if (rec->n_rejected) {
+			n_rejected_total++;
+		}
+		if (rec->qual_rescued) {
+			qual_rescued_total++;
 		}
+		int smallest_dist = rec->smallest_dist;
+		int smallest_count = rec->smallest_count;
+		const std::string& smallest_barcode = rec->smallest_barcode;
 
-		//std::cout << "actual_barcode: " << barcode_str << 
+		//*out << "actual_barcode: " << rec->indword2 << 
 		//	", smallest barcode: " <<  smallest_barcode <<  
 		//	", sallest dist: " << smallest_dist << 
 		//	", smallest_count: " << smallest_count << "\n";
@@ -459,7 +1220,9 @@ void bc_splitter::split_engine() {
 
 		if (smallest_count == 1) {
 			write_barcode = smallest_barcode;
-			if (smallest_dist == 0) {
+			if (rec->qual_rescued) {
+				rescued_map[write_barcode]++;
+			} else if (smallest_dist == 0) {
 				zero_dist_map[write_barcode]++;
 			} else if (smallest_dist == 1) {                        
 				one_dist_map[write_barcode]++;
@@ -475,28 +1238,94 @@ void bc_splitter::split_engine() {
 			write_barcode = "no_match";
 			no_match_total++;
 		}
+		if (smallest_count != 1 && top_unmatched > 0) {
+			unmatched_sketch.offer(rec->indword2);
+		}
 		barcode_set.insert(write_barcode);
+		distmap[smallest_dist]++;
+		timer.lap(STAGE_MATCH);
+		if (count_only) {
+			continue;
+		}
 
-        std::string indword1_p7 = indword1 + indword2;
-        std::string lword1_p7 = lword1 + indword2;
-        std::string rword1_p7 = rword1 + indword2;
-		totalcap = updateMaps(write_barcode, indword1_p7, indword2, indword3, 
-            indword4, lword1_p7, lword2, lword3, lword4, 
-			rword1_p7, rword2, rword3, rword4, totalcap);
+		// In BAM the index read goes in tags, not in the headers.
+		if (bam_output) {
+			totalcap += buffer_bam(*rec, write_barcode);
+			timer.lap(STAGE_BUFFER);
+		} else if (index_from_header) {
+			// The headers carry the index already and go out as they are.
+			timer.lap(STAGE_HEADER);
+			totalcap = updateMaps(write_barcode, rec->indword1, rec->indword2, rec->indword3,
+				rec->indword4, rec->lword1, rec->lword2, rec->lword3, rec->lword4,
+				rec->rword1, rec->rword2, rec->rword3, rec->rword4, totalcap);
+			timer.lap(STAGE_BUFFER);
+		} else {
+	        std::string indword1_p7 = rec->indword1 + rec->indword2;
+	        std::string lword1_p7 = rec->lword1 + rec->indword2;
+	        std::string rword1_p7 = rec->rword1 + rec->indword2;
+			timer.lap(STAGE_HEADER);
+			totalcap = updateMaps(write_barcode, indword1_p7, rec->indword2, rec->indword3, 
+	            rec->indword4, lword1_p7, rec->lword2, rec->lword3, rec->lword4, 
+				rword1_p7, rec->rword2, rec->rword3, rec->rword4, totalcap);
+			timer.lap(STAGE_BUFFER);
+		}
 			
-		//std::cout << "total cap: " << totalcap << "\n";
+		//*out << "total cap: " << totalcap << "\n";
 
 		if (totalcap > total_allowed) {
+			timer.sample_next();
 			writeMapsToFile();
 			// Write all the data in the respective files sequentially
 			totalcap = 0;
+			timer.lap(STAGE_FLUSH);
 		}
-
-		distmap[smallest_dist]++;
 	}
 
 	// final writing to the files
-	writeMapsToFile();
+	if (!count_only) {
+		timer.sample_next();
+		writeMapsToFile();
+		// Close the gzip streams so that the file sizes are final.
+		{
+			trace_scope close_scope(tracer.get(), "close_outputs");
+			read1_writer_map.clear();
+			read2_writer_map.clear();
+			barcode_writer_map.clear();
+			if (streams) {
+				streams->close();
+			}
+			for (auto& kv : bam_writer_map) {
+				kv.second->close();
+			}
+		}
+		timer.lap(STAGE_FLUSH);
+	}
+	timer.finish();
+	input_reads_total = read_count;
+	timer.print(*out);
+	if (tracer) {
+		tracer->write(trace_file);
+		*out << "Trace is written to " << trace_file << " (" << tracer->dropped()
+			<< " events dropped).\n";
+	}
+
+	if (reporter) {
+		publish();
+		progress.buffered_bytes.store(0, std::memory_order_relaxed);
+		reporter->stop();
+	}
+
+	std::chrono::duration<double> split_time = std::chrono::steady_clock::now() - split_start;
+	metrics.split_seconds = split_time.count();
+	if (lanes) {
+		metrics.input_bytes = lanes->input_bytes();
+	} else {
+		metrics.input_bytes = 0;
+		for (auto& file : files) {
+			metrics.input_bytes += file->get_bytes_read();
+		}
+	}
+	metrics.input_file_bytes = input_file_total;
 
 	//log_detailed.close();
 }
@@ -515,7 +1344,17 @@ void bc_splitter::write_log() {
 	double ambiguous_percent = ((double) ambiguous_total / (double) total_reads) * 100;
 	double no_match_percent = ((double) no_match_total / (double) total_reads) * 100;
 
+	write_metrics(total_reads);
+
 	log_freq << "Total reads: " << total_reads << "\n..................\n";
+	if (sampled_out_total > 0 || max_reads > 0) {
+		log_freq << "Reads in the input: " << input_reads_total;
+		if (max_reads > 0) {
+			log_freq << " (stopped at " << max_reads << ")";
+		}
+		log_freq << ", classified: " << total_reads << " (sample fraction "
+			<< sample_fraction << ")\n\n";
+	}
 
 	log_freq << "Ambiguous:\n";
 	log_freq << ".................." << "\n";
@@ -523,13 +1362,26 @@ void bc_splitter::write_log() {
 
 	log_freq << "No match:\n";
     log_freq << ".................." << "\n";
-    log_freq << "Total non-match reads: " << no_match_total << " (" << no_match_percent << "%)\n\n";
+    log_freq << "Total non-match reads: " << no_match_total << " (" << no_match_percent << "%)\n";
+    log_freq << "Non-match reads with more than " << max_n << " Ns: " << n_rejected_total << "\n\n";
+
+	if (top_unmatched > 0) {
+		write_top_unmatched(log_freq, total_reads);
+	}
+
+	if (qual_assign) {
+		double qual_rescued_percent = ((double) qual_rescued_total / (double) total_reads) * 100;
+		log_freq << "Quality rescued:\n";
+		log_freq << ".................." << "\n";
+		log_freq << "Total quality-rescued reads: " << qual_rescued_total << " (" << qual_rescued_percent << "%)\n\n";
+	}
 
 
 	for (const auto& lbarcode : all_nodes) {
 
 	
 		unsigned long total_correct_count = 0;
+		unsigned long rescued_count = 0;
 		double zero_dist_percent = 0;
 		double one_dist_percent = 0;
 		double higher_dist_percent = 0;
@@ -540,8 +1392,10 @@ void bc_splitter::write_log() {
 		    unsigned long zero_dist_count = zero_dist_map[lbarcode];
 		    unsigned long one_dist_count = one_dist_map[lbarcode];
 		    unsigned long higher_dist_count = higher_dist_map[lbarcode];
+		    rescued_count = rescued_map[lbarcode];
 
-		    total_correct_count = zero_dist_count + one_dist_count + higher_dist_count;
+		    total_correct_count = zero_dist_count + one_dist_count + higher_dist_count +
+		        rescued_count;
 		    zero_dist_percent = ((double)zero_dist_count / (double)total_correct_count) * 100.0;
 		    one_dist_percent = ((double)one_dist_count / (double)total_correct_count) * 100.0;
 		    higher_dist_percent = 100 - zero_dist_percent - one_dist_percent;
@@ -553,6 +1407,9 @@ void bc_splitter::write_log() {
 		log_freq << ".................." << "\n";
 		log_freq << "Zero base mismatch: " << zero_dist_percent << "%\n";
 		log_freq << "One base mismatch: " << one_dist_percent << "%\n";
+		if (qual_assign) {
+			log_freq << "Quality rescued: " << rescued_count << "\n";
+		}
 		log_freq << "Total read for this barcode: " << total_correct_count << 
 			" (percent of total reads: " << barcode_read_percent << "%)\n";
 		log_freq << "\n";
@@ -562,16 +1419,395 @@ void bc_splitter::write_log() {
 
 	log_freq.close();
 
-	std::cout << std::fixed;
-    std::cout << std::setprecision(4);	
+	*out << std::fixed;
+    *out << std::setprecision(4);	
 
 	for (auto& entry : bar_map) {
 		
-		std::cout << entry.second << ": " << entry.first << "%\n";
+		*out << entry.second << ": " << entry.first << "%\n";
+	}
+
+	*out << "Ambiguous: " << ambiguous_percent << "%\n";
+	*out << "No-match: " << no_match_percent << "%\n";
+}
+
+
+// Lists the most frequent barcodes of the ambiguous and no_match reads,
+// each with its closest dictionary barcode, to tell a barcode missing from
+// the sample sheet apart from poor sequencing.
+void bc_splitter::write_top_unmatched(std::ofstream& log_freq, unsigned long total_reads) {
+
+	log_freq << "Top unmatched barcodes:\n";
+	log_freq << ".................." << "\n";
+	for (auto const& entry : unmatched_sketch.top(top_unmatched)) {
+		double percent = ((double) entry.count / (double) total_reads) * 100;
+		log_freq << entry.key << ": " << entry.count << " (" << percent << "%)";
+
+		std::string nearest;
+		int nearest_dist = 0;
+		int ties = 0;
+		nearest_search(all_nodes, entry.key, nearest, nearest_dist, ties);
+		if (!nearest.empty()) {
+			log_freq << ", nearest " << nearest << " at distance " << nearest_dist;
+			if (ties > 1) {
+				log_freq << " (" << ties << " tied)";
+			}
+		}
+		log_freq << "\n";
+	}
+	log_freq << "\n";
+}
+
+// The same numbers as the frequency log plus the distance histogram,
+// buffering, timing and byte counters.
+void bc_splitter::write_metrics(unsigned long total_reads) {
+	if (metrics_format.compare("none") == 0) {
+		return;
+	}
+
+	metrics_table table;
+	table.add("run", "tool", "index_splitter");
+	table.add("run", "prefix", prefix_str);
+	table.add("run", "dictionary", dict_file);
+	table.add("run", "mismatch", cutoff);
+	table.add("run", "count_only", count_only ? 1 : 0);
+	table.add("run", "sample_fraction", sample_fraction);
+	table.add("run", "max_reads", max_reads);
+
+	table.add("reads", "total", total_reads);
+	table.add("reads", "input", input_reads_total);
+	table.add("reads", "sampled_out", sampled_out_total);
+	table.add("reads", "matched", match_total);
+	table.add("reads", "ambiguous", ambiguous_total);
+	table.add("reads", "no_match", no_match_total);
+	table.add("reads", "n_rejected", n_rejected_total);
+	table.add("reads", "quality_rescued", qual_rescued_total);
+
+	// The bucket above the cutoff holds the reads the search found no match
+	// for, whether --qual-assign rescued them or not.
+	for (auto const& kv : distmap) {
+		table.add("distance_histogram", std::to_string(kv.first), kv.second);
+	}
+
+	auto count_of = [](const std::map<std::string, unsigned long>& counts,
+		const std::string& key) -> unsigned long {
+		auto it = counts.find(key);
+		return it == counts.end() ? 0 : it->second;
+	};
+	for (auto const& lbarcode : all_nodes) {
+		table.add("zero_mismatch", lbarcode, count_of(zero_dist_map, lbarcode));
+	}
+	for (auto const& lbarcode : all_nodes) {
+		table.add("one_mismatch", lbarcode, count_of(one_dist_map, lbarcode));
+	}
+	for (auto const& lbarcode : all_nodes) {
+		table.add("higher_mismatch", lbarcode, count_of(higher_dist_map, lbarcode));
+	}
+	if (qual_assign) {
+		for (auto const& lbarcode : all_nodes) {
+			table.add("quality_rescued", lbarcode, count_of(rescued_map, lbarcode));
+		}
+	}
+
+	if (top_unmatched > 0) {
+		for (auto const& entry : unmatched_sketch.top(top_unmatched)) {
+			table.add("top_unmatched", entry.key, entry.count);
+		}
+	}
+
+	unsigned long allowed_bytes = (unsigned long) allowed_MB * 1024 * 1024;
+	table.add("buffer", "flushes", metrics.flush_count);
+	table.add("buffer", "peak_bytes", metrics.peak_buffered_bytes);
+	table.add("buffer", "allowed_bytes", allowed_bytes);
+
+	table.add("timing", "load_seconds", metrics.load_seconds);
+	table.add("timing", "split_seconds", metrics.split_seconds);
+	if (metrics.split_seconds > 0) {
+		table.add("timing", "reads_per_second", total_reads / metrics.split_seconds);
+	}
+
+	for (auto const& path : output_paths) {
+		metrics.output_file_bytes += file_bytes(path);
+	}
+	table.add("io", "input_bytes", metrics.input_bytes);
+	table.add("io", "input_file_bytes", metrics.input_file_bytes);
+	table.add("io", "output_bytes", metrics.output_bytes);
+	table.add("io", "output_file_bytes", metrics.output_file_bytes);
+
+	const std::string metrics_base = outdirpath + "/" + prefix_str + "_metrics";
+	if (metrics_format.compare("json") == 0 || metrics_format.compare("both") == 0) {
+		table.write_json(metrics_base + ".json");
+	}
+	if (metrics_format.compare("tsv") == 0 || metrics_format.compare("both") == 0) {
+		table.write_tsv(metrics_base + ".tsv");
+	}
+}
+
+// Hands the counters of the splitting thread to the progress reporter.
+void bc_splitter::publish_progress(unsigned long reads, std::vector<fastq_reader*> readers) {
+	unsigned long input_bytes = 0;
+	unsigned long input_file_pos = 0;
+	for (auto reader : readers) {
+		input_bytes += reader->get_bytes_read();
+		input_file_pos += reader->get_file_pos();
+	}
+	publish_progress(reads, input_bytes, input_file_pos);
+}
+
+void bc_splitter::publish_progress(unsigned long reads, unsigned long input_bytes,
+	unsigned long input_file_pos) {
+
+	progress.reads.store(reads, std::memory_order_relaxed);
+	progress.input_bytes.store(input_bytes, std::memory_order_relaxed);
+	progress.input_file_pos.store(input_file_pos, std::memory_order_relaxed);
+	progress.buffered_bytes.store(totalcap, std::memory_order_relaxed);
+	progress.output_bytes.store(metrics.output_bytes, std::memory_order_relaxed);
+}
+
+void bc_splitter::nearest_search(const std::set<std::string>& nodes,
+	const std::string& query, std::string& nearest, int& nearest_dist, int& ties) {
+
+	// Packed when the encoding holds the barcodes, as strings otherwise
+	bool packed = packed_barcode::fits(query.length());
+	packed_barcode packed_query = packed ? packed_barcode::encode(query) : packed_barcode();
+	nearest_dist = query.length() + 1;
+	ties = 0;
+	for (auto const& node : nodes) {
+		if (node.length() != query.length()) {
+			continue;
+		}
+		int dist = packed ? packed_distance(packed_barcode::encode(node), packed_query) :
+			string_distance(node, query);
+		if (dist < nearest_dist) {
+			nearest_dist = dist;
+			nearest = node;
+			ties = 1;
+		} else if (dist == nearest_dist) {
+			ties++;
+		}
+	}
+}
+
+
+// The input lists of a batch sample, so that parse_args does not expand
+// them again.
+void bc_splitter::set_inputs(const sample_files& sample) {
+	indfile_list = sample.index_list;
+	file1_list = sample.file1_list;
+	file2_list = sample.file2_list;
+	inputs_set = true;
+}
+
+bool bc_splitter::is_batch() const {
+	return batch;
+}
+
+// The first of <base>.fastq.gz and <base>.fastq that exists, as
+// IndexSplitterMain.py looks for them.
+static bool find_fastq(const std::string& base, std::string& path) {
+	struct stat st = {0};
+	for (auto const& ext : {".fastq.gz", ".fastq"}) {
+		if (stat((base + ext).c_str(), &st) == 0) {
+			path = base + ext;
+			return true;
+		}
+	}
+	return false;
+}
+
+static unsigned long sample_bytes(const sample_files& sample) {
+	return file_bytes(sample.index_list) + file_bytes(sample.file1_list) +
+		file_bytes(sample.file2_list);
+}
+
+bool bc_splitter::collect_samples(std::vector<sample_files>& samples) {
+	if (!manifest_file.empty()) {
+		std::ifstream manifest(manifest_file);
+		if (!manifest) {
+			*out << "Error: Could not open the manifest " << manifest_file << ".\n";
+			return false;
+		}
+		std::string line;
+		int line_no = 0;
+		while (std::getline(manifest, line)) {
+			line_no++;
+			boost::trim(line);
+			if (line.empty() || line[0] == '#') {
+				continue;
+			}
+			std::istringstream fields(line);
+			sample_files sample;
+			std::string extra;
+			if (!(fields >> sample.prefix >> sample.index_file >> sample.file1 >> sample.file2) ||
+				(fields >> extra)) {
+				*out << "Error: Line " << line_no << " of the manifest is not"
+					" <prefix> <index-file> <file1> <file2>.\n";
+				return false;
+			}
+			struct stat st = {0};
+			sample.file1_list = expand_inputs(sample.file1);
+			sample.file2_list = expand_inputs(sample.file2);
+			if (!index_from_header) {
+				sample.index_list = expand_inputs(sample.index_file);
+			}
+			for (auto const* list : {&sample.file1_list, &sample.file2_list, &sample.index_list}) {
+				for (auto const& path : *list) {
+					if (stat(path.c_str(), &st) == -1) {
+						*out << "Error: Missing input file " << path << " for "
+							<< sample.prefix << ".\n";
+						return false;
+					}
+				}
+			}
+			samples.push_back(sample);
+		}
+	} else {
+		// <lane>_<rest>.<lane>.{barcode_1,1,2}.fastq.gz, split as <prefix>.<lane>
+		DIR* dir = opendir(indir.c_str());
+		if (dir == NULL) {
+			*out << "Error: Could not open the input directory " << indir << ".\n";
+			return false;
+		}
+		std::set<std::string> prefixes;
+		while (struct dirent* entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			if (boost::ends_with(name, "fastq.gz") || boost::ends_with(name, "fastq")) {
+				prefixes.insert(name.substr(0, name.find('.')));
+			}
+		}
+		closedir(dir);
+
+		for (auto const& prefix : prefixes) {
+			std::string lane = prefix.substr(0, prefix.find('_'));
+			std::string base = indir + "/" + prefix + "." + lane;
+			sample_files sample;
+			sample.prefix = prefix + "." + lane;
+			if ((!index_from_header && !find_fastq(base + ".barcode_1", sample.index_file)) ||
+				!find_fastq(base + ".1", sample.file1) ||
+				!find_fastq(base + ".2", sample.file2)) {
+				*out << "Error: Missing input files for " << sample.prefix << " in "
+					<< indir << ".\n";
+				return false;
+			}
+			sample.file1_list = {sample.file1};
+			sample.file2_list = {sample.file2};
+			if (!index_from_header) {
+				sample.index_list = {sample.index_file};
+			}
+			samples.push_back(sample);
+		}
 	}
 
-	std::cout << "Ambiguous: " << ambiguous_percent << "%\n";
-	std::cout << "No-match: " << no_match_percent << "%\n";
+	if (samples.empty()) {
+		*out << "Error: No samples found.\n";
+		return false;
+	}
+	return true;
+}
+
+// One sample of a batch, as a run of its own with the shared dictionary.
+// Its console output goes to <prefix>_out.txt and its errors to
+// <prefix>_err.txt in the output directory, as the job submission did.
+bool bc_splitter::run_sample(const sample_files& sample,
+	std::shared_ptr<const BKTree<std::string>> shared_tree) {
+
+	const std::string base = outdirpath + "/" + sample.prefix;
+	std::ofstream out_log(base + "_out.txt");
+	std::ofstream err_log(base + "_err.txt");
+
+	std::vector<std::string> args = {"index_splitter"};
+	args.insert(args.end(), sample_args.begin(), sample_args.end());
+	if (!index_from_header) {
+		args.insert(args.end(), {"-i", sample.index_file});
+	}
+	args.insert(args.end(), {"--file1", sample.file1, "--file2", sample.file2,
+		"-p", sample.prefix, "--allowed-mb", std::to_string(sample_allowed_MB)});
+	std::vector<char*> argv;
+	for (auto& arg : args) {
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(NULL);
+
+	bc_splitter lbs;
+	lbs.set_output(out_log, "index_splitter " + sample.prefix);
+	lbs.set_inputs(sample);
+	try {
+		if (!lbs.parse_args(argv.size() - 1, argv.data())) {
+			lbs.print_help();
+			return false;
+		}
+		lbs.initialize(shared_tree);
+		lbs.split_engine();
+		lbs.write_log();
+	} catch(std::exception& e) {
+		err_log << "error: " << e.what() << "\n";
+		return false;
+	}
+	return true;
+}
+
+// Splits every sample of the manifest or the input directory in one
+// process. The dictionary is loaded once and shared read only; each
+// worker takes the next sample, largest first, until none is left, with
+// its share of --allowed-mb.
+int bc_splitter::batch_engine() {
+	std::vector<sample_files> samples;
+	if (!collect_samples(samples)) {
+		return 1;
+	}
+	std::vector<unsigned long> sizes;
+	for (auto const& sample : samples) {
+		sizes.push_back(sample_bytes(sample));
+	}
+	std::vector<size_t> order(samples.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&sizes](size_t a, size_t b) {
+		return sizes[a] > sizes[b];
+	});
+
+	auto load_start = std::chrono::steady_clock::now();
+	std::shared_ptr<const BKTree<std::string>> shared_tree = load_tree(dict_file);
+	std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+	*out << "Dictionary loaded in " << load_time.count() << " s, " << samples.size()
+		<< " samples.\n";
+
+	struct stat st = {0};
+	if (stat(outdirpath.c_str(), &st) == -1) {
+		mkdir(outdirpath.c_str(), 0755);
+	}
+
+	int nthreads = std::min<size_t>(threads, samples.size());
+	sample_allowed_MB = std::max(1, allowed_MB / nthreads);
+	*out << sample_allowed_MB << " MB for each of " << nthreads << " samples at a time.\n";
+
+	std::vector<char> succeeded(samples.size(), 0);
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < order.size(); i = next++) {
+			succeeded[order[i]] = run_sample(samples[order[i]], shared_tree);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int i = 1; i < nthreads; i++) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto& t : workers) {
+		t.join();
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < samples.size(); i++) {
+		if (!succeeded[i]) {
+			*out << "Error: Sample " << samples[i].prefix << " failed, see "
+				<< outdirpath << "/" << samples[i].prefix << "_err.txt.\n";
+			failed++;
+		}
+	}
+	*out << samples.size() - failed << " of " << samples.size() << " samples split.\n";
+	return failed > 0 ? 1 : 0;
 }
 
 
@@ -607,6 +1843,10 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
+	if (lbs.is_batch()) {
+		return lbs.batch_engine();
+	}
+
 	lbs.initialize();
 	try {
 		lbs.split_engine();
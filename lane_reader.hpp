@@ -0,0 +1,261 @@
+#ifndef _LANE_READER_HPP
+#define _LANE_READER_HPP
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <glob.h>
+
+#include "fastq_reader.hpp"
+
+// An input option given as a comma separated list of files and/or glob
+// patterns, e.g. "s_L00*_R1.fastq.gz". The matches of a pattern come in
+// sorted order; a pattern without matches is kept as is, so that opening
+// it fails the same way as a missing file.
+inline std::vector<std::string> expand_inputs(const std::string& spec) {
+    std::vector<std::string> paths;
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string item = spec.substr(start, end - start);
+        start = end + 1;
+        if (item.empty()) {
+            continue;
+        }
+        if (item.find_first_of("*?[") == std::string::npos) {
+            paths.push_back(item);
+            continue;
+        }
+        glob_t matches;
+        if (glob(item.c_str(), 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                paths.push_back(matches.gl_pathv[i]);
+            }
+        } else {
+            paths.push_back(item);
+        }
+        globfree(&matches);
+    }
+    return paths;
+}
+
+// The lanes of one sample, read and classified concurrently. Each lane
+// has a thread that reads records from its files (one fastq_reader per
+// input, e.g. file1 and file2 of the lane) and classifies them, in chunks
+// of chunk_size records. The consumer takes the chunks from the lanes in
+// turn, lane 1 first, so the order it sees depends only on the inputs and
+// the chunk size, never on the timing of the threads. That order is
+// chunk_size records of each lane in turn, not one lane after the other
+// as a serial run over the lanes would give. A lane that runs
+// ahead waits once queue_chunks chunks are ready, which bounds the memory.
+//
+// read fills a record from the readers of a lane and returns false at the
+// end of the input; classify gets the record and the lane number. An
+// exception in a lane thread is thrown again by next() at that lane.
+template <typename Record>
+class lane_reader {
+    public:
+    typedef std::function<bool(std::vector<std::unique_ptr<fastq_reader>>&, Record&)> read_fn;
+    typedef std::function<void(Record&, size_t)> classify_fn;
+
+    // lanes[i] are the files of lane i, in the order read expects them.
+    lane_reader(const std::vector<std::vector<std::string>>& lanes, read_fn read,
+        classify_fn classify, size_t chunk_size = 4096, size_t queue_chunks = 4) {
+
+        this -> read = read;
+        this -> classify = classify;
+        this -> chunk_size = chunk_size;
+        this -> queue_chunks = queue_chunks;
+        for (size_t i = 0; i < lanes.size(); i++) {
+            this -> lanes.emplace_back(new lane(lanes[i]));
+        }
+        for (size_t i = 0; i < lanes.size(); i++) {
+            this -> lanes[i]->worker = std::thread([this, i]() { run(i); });
+        }
+    }
+
+    ~lane_reader() {
+        stopping = true;
+        for (auto& l : lanes) {
+            {
+                std::lock_guard<std::mutex> lock(l->mtx);
+            }
+            l->cond.notify_all();
+        }
+        for (auto& l : lanes) {
+            if (l->worker.joinable()) {
+                l->worker.join();
+            }
+        }
+    }
+
+    // The next record, or NULL once every lane is done. The record stays
+    // valid until the following call.
+    Record* next() {
+        while (true) {
+            if (current && pos < current->size()) {
+                return &(*current)[pos++];
+            }
+            if (current) {
+                lane& l = *lanes[turn];
+                std::lock_guard<std::mutex> lock(l.mtx);
+                l.free_chunks.push_back(std::move(current));
+                l.cond.notify_all();
+                turn = (turn + 1) % lanes.size();
+            }
+            if (!take_chunk()) {
+                return NULL;
+            }
+        }
+    }
+
+    size_t lane_count() const {
+        return lanes.size();
+    }
+
+    // Uncompressed text parsed and the position in the input files, over
+    // all lanes, as of the last chunk of each.
+    unsigned long input_bytes() const {
+        unsigned long bytes = 0;
+        for (auto const& l : lanes) {
+            bytes += l->bytes_read.load(std::memory_order_relaxed);
+        }
+        return bytes;
+    }
+
+    unsigned long input_file_pos() const {
+        unsigned long pos = 0;
+        for (auto const& l : lanes) {
+            pos += l->file_pos.load(std::memory_order_relaxed);
+        }
+        return pos;
+    }
+
+    private:
+    typedef std::vector<Record> chunk;
+
+    struct lane {
+        explicit lane(const std::vector<std::string>& paths) : paths(paths) {
+        }
+
+        std::vector<std::string> paths;
+        std::thread worker;
+        std::mutex mtx;
+        std::condition_variable cond;
+        std::deque<std::unique_ptr<chunk>> ready;
+        std::vector<std::unique_ptr<chunk>> free_chunks;
+        bool done = false;
+        std::exception_ptr error;
+        std::atomic<unsigned long> bytes_read{0};
+        std::atomic<unsigned long> file_pos{0};
+    };
+
+    // Waits for the next chunk of the lane whose turn it is, skipping
+    // lanes that are done.
+    bool take_chunk() {
+        for (size_t tried = 0; tried < lanes.size(); tried++) {
+            lane& l = *lanes[turn];
+            std::unique_lock<std::mutex> lock(l.mtx);
+            l.cond.wait(lock, [&l]() { return !l.ready.empty() || l.done; });
+            if (!l.ready.empty()) {
+                current = std::move(l.ready.front());
+                l.ready.pop_front();
+                pos = 0;
+                l.cond.notify_all();
+                return true;
+            }
+            if (l.error) {
+                std::exception_ptr error = l.error;
+                l.error = nullptr;
+                std::rethrow_exception(error);
+            }
+            turn = (turn + 1) % lanes.size();
+        }
+        return false;
+    }
+
+    void run(size_t idx) {
+        lane& l = *lanes[idx];
+        try {
+            std::vector<std::unique_ptr<fastq_reader>> readers;
+            for (auto& path : l.paths) {
+                readers.emplace_back(new fastq_reader(path));
+            }
+            bool more = true;
+            while (more && !stopping) {
+                std::unique_ptr<chunk> next_chunk;
+                {
+                    std::unique_lock<std::mutex> lock(l.mtx);
+                    l.cond.wait(lock, [this, &l]() {
+                        return stopping || l.ready.size() < queue_chunks;
+                    });
+                    if (stopping) {
+                        break;
+                    }
+                    if (!l.free_chunks.empty()) {
+                        next_chunk = std::move(l.free_chunks.back());
+                        l.free_chunks.pop_back();
+                    }
+                }
+                if (!next_chunk) {
+                    next_chunk.reset(new chunk());
+                }
+                // The records of a recycled chunk keep their string buffers.
+                next_chunk->resize(chunk_size);
+                size_t count = 0;
+                while (count < chunk_size) {
+                    if (!read(readers, (*next_chunk)[count])) {
+                        more = false;
+                        break;
+                    }
+                    classify((*next_chunk)[count], idx);
+                    count++;
+                }
+                next_chunk->resize(count);
+
+                unsigned long bytes = 0;
+                unsigned long file_pos = 0;
+                for (auto& reader : readers) {
+                    bytes += reader->get_bytes_read();
+                    file_pos += reader->get_file_pos();
+                }
+                l.bytes_read.store(bytes, std::memory_order_relaxed);
+                l.file_pos.store(file_pos, std::memory_order_relaxed);
+
+                if (count > 0) {
+                    std::lock_guard<std::mutex> lock(l.mtx);
+                    l.ready.push_back(std::move(next_chunk));
+                    l.cond.notify_all();
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(l.mtx);
+            l.error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(l.mtx);
+        l.done = true;
+        l.cond.notify_all();
+    }
+
+    std::vector<std::unique_ptr<lane>> lanes;
+    read_fn read;
+    classify_fn classify;
+    size_t chunk_size;
+    size_t queue_chunks;
+    std::atomic<bool> stopping{false};
+
+    // The chunk being consumed and the lane it came from
+    std::unique_ptr<chunk> current;
+    size_t pos = 0;
+    size_t turn = 0;
+};
+#endif
@@ -0,0 +1,130 @@
+#ifndef _PACKED_BARCODE_HPP
+#define _PACKED_BARCODE_HPP
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <cctype>
+
+// Two bits per base encoding of a barcode of up to 32 bases. Base i lives
+// in bits 2i and 2i+1. Anything that is not A, C, G or T (normally N) is
+// stored as A and flagged in nmask, which uses the low bit of the same two
+// bit slot, so the Hamming distance and the N handling are a few word
+// operations regardless of the barcode length.
+
+struct packed_barcode {
+    uint64_t bits = 0;
+    uint64_t nmask = 0;
+    int len = 0;
+
+    static const uint64_t LOW_BITS = 0x5555555555555555ULL;
+    static const int MAX_LEN = 32;
+
+    // Whether a barcode of this length has a packed encoding. Longer ones,
+    // and an empty slice of a short read, are compared as strings.
+    static bool fits(size_t len) {
+        return len > 0 && len <= MAX_LEN;
+    }
+
+    static packed_barcode encode(const std::string& str) {
+        return encode(str.data(), str.length());
+    }
+
+    static packed_barcode encode(const char* str, size_t len) {
+        if (len == 0 || len > MAX_LEN) {
+            throw std::invalid_argument("Barcode length is not supported by the packed encoding.");
+        }
+        packed_barcode pb;
+        pb.len = len;
+        for (size_t i = 0; i < len; i++) {
+            uint64_t code;
+            switch (str[i]) {
+                case 'A': case 'a': code = 0; break;
+                case 'C': case 'c': code = 1; break;
+                case 'G': case 'g': code = 2; break;
+                case 'T': case 't': code = 3; break;
+                default:
+                    code = 0;
+                    pb.nmask |= 1ULL << (2 * i);
+            }
+            pb.bits |= code << (2 * i);
+        }
+        return pb;
+    }
+
+    std::string decode() const {
+        static const char bases[] = "ACGT";
+        std::string str(len, 'N');
+        for (int i = 0; i < len; i++) {
+            if (!((nmask >> (2 * i)) & 1)) {
+                str[i] = bases[(bits >> (2 * i)) & 3];
+            }
+        }
+        return str;
+    }
+
+    int n_count() const {
+        return __builtin_popcountll(nmask);
+    }
+
+    // Mask with the low bit of each of the first n slots set.
+    static uint64_t slot_mask(int n) {
+        return n >= MAX_LEN ? LOW_BITS : (LOW_BITS & ((1ULL << (2 * n)) - 1));
+    }
+};
+
+// Hamming distance of two packed barcodes of the same length. A position
+// where either side is N counts as one mismatch, or as nothing when
+// n_wildcard is set. With remove_last the last base is ignored, as in
+// BKNode::distance.
+inline int packed_distance(const packed_barcode& a, const packed_barcode& b,
+    bool n_wildcard = false, bool remove_last = false) {
+
+    if (a.len != b.len) {
+        throw std::invalid_argument("Source and target have different length");
+    }
+    uint64_t valid = packed_barcode::slot_mask(remove_last ? a.len - 1 : a.len);
+    uint64_t x = a.bits ^ b.bits;
+    uint64_t diff = (x | (x >> 1)) & valid;
+    uint64_t nm = (a.nmask | b.nmask) & valid;
+    int dist = __builtin_popcountll(diff & ~nm);
+    if (!n_wildcard) {
+        dist += __builtin_popcountll(nm);
+    }
+    return dist;
+}
+inline bool is_acgt(char c) {
+    switch (c) {
+        case 'A': case 'a': case 'C': case 'c': case 'G': case 'g': case 'T': case 't':
+            return true;
+    }
+    return false;
+}
+
+// packed_distance on the strings, for barcodes without a packed encoding.
+inline int string_distance(const std::string& a, const std::string& b,
+    bool n_wildcard = false, bool remove_last = false) {
+
+    if (a.length() != b.length()) {
+        throw std::invalid_argument("Source and target have different length");
+    }
+    size_t n = remove_last && a.length() > 0 ? a.length() - 1 : a.length();
+    int dist = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!is_acgt(a[i]) || !is_acgt(b[i])) {
+            dist += n_wildcard ? 0 : 1;
+        } else if (toupper(a[i]) != toupper(b[i])) {
+            dist++;
+        }
+    }
+    return dist;
+}
+
+// Bases that are not A, C, G or T, as packed_barcode::n_count counts them.
+inline int string_n_count(const std::string& str) {
+    int count = 0;
+    for (char c : str) {
+        count += is_acgt(c) ? 0 : 1;
+    }
+    return count;
+}
+#endif
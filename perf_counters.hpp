@@ -0,0 +1,140 @@
+#ifndef _PERF_COUNTERS_HPP
+#define _PERF_COUNTERS_HPP
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters of the calling thread through perf_event_open, as one
+// group so that all of them are read with a single system call. Only user
+// space is counted, which is what perf_event_paranoid 2 (the usual default
+// on shared nodes) still allows. An event the machine or the VM does not
+// have is left out; if none can be opened, available() is false and
+// error() says why.
+class perf_counters {
+    public:
+    enum event {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        EVENT_COUNT
+    };
+
+    static const char* event_name(int ev) {
+        static const char* names[EVENT_COUNT] = {
+            "cycles", "instructions", "cache-misses", "branch-misses"
+        };
+        return names[ev];
+    }
+
+    perf_counters() {
+        for (int ev = 0; ev < EVENT_COUNT; ev++) {
+            fds[ev] = -1;
+            slots[ev] = -1;
+        }
+    }
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator = (const perf_counters&) = delete;
+
+    ~perf_counters() {
+        close_all();
+    }
+
+    bool open() {
+#if defined(__linux__)
+        static const uint64_t configs[EVENT_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        int leader = -1;
+        for (int ev = 0; ev < EVENT_COUNT; ev++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[ev];
+            attr.disabled = leader < 0 ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd < 0) {
+                if (err.empty()) {
+                    err = std::string(event_name(ev)) + ": " + strerror(errno);
+                }
+                continue;
+            }
+            if (leader < 0) {
+                leader = fd;
+            }
+            fds[ev] = fd;
+            slots[ev] = group_size++;
+        }
+        if (leader < 0) {
+            return false;
+        }
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        leader_fd = leader;
+        return true;
+#else
+        err = "perf_event_open is only available on Linux";
+        return false;
+#endif
+    }
+
+    bool available() const {
+        return leader_fd >= 0;
+    }
+
+    bool has(int ev) const {
+        return slots[ev] >= 0;
+    }
+
+    const std::string& error() const {
+        return err;
+    }
+
+    // Current value of every event, 0 for the ones not opened.
+    bool read(uint64_t values[EVENT_COUNT]) const {
+        // Group read format: the number of events, then their values
+        uint64_t buf[EVENT_COUNT + 1];
+        if (leader_fd < 0 || ::read(leader_fd, buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t)) {
+            return false;
+        }
+        for (int ev = 0; ev < EVENT_COUNT; ev++) {
+            values[ev] = slots[ev] >= 0 ? buf[1 + slots[ev]] : 0;
+        }
+        return true;
+    }
+
+    private:
+    void close_all() {
+        for (int ev = 0; ev < EVENT_COUNT; ev++) {
+            if (fds[ev] >= 0) {
+                close(fds[ev]);
+                fds[ev] = -1;
+            }
+        }
+        leader_fd = -1;
+    }
+
+    int fds[EVENT_COUNT];
+    // Position of each event in the group read, -1 if not opened
+    int slots[EVENT_COUNT];
+    int group_size = 0;
+    int leader_fd = -1;
+    std::string err;
+};
+#endif
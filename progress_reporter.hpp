@@ -0,0 +1,194 @@
+#ifndef _PROGRESS_REPORTER_HPP
+#define _PROGRESS_REPORTER_HPP
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+
+#include "run_metrics.hpp"
+
+// Counters the splitting thread publishes for the progress reporter. The
+// splitter keeps its own plain counters and stores them here every few
+// thousand reads, so the hot loop only pays for a few relaxed stores.
+struct progress_counters {
+    std::atomic<unsigned long> reads{0};
+    // Uncompressed text parsed and the position in the input files
+    std::atomic<unsigned long> input_bytes{0};
+    std::atomic<unsigned long> input_file_pos{0};
+    std::atomic<unsigned long> output_bytes{0};
+    std::atomic<unsigned long> buffered_bytes{0};
+    std::atomic<unsigned long> flushes{0};
+};
+
+// Timer thread that samples progress_counters every interval seconds and
+// prints a line to stderr and/or rewrites a small JSON status file. The
+// status file is written next to its final name and renamed over it, so a
+// monitor never sees half of it. With input_file_total (the size of the
+// input files on disk) known, it also gives an ETA.
+class progress_reporter {
+    public:
+    progress_reporter(const progress_counters& counters, const std::string& tool,
+        double interval, bool print, const std::string& status_file,
+        unsigned long input_file_total) : counters(counters) {
+
+        this -> tool = tool;
+        this -> interval = interval > 0 ? interval : 1;
+        this -> print = print;
+        this -> status_file = status_file;
+        this -> input_file_total = input_file_total;
+    }
+
+    ~progress_reporter() {
+        stop();
+    }
+
+    void start() {
+        start_time = std::chrono::steady_clock::now();
+        last_time = start_time;
+        worker = std::thread([this]() { run(); });
+    }
+
+    // Stops the timer thread and reports the final state once more.
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            done = true;
+        }
+        cv.notify_all();
+        worker.join();
+        report(true);
+    }
+
+    private:
+    struct sample {
+        unsigned long reads = 0;
+        unsigned long input_bytes = 0;
+        unsigned long input_file_pos = 0;
+        unsigned long output_bytes = 0;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto period = std::chrono::duration<double>(interval);
+        while (!cv.wait_for(lock, period, [this]() { return done; })) {
+            lock.unlock();
+            report(false);
+            lock.lock();
+        }
+    }
+
+    void report(bool finished) {
+        auto now = std::chrono::steady_clock::now();
+        sample cur;
+        cur.reads = counters.reads.load(std::memory_order_relaxed);
+        cur.input_bytes = counters.input_bytes.load(std::memory_order_relaxed);
+        cur.input_file_pos = counters.input_file_pos.load(std::memory_order_relaxed);
+        cur.output_bytes = counters.output_bytes.load(std::memory_order_relaxed);
+        unsigned long buffered = counters.buffered_bytes.load(std::memory_order_relaxed);
+        unsigned long flushes = counters.flushes.load(std::memory_order_relaxed);
+
+        double elapsed = std::chrono::duration<double>(now - start_time).count();
+        double span = std::chrono::duration<double>(now - last_time).count();
+        if (span <= 0) {
+            span = elapsed > 0 ? elapsed : 1;
+        }
+        const double MB = 1024.0 * 1024.0;
+        // Rates over the last interval, so a slow phase shows up right away
+        double reads_rate = (cur.reads - last.reads) / span;
+        double in_rate = (cur.input_bytes - last.input_bytes) / MB / span;
+        double in_file_rate = (cur.input_file_pos - last.input_file_pos) / MB / span;
+        double out_rate = (cur.output_bytes - last.output_bytes) / MB / span;
+
+        // The ETA uses the average rate through the input files since the start.
+        double eta = -1;
+        if (!finished && input_file_total > 0 && cur.input_file_pos > 0 && elapsed > 0) {
+            double remaining = input_file_total > cur.input_file_pos ?
+                input_file_total - cur.input_file_pos : 0;
+            eta = remaining / (cur.input_file_pos / elapsed);
+        }
+
+        if (print) {
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(1);
+            line << "[" << tool << "] " << (finished ? "done " : "") << cur.reads << " reads, "
+                << reads_rate << " reads/s, in " << in_rate << " MB/s ("
+                << in_file_rate << " MB/s on disk), out " << out_rate << " MB/s, buffered "
+                << buffered / MB << " MB, " << flushes << " flushes, elapsed "
+                << elapsed << " s";
+            if (eta >= 0) {
+                line << ", ETA " << eta << " s";
+            }
+            line << "\n";
+            std::cerr << line.str();
+        }
+
+        if (!status_file.empty()) {
+            write_status(cur, finished, elapsed, reads_rate, in_rate, in_file_rate,
+                out_rate, buffered, flushes, eta);
+        }
+
+        last = cur;
+        last_time = now;
+    }
+
+    void write_status(const sample& cur, bool finished, double elapsed, double reads_rate,
+        double in_rate, double in_file_rate, double out_rate, unsigned long buffered,
+        unsigned long flushes, double eta) {
+
+        const std::string tmp_file = status_file + ".tmp";
+        {
+            std::ofstream out(tmp_file, std::ios_base::out | std::ios_base::trunc);
+            json_writer json(out);
+            json.begin_object();
+            json.field("tool", tool);
+            json.field("state", finished ? "done" : "running");
+            json.field("elapsed_seconds", elapsed);
+            json.field("reads", cur.reads);
+            json.field("reads_per_second", reads_rate);
+            json.field("input_bytes", cur.input_bytes);
+            json.field("input_file_bytes_read", cur.input_file_pos);
+            json.field("input_file_bytes_total", input_file_total);
+            json.field("input_mb_per_second", in_rate);
+            json.field("input_file_mb_per_second", in_file_rate);
+            json.field("output_bytes", cur.output_bytes);
+            json.field("output_mb_per_second", out_rate);
+            json.field("buffered_bytes", buffered);
+            json.field("flushes", flushes);
+            if (eta >= 0) {
+                json.field("eta_seconds", eta);
+            }
+            json.end_object();
+            if (!out) {
+                return;
+            }
+        }
+        std::rename(tmp_file.c_str(), status_file.c_str());
+    }
+
+    const progress_counters& counters;
+    std::string tool;
+    double interval;
+    bool print;
+    std::string status_file;
+    unsigned long input_file_total;
+
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point last_time;
+    sample last;
+};
+#endif
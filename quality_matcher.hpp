@@ -0,0 +1,167 @@
+#ifndef _QUALITY_MATCHER_HPP
+#define _QUALITY_MATCHER_HPP
+#include <string>
+#include <vector>
+#include <set>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Probabilistic barcode assignment that uses the base qualities of the
+// barcode window. A base with Phred quality q agrees with the true barcode
+// with probability 1 - e(q) and shows one of the other three bases with
+// probability e(q)/3. Every dictionary barcode gets the same prior, and a
+// "not in the dictionary" hypothesis (uniform bases) gets null_prior. A read
+// is assigned to the best barcode only when its posterior beats the
+// threshold, so low quality mismatches cost little while confident
+// mismatches still keep the read out.
+//
+// The log-likelihood terms come from per-quality lookup tables. For each
+// dictionary entry only the positions that differ from the read need to be
+// looked at, and those are found with one SIMD compare per 16 bases.
+
+class quality_matcher {
+    public:
+    quality_matcher(const std::set<std::string>& barcode_set, double min_posterior,
+        double null_prior, int qual_offset = 33) {
+
+        if (barcode_set.empty()) {
+            throw std::invalid_argument("Quality matcher needs a non empty dictionary.");
+        }
+        if (null_prior <= 0 || null_prior >= 1) {
+            throw std::invalid_argument("Null prior must be between 0 and 1.");
+        }
+
+        barcodes.assign(barcode_set.begin(), barcode_set.end());
+        bc_len = barcodes[0].length();
+        if (bc_len == 0 || bc_len > MAX_LEN) {
+            throw std::invalid_argument("Barcode length is not supported by the quality matcher.");
+        }
+        stride = ((bc_len + 15) / 16) * 16;
+
+        packed.assign(barcodes.size() * stride, 0);
+        for (size_t i = 0; i < barcodes.size(); i++) {
+            if (barcodes[i].length() != (size_t) bc_len) {
+                throw std::invalid_argument("Dictionary barcodes have different length.");
+            }
+            memcpy(&packed[i * stride], barcodes[i].data(), bc_len);
+        }
+
+        for (int q = 0; q <= MAX_PHRED; q++) {
+            double err = std::pow(10.0, -q / 10.0);
+            // Below Q2 the base call carries no information at all.
+            if (err > 0.75) {
+                err = 0.75;
+            }
+            match_ll[q] = (float) std::log(1.0 - err);
+            mismatch_ll[q] = (float) std::log(err / 3.0);
+        }
+
+        this -> min_posterior = min_posterior;
+        this -> qual_offset = qual_offset;
+        log_prior_ratio = std::log(null_prior) -
+            std::log((1.0 - null_prior) / (double) barcodes.size());
+        null_ll = bc_len * std::log(0.25);
+    }
+
+    // Returns the index of the assigned barcode or -1 if no barcode has
+    // a posterior of at least min_posterior.
+    int assign(const std::string& window, const std::string& qual_window,
+        double& posterior) const {
+
+        if (window.length() != (size_t) bc_len || qual_window.length() != (size_t) bc_len) {
+            std::string msg = "The size of the barcode or its quality does not match\n"
+                "with the one from the dictionary.\n" + window + "\n" + qual_window + "\n";
+            throw std::invalid_argument(msg);
+        }
+
+        alignas(16) unsigned char query[MAX_LEN] = {0};
+        memcpy(query, window.data(), bc_len);
+
+        // The read's likelihood if every base agreed, and what each position
+        // costs when it disagrees.
+        double base_ll = 0;
+        float penalty[MAX_LEN];
+        for (int i = 0; i < bc_len; i++) {
+            int q = (unsigned char) qual_window[i] - qual_offset;
+            if (q < 0) {
+                q = 0;
+            } else if (q > MAX_PHRED) {
+                q = MAX_PHRED;
+            }
+            base_ll += match_ll[q];
+            penalty[i] = mismatch_ll[q] - match_ll[q];
+        }
+
+        // Everything below is relative to base_ll, so each term is <= 1.
+        int best_idx = -1;
+        double best_ll = 0;
+        double sum_lik = 0;
+        for (size_t idx = 0; idx < barcodes.size(); idx++) {
+            uint64_t mask = mismatch_mask(query, idx);
+            double ll = 0;
+            while (mask) {
+                ll += penalty[__builtin_ctzll(mask)];
+                mask &= mask - 1;
+            }
+            sum_lik += std::exp(ll);
+            if (best_idx < 0 || ll > best_ll) {
+                best_idx = idx;
+                best_ll = ll;
+            }
+        }
+        sum_lik += std::exp(null_ll - base_ll + log_prior_ratio);
+
+        posterior = std::exp(best_ll) / sum_lik;
+        if (posterior >= min_posterior) {
+            return best_idx;
+        }
+        return -1;
+    }
+
+    const std::string& get_barcode(int idx) const {
+        return barcodes[idx];
+    }
+
+    private:
+    // Bit i is set when position i of the query differs from barcode idx.
+    uint64_t mismatch_mask(const unsigned char* query, size_t idx) const {
+        const unsigned char* ref = &packed[idx * stride];
+        uint64_t eq = 0;
+        for (int off = 0; off < stride; off += 16) {
+#if defined(__SSE2__)
+            __m128i a = _mm_load_si128((const __m128i*) (query + off));
+            __m128i b = _mm_loadu_si128((const __m128i*) (ref + off));
+            uint64_t m = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+#else
+            uint64_t m = 0;
+            for (int j = 0; j < 16; j++) {
+                m |= (uint64_t) (query[off + j] == ref[off + j]) << j;
+            }
+#endif
+            eq |= m << off;
+        }
+        uint64_t len_mask = bc_len == 64 ? ~0ULL : ((1ULL << bc_len) - 1);
+        return ~eq & len_mask;
+    }
+
+    static const int MAX_PHRED = 93;
+    static const int MAX_LEN = 64;
+
+    std::vector<std::string> barcodes;
+    // Dictionary barcodes back to back, each zero padded to stride bytes.
+    std::vector<unsigned char> packed;
+    int bc_len;
+    int stride;
+    int qual_offset;
+    double min_posterior;
+    double log_prior_ratio;
+    double null_ll;
+    float match_ll[MAX_PHRED + 1];
+    float mismatch_ll[MAX_PHRED + 1];
+};
+#endif
@@ -0,0 +1,214 @@
+#ifndef _RUN_METRICS_HPP
+#define _RUN_METRICS_HPP
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+// Counters of a splitter run that only go to the metrics file. The read
+// and barcode counters stay where they are in the splitters.
+struct run_metrics {
+    // Bytes of FASTQ text parsed and written, before compression
+    unsigned long input_bytes = 0;
+    unsigned long output_bytes = 0;
+    // Sizes on disk, compressed where the files are
+    unsigned long input_file_bytes = 0;
+    unsigned long output_file_bytes = 0;
+    // Buffering of reads between flushes to the output files
+    unsigned long flush_count = 0;
+    unsigned long peak_buffered_bytes = 0;
+    double load_seconds = 0;
+    double split_seconds = 0;
+};
+
+inline unsigned long file_bytes(const std::string& path) {
+    struct stat buffer;
+    if (stat(path.c_str(), &buffer) != 0) {
+        return 0;
+    }
+    return buffer.st_size;
+}
+
+inline unsigned long file_bytes(const std::vector<std::string>& paths) {
+    unsigned long bytes = 0;
+    for (auto const& path : paths) {
+        bytes += file_bytes(path);
+    }
+    return bytes;
+}
+
+// Just enough of a JSON writer for nested objects and arrays of numbers and
+// strings. Members come out in the order they are written.
+class json_writer {
+    public:
+    json_writer(std::ostream& out) : out(out) {
+    }
+
+    void begin_object(const std::string& key = "") {
+        open('{', key);
+    }
+
+    void end_object() {
+        close('}');
+    }
+
+    // Members of an array are written with an empty key.
+    void begin_array(const std::string& key = "") {
+        open('[', key);
+    }
+
+    void end_array() {
+        close(']');
+    }
+
+    template <typename V>
+    void field(const std::string& key, const V& value) {
+        separate(key);
+        out << value;
+    }
+
+    void field(const std::string& key, const std::string& value) {
+        separate(key);
+        quote(value);
+    }
+
+    void field(const std::string& key, const char* value) {
+        field(key, std::string(value));
+    }
+
+    void field(const std::string& key, bool value) {
+        separate(key);
+        out << (value ? "true" : "false");
+    }
+
+    private:
+    struct level {
+        // True until the first member is written
+        bool first;
+        bool array;
+    };
+
+    void open(char bracket, const std::string& key) {
+        if (!levels.empty()) {
+            separate(key);
+        }
+        out << bracket;
+        levels.push_back(level{true, bracket == '['});
+    }
+
+    void close(char bracket) {
+        levels.pop_back();
+        out << "\n" << std::string(2 * levels.size(), ' ') << bracket;
+        if (levels.empty()) {
+            out << "\n";
+        }
+    }
+
+    void separate(const std::string& key) {
+        if (!levels.back().first) {
+            out << ",";
+        }
+        levels.back().first = false;
+        out << "\n" << std::string(2 * levels.size(), ' ');
+        if (!levels.back().array) {
+            quote(key);
+            out << ": ";
+        }
+    }
+
+    void quote(const std::string& str) {
+        out << '"';
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if ((unsigned char) c < 0x20) {
+                const char* hex = "0123456789abcdef";
+                out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    std::ostream& out;
+    // One entry per open object or array
+    std::vector<level> levels;
+};
+
+// Rows of (section, key, value) that go out either as a TSV with one row
+// per value, or as a JSON object of sections. Rows of a section have to be
+// added one after the other.
+class metrics_table {
+    public:
+    template <typename V>
+    void add(const std::string& section, const std::string& key, const V& value) {
+        std::ostringstream str;
+        str << value;
+        rows.push_back(row{section, key, str.str(), true});
+    }
+
+    void add(const std::string& section, const std::string& key, const std::string& value) {
+        rows.push_back(row{section, key, value, false});
+    }
+
+    void add(const std::string& section, const std::string& key, const char* value) {
+        add(section, key, std::string(value));
+    }
+
+    void write_tsv(const std::string& path) const {
+        std::ofstream out(path);
+        out << "section\tkey\tvalue\n";
+        for (auto const& r : rows) {
+            out << r.section << "\t" << r.key << "\t" << r.value << "\n";
+        }
+    }
+
+    void write_json(const std::string& path) const {
+        std::ofstream out(path);
+        json_writer json(out);
+        json.begin_object();
+        std::string section;
+        for (auto const& r : rows) {
+            if (r.section != section) {
+                if (!section.empty()) {
+                    json.end_object();
+                }
+                section = r.section;
+                json.begin_object(section);
+            }
+            if (r.numeric) {
+                json.field(r.key, raw_value(r.value));
+            } else {
+                json.field(r.key, r.value);
+            }
+        }
+        if (!section.empty()) {
+            json.end_object();
+        }
+        json.end_object();
+    }
+
+    private:
+    struct row {
+        std::string section;
+        std::string key;
+        std::string value;
+        bool numeric;
+    };
+
+    // Numbers are already formatted, this keeps them unquoted.
+    struct raw_value {
+        raw_value(const std::string& str) : str(str) {
+        }
+        friend std::ostream& operator << (std::ostream& out, const raw_value& v) {
+            return out << v.str;
+        }
+        const std::string& str;
+    };
+
+    std::vector<row> rows;
+};
+#endif
@@ -0,0 +1,448 @@
+#ifndef _SHARD_READER_HPP
+#define _SHARD_READER_HPP
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <zlib.h>
+#include <boost/iostreams/categories.hpp>
+
+// Shards of one FASTQ input for several processes. Shard i of N starts at
+// the first record after byte size * i / N of the first file; the other
+// files of the set (e.g. read 2) start at the record with the same name,
+// so the shards stay paired. Each shard ends where the next one starts,
+// so the shards cover the input exactly once and their outputs concatenate
+// in shard order. Plain files are cut at any byte, BGZF files at their
+// blocks; plain gzip cannot be entered in the middle and is refused.
+
+// A position in a plain or BGZF file: the file offset of a BGZF block and
+// an offset in its uncompressed data. For a plain file block is the byte
+// offset and within is 0.
+struct shard_pos {
+    uint64_t block = 0;
+    uint32_t within = 0;
+
+    bool operator<(const shard_pos& rhs) const {
+        return block < rhs.block || (block == rhs.block && within < rhs.within);
+    }
+    bool operator==(const shard_pos& rhs) const {
+        return block == rhs.block && within == rhs.within;
+    }
+};
+
+struct shard_range {
+    shard_pos start;
+    shard_pos end;
+};
+
+// Sequential reads of a plain or BGZF file from any position up to an end
+// position.
+class shard_file {
+    public:
+    explicit shard_file(const std::string& path) {
+        this -> path = path;
+        file.open(path, std::ios_base::in | std::ios_base::binary);
+        if (!file) {
+            throw std::invalid_argument("Could not open " + path + ".");
+        }
+        file.seekg(0, std::ios_base::end);
+        file_size = file.tellg();
+        end = end_pos();
+
+        unsigned char header[18];
+        size_t got = read_at(0, (char*) header, sizeof(header));
+        if (got >= 2 && header[0] == 0x1f && header[1] == 0x8b) {
+            if (got < sizeof(header) || block_size(header) == 0) {
+                throw std::invalid_argument(path + " is gzip but not BGZF, so it cannot be"
+                    " sharded. Compress it with bgzip, or decompress it.");
+            }
+            is_bgzf = true;
+        }
+        seek(shard_pos());
+    }
+
+    bool bgzf() const {
+        return is_bgzf;
+    }
+
+    uint64_t size() const {
+        return file_size;
+    }
+
+    shard_pos end_pos() const {
+        shard_pos pos;
+        pos.block = file_size;
+        return pos;
+    }
+
+    // Where a read starting at a raw file offset can begin: the offset
+    // itself for a plain file, the first block at or after it for BGZF.
+    shard_pos entry_at(uint64_t offset) {
+        shard_pos pos;
+        pos.block = is_bgzf ? block_at(offset) : std::min(offset, file_size);
+        return pos;
+    }
+
+    void set_end(shard_pos end) {
+        this -> end = end;
+    }
+
+    void seek(shard_pos pos) {
+        data.clear();
+        data_pos = 0;
+        if (is_bgzf) {
+            next_block = pos.block;
+            if (pos.block < file_size) {
+                load_block();
+                data_pos = std::min((size_t) pos.within, data.size());
+            }
+        } else {
+            block_offset = pos.block;
+            next_block = pos.block;
+        }
+    }
+
+    // The position of the next byte to be read.
+    shard_pos tell() const {
+        shard_pos pos;
+        if (!is_bgzf) {
+            pos.block = block_offset + data_pos;
+        } else if (data_pos < data.size()) {
+            pos.block = block_offset;
+            pos.within = data_pos;
+        } else {
+            pos.block = next_block;
+        }
+        return pos;
+    }
+
+    // Up to n bytes, 0 at the end position.
+    size_t read(char* buf, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            size_t avail = available();
+            if (avail == 0) {
+                break;
+            }
+            size_t take = std::min(avail, n - done);
+            memcpy(buf + done, data.data() + data_pos, take);
+            data_pos += take;
+            done += take;
+        }
+        return done;
+    }
+
+    // A line without its newline; false at the end position.
+    bool getline(std::string& line) {
+        line.clear();
+        bool any = false;
+        while (true) {
+            size_t avail = available();
+            if (avail == 0) {
+                return any;
+            }
+            any = true;
+            const char* start = data.data() + data_pos;
+            const char* newline = (const char*) memchr(start, '\n', avail);
+            size_t take = newline ? newline - start : avail;
+            line.append(start, take);
+            data_pos += take;
+            if (newline) {
+                data_pos++;
+                return true;
+            }
+        }
+    }
+
+    private:
+    static const size_t CHUNK = 1 << 16;
+
+    // BSIZE + 1 from a BGZF block header, 0 if it is not one.
+    static size_t block_size(const unsigned char* h) {
+        if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || (h[3] & 4) == 0) {
+            return 0;
+        }
+        size_t xlen = h[10] | (h[11] << 8);
+        if (xlen < 6 || h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0) {
+            return 0;
+        }
+        return (h[16] | (h[17] << 8)) + 1;
+    }
+
+    size_t read_at(uint64_t offset, char* buf, size_t n) {
+        file.clear();
+        file.seekg(offset);
+        file.read(buf, n);
+        return file.gcount();
+    }
+
+    // The first offset at or after offset where a BGZF block starts and is
+    // followed by another block or the end of the file.
+    uint64_t block_at(uint64_t offset) {
+        std::vector<char> buf(CHUNK + 18);
+        while (offset < file_size) {
+            size_t got = read_at(offset, buf.data(), buf.size());
+            for (size_t i = 0; i + 18 <= got; i++) {
+                size_t bsize = block_size((unsigned char*) &buf[i]);
+                if (bsize == 0) {
+                    continue;
+                }
+                uint64_t next = offset + i + bsize;
+                unsigned char h[18];
+                if (next == file_size ||
+                    (read_at(next, (char*) h, 18) == 18 && block_size(h) > 0)) {
+                    return offset + i;
+                }
+            }
+            if (got < buf.size()) {
+                break;
+            }
+            offset += CHUNK;
+        }
+        return file_size;
+    }
+
+    // Bytes that can be read from the buffer before the end position,
+    // after loading the next block or chunk if the buffer is used up.
+    size_t available() {
+        if (data_pos == data.size() && !fill()) {
+            return 0;
+        }
+        shard_pos here = tell();
+        if (!(here < end)) {
+            return 0;
+        }
+        size_t avail = data.size() - data_pos;
+        if (is_bgzf && here.block == end.block) {
+            avail = std::min(avail, (size_t) (end.within - here.within));
+        } else if (!is_bgzf) {
+            avail = std::min(avail, (size_t) (end.block - here.block));
+        }
+        return avail;
+    }
+
+    // The next block or chunk, false at the end of the file.
+    bool fill() {
+        if (next_block >= file_size || !(tell() < end)) {
+            return false;
+        }
+        if (is_bgzf) {
+            load_block();
+        } else {
+            block_offset = next_block;
+            data.resize(CHUNK);
+            data.resize(read_at(block_offset, data.data(), CHUNK));
+            next_block = block_offset + data.size();
+        }
+        data_pos = 0;
+        return !data.empty() || fill();
+    }
+
+    void load_block() {
+        block_offset = next_block;
+        unsigned char h[18];
+        size_t bsize = 0;
+        if (read_at(block_offset, (char*) h, 18) == 18) {
+            bsize = block_size(h);
+        }
+        if (bsize == 0) {
+            throw std::invalid_argument("Bad BGZF block in " + path + ".");
+        }
+        std::vector<char> block(bsize);
+        if (read_at(block_offset, block.data(), bsize) != bsize) {
+            throw std::invalid_argument("Truncated BGZF block in " + path + ".");
+        }
+        size_t xlen = h[10] | (h[11] << 8);
+        const unsigned char* tail = (unsigned char*) block.data() + bsize - 8;
+        uint32_t crc = tail[0] | (tail[1] << 8) | (tail[2] << 16) | ((uint32_t) tail[3] << 24);
+        uint32_t isize = tail[4] | (tail[5] << 8) | (tail[6] << 16) | ((uint32_t) tail[7] << 24);
+
+        data.resize(isize);
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -15);
+        zs.next_in = (Bytef*) block.data() + 12 + xlen;
+        zs.avail_in = bsize - 12 - xlen - 8;
+        zs.next_out = (Bytef*) data.data();
+        zs.avail_out = isize;
+        int ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END || zs.total_out != isize ||
+            crc32(crc32(0L, Z_NULL, 0), (Bytef*) data.data(), isize) != crc) {
+            throw std::invalid_argument("Corrupt BGZF block in " + path + ".");
+        }
+        next_block = block_offset + bsize;
+        data_pos = 0;
+    }
+
+    std::string path;
+    std::ifstream file;
+    uint64_t file_size = 0;
+    bool is_bgzf = false;
+    shard_pos end;
+
+    // The uncompressed block, or the chunk of a plain file, being read
+    std::vector<char> data;
+    size_t data_pos = 0;
+    uint64_t block_offset = 0;
+    uint64_t next_block = 0;
+};
+
+// The name of a read from its header, without the @ and a /1 or /2 mate
+// suffix, so that both mates give the same name.
+inline std::string read_name(const std::string& header) {
+    size_t end = header.find_first_of(" \t\r");
+    if (end == std::string::npos) {
+        end = header.size();
+    }
+    if (end >= 3 && header[end - 2] == '/' && (header[end - 1] == '1' || header[end - 1] == '2')) {
+        end -= 2;
+    }
+    return header.substr(1, end - 1);
+}
+
+// Moves to the first record that starts at or after pos, and returns its
+// position and name; the end position and an empty name if there is none.
+// Past the first line, a line starting with @ is a header when the next
+// but one starts with + and the sequence and quality lengths agree, so a
+// quality line starting with @ is not taken for one.
+inline shard_pos sync_record(shard_file& f, shard_pos pos, bool at_line_start,
+    std::string& name) {
+
+    f.seek(pos);
+    std::string line;
+    if (!at_line_start) {
+        f.getline(line);
+    }
+    std::vector<std::string> lines;
+    std::vector<shard_pos> starts;
+    while (true) {
+        while (lines.size() < 4) {
+            starts.push_back(f.tell());
+            if (!f.getline(line)) {
+                name.clear();
+                return f.end_pos();
+            }
+            lines.push_back(line);
+        }
+        if (!lines[0].empty() && lines[0][0] == '@' && !lines[2].empty() &&
+            lines[2][0] == '+' && lines[1].size() == lines[3].size()) {
+            name = read_name(lines[0]);
+            return starts[0];
+        }
+        lines.erase(lines.begin());
+        starts.erase(starts.begin());
+    }
+}
+
+// The start of the record named name, searched around a raw offset in an
+// ever larger window. Of several records with the name the one closest to
+// the offset is taken.
+inline shard_pos find_named_record(shard_file& f, uint64_t offset, const std::string& name,
+    const std::string& path) {
+
+    uint64_t window = 1 << 20;
+    while (true) {
+        uint64_t from = offset > window ? offset - window : 0;
+        uint64_t to = offset + window;
+        std::string found;
+        shard_pos pos = sync_record(f, f.entry_at(from), from == 0, found);
+        shard_pos best;
+        uint64_t best_dist = UINT64_MAX;
+        // From here on the records follow each other
+        std::string line;
+        while (!found.empty() && pos.block <= to) {
+            uint64_t dist = pos.block > offset ? pos.block - offset : offset - pos.block;
+            if (found == name && dist < best_dist) {
+                best = pos;
+                best_dist = dist;
+            }
+            pos = f.tell();
+            if (!f.getline(line)) {
+                break;
+            }
+            found = read_name(line);
+            for (int i = 0; i < 3; i++) {
+                f.getline(line);
+            }
+        }
+        if (best_dist != UINT64_MAX) {
+            return best;
+        }
+        if (from == 0 && to >= f.size()) {
+            throw std::invalid_argument("Read " + name + " is not in " + path +
+                ", the files are not paired.");
+        }
+        window *= 4;
+    }
+}
+
+// The ranges of shard index (from 0) of count for a set of paired files.
+inline std::vector<shard_range> plan_shard(const std::vector<std::string>& paths,
+    int index, int count) {
+
+    std::vector<std::unique_ptr<shard_file>> files;
+    for (auto const& path : paths) {
+        files.emplace_back(new shard_file(path));
+    }
+
+    // Where shard k starts in each file; shard count starts at the ends.
+    auto boundary = [&](int k) {
+        std::vector<shard_pos> pos(files.size());
+        if (k == 0) {
+            return pos;
+        }
+        if (k == count) {
+            for (size_t i = 0; i < files.size(); i++) {
+                pos[i] = files[i]->end_pos();
+            }
+            return pos;
+        }
+        std::string name;
+        uint64_t offset = files[0]->size() / count * k;
+        pos[0] = sync_record(*files[0], files[0]->entry_at(offset), false, name);
+        for (size_t i = 1; i < files.size(); i++) {
+            if (name.empty()) {
+                pos[i] = files[i]->end_pos();
+            } else {
+                uint64_t near = files[i]->size() / count * k;
+                pos[i] = find_named_record(*files[i], near, name, paths[i]);
+            }
+        }
+        return pos;
+    };
+
+    std::vector<shard_pos> start = boundary(index);
+    std::vector<shard_pos> end = boundary(index + 1);
+    std::vector<shard_range> ranges;
+    for (size_t i = 0; i < files.size(); i++) {
+        ranges.push_back(shard_range{start[i], end[i]});
+    }
+    return ranges;
+}
+
+// A range of a file as a boost iostreams source, for fastq_reader.
+class shard_device {
+    public:
+    typedef char char_type;
+    typedef boost::iostreams::source_tag category;
+
+    shard_device(const std::string& path, const shard_range& range) {
+        file = std::make_shared<shard_file>(path);
+        file->seek(range.start);
+        file->set_end(range.end);
+    }
+
+    std::streamsize read(char* s, std::streamsize n) {
+        size_t got = file->read(s, n);
+        return got == 0 ? -1 : got;
+    }
+
+    private:
+    std::shared_ptr<shard_file> file;
+};
+#endif
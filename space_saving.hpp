@@ -0,0 +1,135 @@
+#ifndef _SPACE_SAVING_HPP
+#define _SPACE_SAVING_HPP
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+
+// Space-saving heavy hitter counter (Metwally et al.) in bounded memory.
+// At most capacity keys are tracked. A new key evicts the key with the
+// smallest count and inherits that count as its possible overestimate
+// (error), so every key with a true frequency above total / capacity is
+// guaranteed to be in the table. The counters live in an indexed min-heap,
+// which makes an update O(log capacity) and eviction O(log capacity).
+
+template <typename K, typename Hash = std::hash<K>>
+class space_saving {
+    public:
+    struct entry {
+        K key;
+        unsigned long count;
+        unsigned long error;
+    };
+
+    explicit space_saving(size_t capacity = 1024) {
+        this -> capacity = capacity > 0 ? capacity : 1;
+        pos.reserve(this -> capacity);
+        heap.reserve(this -> capacity);
+    }
+
+    void offer(const K& key, unsigned long count = 1) {
+        add(key, count, 0);
+    }
+
+    // Folds the counters of another sketch, e.g. one per worker, into
+    // this one.
+    void merge(const space_saving& other) {
+        for (auto const& e : other.heap) {
+            add(e.key, e.count, e.error);
+        }
+    }
+
+    // Folds in one counter of another sketch, e.g. one saved by another
+    // process.
+    void merge(const entry& e) {
+        add(e.key, e.count, e.error);
+    }
+
+    // The k largest counters, largest first.
+    std::vector<entry> top(size_t k) const {
+        std::vector<entry> result(heap.begin(), heap.end());
+        std::sort(result.begin(), result.end(), [](const entry& a, const entry& b) {
+            return a.count > b.count || (a.count == b.count && a.error < b.error);
+        });
+        if (result.size() > k) {
+            result.resize(k);
+        }
+        return result;
+    }
+
+    // Number of items offered, which is also the sum of all counters.
+    unsigned long total() const {
+        return seen;
+    }
+
+    size_t size() const {
+        return heap.size();
+    }
+
+    private:
+    void add(const K& key, unsigned long count, unsigned long error) {
+        seen += count;
+        auto it = pos.find(key);
+        if (it != pos.end()) {
+            size_t i = it -> second;
+            heap[i].count += count;
+            heap[i].error += error;
+            sift_down(i);
+        } else if (heap.size() < capacity) {
+            heap.push_back(entry{key, count, error});
+            pos[key] = heap.size() - 1;
+            sift_up(heap.size() - 1);
+        } else {
+            entry& root = heap[0];
+            pos.erase(root.key);
+            root.key = key;
+            root.error = root.count + error;
+            root.count += count;
+            pos[key] = 0;
+            sift_down(0);
+        }
+    }
+
+    void swap_nodes(size_t i, size_t j) {
+        std::swap(heap[i], heap[j]);
+        pos[heap[i].key] = i;
+        pos[heap[j].key] = j;
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (heap[parent].count <= heap[i].count) {
+                break;
+            }
+            swap_nodes(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(size_t i) {
+        const size_t n = heap.size();
+        while (true) {
+            size_t smallest = i;
+            size_t left = 2 * i + 1;
+            size_t right = left + 1;
+            if (left < n && heap[left].count < heap[smallest].count) {
+                smallest = left;
+            }
+            if (right < n && heap[right].count < heap[smallest].count) {
+                smallest = right;
+            }
+            if (smallest == i) {
+                break;
+            }
+            swap_nodes(i, smallest);
+            i = smallest;
+        }
+    }
+
+    size_t capacity;
+    unsigned long seen = 0;
+    std::vector<entry> heap;
+    std::unordered_map<K, size_t, Hash> pos;
+};
+#endif
@@ -0,0 +1,303 @@
+#ifndef _STAGE_TIMER_HPP
+#define _STAGE_TIMER_HPP
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+
+#include "perf_counters.hpp"
+#include "trace_recorder.hpp"
+
+// Stages of the per-read loop of the splitters. Decompression and line
+// parsing happen inside the same getline call, so they are one stage.
+enum split_stage {
+    STAGE_READ,     // decompress and parse the FASTQ records
+    STAGE_EXTRACT,  // cut and encode the barcode
+    STAGE_MATCH,    // dictionary search, rescue and classification
+    STAGE_HEADER,   // header rewrite (UMI, tags, index)
+    STAGE_BUFFER,   // updateMaps
+    STAGE_FLUSH,    // writeMapsToFile, including compression
+    STAGE_COUNT
+};
+
+inline const char* stage_name(int stage) {
+    static const char* names[STAGE_COUNT] = {
+        "read", "extract", "match", "header", "buffer", "flush"
+    };
+    return names[stage];
+}
+
+// Arg names of the per stage times of a batch in the trace
+inline const char* const* stage_arg_names() {
+    static const char* names[STAGE_COUNT] = {
+        "read_ns", "extract_ns", "match_ns", "header_ns", "buffer_ns", "flush_ns"
+    };
+    return names;
+}
+
+// Wall time per stage of the splitting loop. The loop calls lap() at each
+// stage boundary, which charges the time since the previous lap to that
+// stage, and next_read() once per read. Every batch_reads reads the per
+// stage times of the batch are kept, for the p50/p99 in the summary. One
+// timer belongs to one thread; timers of several threads are merged at the
+// end. When disabled every call is a single branch.
+//
+// The same boundaries can also read the hardware counters. A counter read
+// is a system call, so they are only read through every perf_every-th read
+// and around every flush, and reported per read.
+//
+// With a trace recorder attached every batch becomes a span carrying its
+// per stage times, and every flush a span of its own.
+class stage_timer {
+    public:
+    typedef std::chrono::steady_clock clock;
+
+    stage_timer(bool timing = false, unsigned long batch_reads = 4096) {
+        this -> timing = timing;
+        this -> report_timing = timing;
+        this -> enabled = timing;
+        this -> batch_reads = batch_reads > 0 ? batch_reads : 1;
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            batch[s] = 0;
+            total[s] = 0;
+            samples[s] = 0;
+            for (int ev = 0; ev < perf_counters::EVENT_COUNT; ev++) {
+                events[s][ev] = 0;
+            }
+        }
+    }
+
+    // Returns false, with the reason in error, when the counters cannot be
+    // opened. The timer then goes on without them.
+    bool enable_counters(unsigned long perf_every, std::string& error) {
+        perf = std::make_unique<perf_counters>();
+        if (!perf->open()) {
+            error = perf->error();
+            perf.reset();
+            return false;
+        }
+        this -> perf_every = perf_every > 0 ? perf_every : 1;
+        enabled = true;
+        return true;
+    }
+
+    void attach_trace(trace_recorder* trace) {
+        this -> trace = trace;
+        if (trace) {
+            timing = true;
+            enabled = true;
+        }
+    }
+
+    bool is_enabled() const {
+        return enabled;
+    }
+
+    void start() {
+        if (!enabled) {
+            return;
+        }
+        last = clock::now();
+        batch_start = last;
+    }
+
+    void lap(int stage) {
+        if (!enabled) {
+            return;
+        }
+        if (timing) {
+            clock::time_point now = clock::now();
+            batch[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+            if (trace && stage == STAGE_FLUSH) {
+                trace->complete("flush", last, now);
+            }
+            last = now;
+        }
+        if (sampling || forced) {
+            count_lap(stage);
+        }
+    }
+
+    void next_read() {
+        if (!enabled) {
+            return;
+        }
+        reads++;
+        if (timing && ++batch_count == batch_reads) {
+            end_batch();
+        }
+        if (perf) {
+            sampling = reads % perf_every == 0;
+            if (sampling) {
+                perf->read(last_events);
+            }
+        }
+    }
+
+    // The next stage gets counted whether or not the current read is a
+    // sample. Called before a flush, which is rare and expensive.
+    void sample_next() {
+        if (!perf) {
+            return;
+        }
+        perf->read(last_events);
+        forced = true;
+    }
+
+    // Closes the last, partial batch.
+    void finish() {
+        if (timing && batch_count > 0) {
+            end_batch();
+        }
+    }
+
+    void merge(const stage_timer& other) {
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            total[s] += other.total[s];
+            history[s].insert(history[s].end(), other.history[s].begin(), other.history[s].end());
+            samples[s] += other.samples[s];
+            for (int ev = 0; ev < perf_counters::EVENT_COUNT; ev++) {
+                events[s][ev] += other.events[s][ev];
+            }
+        }
+        reads += other.reads;
+    }
+
+    void print(std::ostream& out) const {
+        print_timing(out);
+        print_counters(out);
+    }
+
+    private:
+    void print_timing(std::ostream& out) const {
+        if (!report_timing) {
+            return;
+        }
+        uint64_t sum = 0;
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            sum += total[s];
+        }
+        std::ios_base::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(3);
+        out << "Stage timing over " << reads << " reads, batches of " << batch_reads << " reads:\n";
+        out << std::left << std::setw(10) << "stage" << std::right
+            << std::setw(12) << "total_s" << std::setw(9) << "pct"
+            << std::setw(14) << "p50_ms/batch" << std::setw(14) << "p99_ms/batch" << "\n";
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            double pct = sum > 0 ? 100.0 * total[s] / sum : 0;
+            out << std::left << std::setw(10) << stage_name(s) << std::right
+                << std::setw(12) << total[s] / 1e9 << std::setw(8) << pct << "%"
+                << std::setw(14) << percentile(s, 0.50) / 1e6
+                << std::setw(14) << percentile(s, 0.99) / 1e6 << "\n";
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // Every flush is counted, so flush is per read of the whole run; the
+    // other stages are per sampled read.
+    void print_counters(std::ostream& out) const {
+        if (!perf) {
+            return;
+        }
+        std::ios_base::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(2);
+        out << "Performance counters per read, user space, sampled every " << perf_every
+            << " reads:\n";
+        out << std::left << std::setw(10) << "stage" << std::right << std::setw(10) << "samples";
+        for (int ev = 0; ev < perf_counters::EVENT_COUNT; ev++) {
+            out << std::setw(15) << perf_counters::event_name(ev);
+        }
+        out << std::setw(8) << "IPC" << "\n";
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            double per = s == STAGE_FLUSH ? reads : samples[s];
+            out << std::left << std::setw(10) << stage_name(s) << std::right
+                << std::setw(10) << samples[s];
+            for (int ev = 0; ev < perf_counters::EVENT_COUNT; ev++) {
+                if (!perf->has(ev)) {
+                    out << std::setw(15) << "n/a";
+                } else {
+                    out << std::setw(15) << (per > 0 ? events[s][ev] / per : 0);
+                }
+            }
+            uint64_t cycles = events[s][perf_counters::CYCLES];
+            if (perf->has(perf_counters::CYCLES) && perf->has(perf_counters::INSTRUCTIONS)
+                && cycles > 0) {
+                out << std::setw(8) << (double) events[s][perf_counters::INSTRUCTIONS] / cycles;
+            } else {
+                out << std::setw(8) << "n/a";
+            }
+            out << "\n";
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    void count_lap(int stage) {
+        uint64_t now[perf_counters::EVENT_COUNT];
+        if (perf->read(now)) {
+            for (int ev = 0; ev < perf_counters::EVENT_COUNT; ev++) {
+                events[stage][ev] += now[ev] - last_events[ev];
+                last_events[ev] = now[ev];
+            }
+            samples[stage]++;
+        }
+        forced = false;
+    }
+
+    void end_batch() {
+        if (trace) {
+            trace->complete("batch", batch_start, last, std::to_string(batch_count) + " reads",
+                stage_arg_names(), batch, STAGE_COUNT);
+            batch_start = last;
+        }
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            history[s].push_back(batch[s]);
+            total[s] += batch[s];
+            batch[s] = 0;
+        }
+        batch_count = 0;
+    }
+
+    // Nearest rank percentile of the batch times of a stage, in ns.
+    double percentile(int stage, double p) const {
+        std::vector<uint64_t> times(history[stage]);
+        if (times.empty()) {
+            return 0;
+        }
+        size_t rank = (size_t) (p * times.size());
+        if (rank >= times.size()) {
+            rank = times.size() - 1;
+        }
+        std::nth_element(times.begin(), times.begin() + rank, times.end());
+        return times[rank];
+    }
+
+    bool enabled;
+    bool timing;
+    bool report_timing;
+    unsigned long batch_reads;
+    unsigned long batch_count = 0;
+    unsigned long reads = 0;
+    clock::time_point last;
+    clock::time_point batch_start;
+    trace_recorder* trace = nullptr;
+    uint64_t batch[STAGE_COUNT];
+    uint64_t total[STAGE_COUNT];
+    std::vector<uint64_t> history[STAGE_COUNT];
+
+    std::unique_ptr<perf_counters> perf;
+    unsigned long perf_every = 1;
+    bool sampling = false;
+    bool forced = false;
+    uint64_t last_events[perf_counters::EVENT_COUNT];
+    uint64_t events[STAGE_COUNT][perf_counters::EVENT_COUNT];
+    unsigned long samples[STAGE_COUNT];
+};
+#endif
@@ -0,0 +1,388 @@
+#ifndef _STREAM_OUTPUT_HPP
+#define _STREAM_OUTPUT_HPP
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Bytes handed to the streams and not written yet, over all of them. A
+// flush waits for room once limit is reached, so a slow consumer holds up
+// the others only when the memory budget is used up.
+struct stream_budget {
+    std::mutex mtx;
+    std::condition_variable cond;
+    unsigned long queued = 0;
+    unsigned long limit = 0;
+
+    void release(unsigned long bytes) {
+        std::lock_guard<std::mutex> lock(mtx);
+        queued -= bytes;
+        cond.notify_all();
+    }
+};
+
+// One FIFO, or the stdin of a command, written by a thread of its own. A
+// FIFO is opened by that thread too, since there is no writing to it until
+// its reader has opened it.
+class pipe_writer {
+    public:
+    pipe_writer(const std::string& path, FILE* command, stream_budget& budget)
+        : path(path), command(command), budget(budget) {
+
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~pipe_writer() {
+        finish();
+    }
+
+    // Queues data, waiting for room in the budget. Throws once the stream
+    // has failed.
+    void push(std::string&& data) {
+        {
+            std::unique_lock<std::mutex> lock(budget.mtx);
+            budget.cond.wait(lock, [this, &data]() {
+                return budget.queued == 0 || budget.queued + data.size() <= budget.limit ||
+                    failed();
+            });
+            check();
+            budget.queued += data.size();
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.push_back(std::move(data));
+        cond.notify_all();
+    }
+
+    // Writes what is queued and closes the stream.
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closing = true;
+            cond.notify_all();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void check() const {
+        if (failed()) {
+            throw std::invalid_argument("Could not write to " + path + ": " + error);
+        }
+    }
+
+    private:
+    bool failed() const {
+        return has_error.load();
+    }
+
+    void run() {
+        int fd = -1;
+        try {
+            fd = command != NULL ? fileno(command) : open_fifo();
+            while (true) {
+                std::string data;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cond.wait(lock, [this]() { return !queue.empty() || closing; });
+                    if (queue.empty()) {
+                        break;
+                    }
+                    data = std::move(queue.front());
+                    queue.pop_front();
+                }
+                write_all(fd, data);
+                budget.release(data.size());
+            }
+        } catch (const std::exception& e) {
+            // What is still queued is given up, so that nobody waits for it.
+            std::lock_guard<std::mutex> lock(mtx);
+            unsigned long dropped = 0;
+            for (auto const& data : queue) {
+                dropped += data.size();
+            }
+            queue.clear();
+            error = e.what();
+            has_error = true;
+            budget.release(dropped);
+        }
+        if (command == NULL && fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    // Waits for the reader of the FIFO. With the run over and still no
+    // reader after a minute, nobody is coming.
+    int open_fifo() {
+        auto closed_at = std::chrono::steady_clock::time_point();
+        while (true) {
+            int fd = ::open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                return fd;
+            }
+            if (errno != ENXIO) {
+                throw std::runtime_error(strerror(errno));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (closing && closed_at == std::chrono::steady_clock::time_point()) {
+                    closed_at = std::chrono::steady_clock::now();
+                }
+            }
+            if (closed_at != std::chrono::steady_clock::time_point() &&
+                std::chrono::steady_clock::now() - closed_at > std::chrono::seconds(60)) {
+                throw std::runtime_error("no reader opened it");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    static void write_all(int fd, const std::string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error(strerror(errno));
+            }
+            done += n;
+        }
+    }
+
+    std::string path;
+    FILE* command;
+    stream_budget& budget;
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<std::string> queue;
+    bool closing = false;
+    std::string error;
+    std::atomic<bool> has_error{false};
+};
+
+// Barcodes whose reads go to a FIFO or a command instead of files, from a
+// file of <barcode> <target> lines. The target is one of
+//   fifo:<path>            both reads interleaved into one FIFO
+//   fifo:<path1>,<path2>   read 1 and read 2 into a FIFO each
+//   <command>              run by the shell, read pairs interleaved on its
+//                          stdin, or in FIFOs at {R1} and {R2} if it has them
+// The FIFOs for {R1} and {R2} are made as <fifo_base>_<barcode>_R1.fifo
+// and so on, and removed at the end.
+class stream_outputs {
+    public:
+    stream_outputs(const std::string& spec_file, const std::string& fifo_base,
+        unsigned long budget_bytes) {
+
+        budget.limit = budget_bytes;
+        // A consumer that goes away shows up as EPIPE on its own stream.
+        signal(SIGPIPE, SIG_IGN);
+
+        std::ifstream spec(spec_file);
+        if (!spec) {
+            throw std::invalid_argument("Could not open the stream file " + spec_file + ".");
+        }
+        std::string line;
+        while (std::getline(spec, line)) {
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line[start] == '#') {
+                continue;
+            }
+            size_t end = line.find_first_of(" \t", start);
+            size_t target_start = end == std::string::npos ? end :
+                line.find_first_not_of(" \t", end);
+            if (target_start == std::string::npos) {
+                throw std::invalid_argument("No target for " + line + " in " + spec_file + ".");
+            }
+            add(line.substr(start, end - start), line.substr(target_start), fifo_base);
+        }
+    }
+
+    ~stream_outputs() {
+        for (auto& kv : sinks) {
+            for (auto& writer : kv.second.writers) {
+                writer->finish();
+            }
+            if (kv.second.command != NULL) {
+                pclose(kv.second.command);
+            }
+        }
+    }
+
+    bool has(const std::string& barcode) const {
+        return sinks.count(barcode) > 0;
+    }
+
+    size_t size() const {
+        return sinks.size();
+    }
+
+    // Hands the buffered lines of a barcode to its stream, read pair by read
+    // pair when interleaved. Returns the bytes.
+    unsigned long write(const std::string& barcode,
+        const std::vector<std::unique_ptr<std::string>>& lines1,
+        const std::vector<std::unique_ptr<std::string>>& lines2) {
+
+        sink& s = sinks.at(barcode);
+        std::string text1;
+        std::string text2;
+        if (s.writers.size() == 1) {
+            for (size_t i = 0; i < lines1.size(); i += 4) {
+                for (size_t j = i; j < i + 4 && j < lines1.size(); j++) {
+                    text1 += *lines1[j];
+                    text1 += '\n';
+                }
+                for (size_t j = i; j < i + 4 && j < lines2.size(); j++) {
+                    text1 += *lines2[j];
+                    text1 += '\n';
+                }
+            }
+        } else {
+            for (auto const& l : lines1) {
+                text1 += *l;
+                text1 += '\n';
+            }
+            for (auto const& l : lines2) {
+                text2 += *l;
+                text2 += '\n';
+            }
+        }
+        unsigned long bytes = text1.size() + text2.size();
+        s.writers[0]->push(std::move(text1));
+        if (s.writers.size() > 1) {
+            s.writers[1]->push(std::move(text2));
+        }
+        return bytes;
+    }
+
+    // Closes every stream and waits for the commands. Throws if a stream
+    // failed or a command did not exit with 0.
+    void close() {
+        std::string failure;
+        for (auto& kv : sinks) {
+            sink& s = kv.second;
+            for (auto& writer : s.writers) {
+                writer->finish();
+                try {
+                    writer->check();
+                } catch (const std::invalid_argument& e) {
+                    failure += std::string(e.what()) + "\n";
+                }
+            }
+            if (s.command != NULL) {
+                int status = pclose(s.command);
+                s.command = NULL;
+                if (status != 0) {
+                    failure += "The command for " + kv.first + " exited with status " +
+                        std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : status) + "\n";
+                }
+            }
+            for (auto const& fifo : s.made_fifos) {
+                remove(fifo.c_str());
+            }
+        }
+        if (!failure.empty()) {
+            throw std::invalid_argument(failure);
+        }
+    }
+
+    private:
+    struct sink {
+        FILE* command = NULL;
+        std::vector<std::unique_ptr<pipe_writer>> writers;
+        std::vector<std::string> made_fifos;
+    };
+
+    void add(const std::string& barcode, const std::string& target,
+        const std::string& fifo_base) {
+
+        if (has(barcode)) {
+            throw std::invalid_argument("Barcode " + barcode + " has two stream targets.");
+        }
+        sink& s = sinks[barcode];
+        std::vector<std::string> paths;
+        if (target.compare(0, 5, "fifo:") == 0) {
+            std::stringstream list(target.substr(5));
+            std::string path;
+            while (std::getline(list, path, ',')) {
+                paths.push_back(path);
+            }
+            if (paths.empty() || paths.size() > 2) {
+                throw std::invalid_argument("Invalid FIFO target " + target + ".");
+            }
+            for (auto const& path : paths) {
+                make_fifo(path, false);
+            }
+        } else {
+            std::string cmd = target;
+            if (target.find("{R1}") != std::string::npos) {
+                paths.push_back(fifo_base + "_" + barcode + "_R1.fifo");
+                paths.push_back(fifo_base + "_" + barcode + "_R2.fifo");
+                for (auto const& path : paths) {
+                    make_fifo(path, true);
+                    s.made_fifos.push_back(path);
+                }
+                replace_all(cmd, "{R1}", paths[0]);
+                replace_all(cmd, "{R2}", paths[1]);
+            }
+            s.command = popen(cmd.c_str(), "we");
+            if (s.command == NULL) {
+                throw std::invalid_argument("Could not start " + cmd + ".");
+            }
+            if (paths.empty()) {
+                s.writers.emplace_back(new pipe_writer(cmd, s.command, budget));
+            }
+        }
+        for (auto const& path : paths) {
+            s.writers.emplace_back(new pipe_writer(path, NULL, budget));
+        }
+    }
+
+    // An existing FIFO is used as it is, one of ours is made afresh.
+    static void make_fifo(const std::string& path, bool fresh) {
+        struct stat buffer;
+        if (!fresh && stat(path.c_str(), &buffer) == 0) {
+            if (!S_ISFIFO(buffer.st_mode)) {
+                throw std::invalid_argument(path + " exists and is not a FIFO.");
+            }
+            return;
+        }
+        remove(path.c_str());
+        if (mkfifo(path.c_str(), 0644) != 0) {
+            throw std::invalid_argument("Could not make the FIFO " + path + ": " +
+                strerror(errno) + ".");
+        }
+    }
+
+    static void replace_all(std::string& str, const std::string& from, const std::string& to) {
+        size_t pos = 0;
+        while ((pos = str.find(from, pos)) != std::string::npos) {
+            str.replace(pos, from.size(), to);
+            pos += to.size();
+        }
+    }
+
+    stream_budget budget;
+    std::map<std::string, sink> sinks;
+};
+#endif
@@ -0,0 +1,610 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+
+#include "fastq_reader.hpp"
+#include "fastq_writer.hpp"
+#include "trace_recorder.hpp"
+#include "../bench/matcher_engines.hpp"
+#include "../bench/synth_random.hpp"
+
+#include <boost/program_options.hpp>
+#include <zlib.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace po = boost::program_options;
+
+// Differential checks of the hot path against plain reference code.
+//
+// Matchers: random dictionaries, some of them clustered so that ties are
+// common, and queries with substitutions and Ns, at every cutoff with and
+// without remove_last, wildcard Ns and the safe cutoff shortcut. Every
+// engine of bench/matcher_engines.hpp must give the same distance, tie
+// count and barcode as a string by string scan. A few fixed queries
+// check the BK-tree pruning without the last base.
+//
+// Reader and writer: random FASTQ text, including CR LF line ends, very
+// long lines, a missing last newline and gzip files of several members.
+// fastq_reader must return the lines std::getline would, and what
+// fastq_writer writes must read back byte for byte through zlib. Trace
+// recorders made one after the other, often at the same address, must
+// each write the events recorded into them.
+//
+// Every failure is printed with the seed and round, and the exit status
+// is 1 if there was any.
+
+class differential {
+	public:
+	bool parse_args(int argc, char* argv[]);
+	void print_help();
+	bool run();
+
+	private:
+	struct ref_result {
+		int dist;
+		int count;
+		std::string barcode;
+	};
+
+	struct dict_config {
+		int len;
+		bool clustered;
+		std::vector<std::string> barcodes;
+	};
+
+	// Matchers
+	void check_pruning();
+	void check_matchers();
+	void make_dictionary(dict_config& dict);
+	std::string make_query(const dict_config& dict);
+	int ref_distance(const std::string& entry, const std::string& query,
+		bool n_wildcard, bool remove_last);
+	ref_result ref_classify(const std::vector<std::string>& barcodes, const std::string& query,
+		int cutoff, bool n_wildcard, bool remove_last);
+	int min_distance(const std::vector<std::string>& barcodes, bool remove_last);
+
+	// Reader and writer
+	void check_io();
+	void check_trace();
+	std::string make_fastq_text(int round);
+	std::vector<std::string> ref_lines(const std::string& text);
+	void write_plain(const std::string& path, const std::string& text);
+	void write_gzip(const std::string& path, const std::string& text, int members);
+	bool read_gzip(const std::string& path, std::string& text);
+	std::string read_plain(const std::string& path);
+
+	std::string random_bases(int len);
+	void fail(const std::string& what, const std::string& detail);
+
+	po::options_description desc;
+	unsigned long seed;
+	unsigned long queries;
+	unsigned long round_queries;
+	int io_rounds;
+	std::string workdir;
+	bool run_matchers = true;
+	bool run_io = true;
+	int max_reports;
+
+	std::unique_ptr<synth_random> rng;
+	unsigned long failures = 0;
+	std::string context;
+};
+
+void differential::print_help() {
+	std::cout << desc << "\n";
+	std::cout << "Usage: differential [--queries <n>] [--io-rounds <n>] [--seed <n>]\n\n";
+}
+
+bool differential::parse_args(int argc, char* argv[]) {
+	bool all_set = true;
+	desc.add_options()
+		("help,h", "produce help message")
+		("seed", po::value(&seed)->default_value(1), "Optional/Random seed")
+		("queries,n", po::value(&queries)->default_value(1000000),
+			"Optional/Matcher queries in total, over all rounds")
+		("round-queries", po::value(&round_queries)->default_value(2000),
+			"Optional/Queries per dictionary and configuration")
+		("io-rounds", po::value(&io_rounds)->default_value(200),
+			"Optional/Generated FASTQ texts for the reader and writer")
+		("workdir,w", po::value(&workdir)->default_value("test_out"),
+			"Optional/Directory for the temporary files")
+		("matchers-only", "Optional/Skip the reader and writer checks")
+		("io-only", "Optional/Skip the matcher checks")
+		("max-reports", po::value(&max_reports)->default_value(20),
+			"Optional/Failures printed in detail")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		return false;
+	}
+	if (vm.count("matchers-only") && vm.count("io-only")) {
+		std::cout << "Error: --matchers-only and --io-only exclude each other.\n";
+		all_set = false;
+	}
+	run_matchers = !vm.count("io-only");
+	run_io = !vm.count("matchers-only");
+	if (round_queries == 0) {
+		round_queries = 1;
+	}
+	rng = std::make_unique<synth_random>(seed);
+	return all_set;
+}
+
+void differential::fail(const std::string& what, const std::string& detail) {
+	failures++;
+	if ((long) failures <= max_reports) {
+		std::cout << "FAIL " << what << " (seed " << seed << ", " << context << ")\n"
+			<< detail << "\n";
+	}
+}
+
+std::string differential::random_bases(int len) {
+	static const char bases[] = "ACGT";
+	std::string str(len, 'A');
+	for (int i = 0; i < len; i++) {
+		str[i] = bases[rng->below(4)];
+	}
+	return str;
+}
+
+// Matchers
+
+// Characters compared one by one, independent of the packed encoding.
+int differential::ref_distance(const std::string& entry, const std::string& query,
+	bool n_wildcard, bool remove_last) {
+
+	int len = remove_last ? entry.length() - 1 : entry.length();
+	int dist = 0;
+	for (int i = 0; i < len; i++) {
+		if (entry[i] == 'N' || query[i] == 'N') {
+			dist += n_wildcard ? 0 : 1;
+		} else if (entry[i] != query[i]) {
+			dist++;
+		}
+	}
+	return dist;
+}
+
+differential::ref_result differential::ref_classify(const std::vector<std::string>& barcodes,
+	const std::string& query, int cutoff, bool n_wildcard, bool remove_last) {
+
+	ref_result result{cutoff + 1, 0, ""};
+	for (auto const& entry : barcodes) {
+		int dist = ref_distance(entry, query, n_wildcard, remove_last);
+		if (dist > cutoff) {
+			continue;
+		}
+		if (dist < result.dist) {
+			result.dist = dist;
+			result.count = 1;
+			result.barcode = entry;
+		} else if (dist == result.dist) {
+			result.count++;
+		}
+	}
+	if (result.count != 1) {
+		result.barcode.clear();
+	}
+	return result;
+}
+
+int differential::min_distance(const std::vector<std::string>& barcodes, bool remove_last) {
+	int dmin = barcodes[0].length() + 1;
+	for (size_t i = 0; i < barcodes.size(); i++) {
+		for (size_t j = i + 1; j < barcodes.size(); j++) {
+			int dist = ref_distance(barcodes[i], barcodes[j], false, remove_last);
+			if (dist < dmin) {
+				dmin = dist;
+			}
+		}
+	}
+	return dmin;
+}
+
+// Either uniform random barcodes, or clusters of close neighbours around
+// a few centres, where ties within the cutoff are the rule.
+void differential::make_dictionary(dict_config& dict) {
+	static const int sizes[] = {1, 2, 5, 20, 96, 384, 1500};
+	dict.len = 3 + rng->below(14);
+	dict.clustered = rng->below(2) == 0;
+	size_t size = sizes[rng->below(sizeof(sizes) / sizeof(sizes[0]))];
+	size_t space = dict.len < 16 ? (1ULL << (2 * dict.len)) / 2 : size;
+	if (size > space) {
+		size = space;
+	}
+
+	std::set<std::string> seen;
+	std::vector<std::string> centres;
+	while (dict.barcodes.size() < size) {
+		std::string candidate;
+		if (dict.clustered && !centres.empty() && rng->below(4) != 0) {
+			candidate = centres[rng->below(centres.size())];
+			int changes = 1 + rng->below(3);
+			for (int c = 0; c < changes; c++) {
+				candidate[rng->below(dict.len)] = "ACGT"[rng->below(4)];
+			}
+		} else {
+			candidate = random_bases(dict.len);
+			centres.push_back(candidate);
+		}
+		if (seen.insert(candidate).second) {
+			dict.barcodes.push_back(candidate);
+		}
+	}
+}
+
+std::string differential::make_query(const dict_config& dict) {
+	uint64_t kind = rng->below(20);
+	if (kind == 0) {
+		return random_bases(dict.len);
+	}
+	if (kind == 1) {
+		return std::string(dict.len, 'N');
+	}
+	std::string query = dict.barcodes[rng->below(dict.barcodes.size())];
+	int changes = rng->below(5);
+	for (int c = 0; c < changes; c++) {
+		query[rng->below(dict.len)] = "ACGT"[rng->below(4)];
+	}
+	int ns = rng->below(4) == 0 ? 1 + rng->below(3) : 0;
+	for (int c = 0; c < ns; c++) {
+		query[rng->below(dict.len)] = 'N';
+	}
+	return query;
+}
+
+// Dictionaries where the BK-tree once pruned the entry a query matches
+// without its last base: the children are keyed by the full distance, and
+// pruning by the trimmed one skipped those one further away over the full
+// length. The first entry is the root.
+void differential::check_pruning() {
+	struct pruning_case {
+		std::vector<std::string> barcodes;
+		std::string query;
+		int cutoff;
+	};
+	const std::vector<pruning_case> cases = {
+		// CAAC is at 2 from the root, the query at 1 without the last base.
+		{{"AAAA", "CAAC"}, "CAAG", 0},
+		// CCAAAC is at 3 from the root, the query at 1 from both of them
+		// without the last base, so it is ambiguous.
+		{{"AAAAAA", "CCAAAC"}, "CAAAAG", 1},
+		{{"ACGTAC", "TGGTAA", "ACGTTT"}, "TGGTAG", 0},
+	};
+	for (size_t i = 0; i < cases.size(); i++) {
+		const pruning_case& c = cases[i];
+		context = "pruning case " + std::to_string(i) + ", cutoff " + std::to_string(c.cutoff);
+		bktree_engine engine(c.barcodes);
+		engine.prepare(c.cutoff, true, false);
+		match_result got = engine.classify(c.query);
+		ref_result expected = ref_classify(c.barcodes, c.query, c.cutoff, false, true);
+		if (got.count != expected.count || got.barcode != expected.barcode ||
+			(expected.count > 0 && got.dist != expected.dist)) {
+			std::ostringstream detail;
+			detail << "  query " << c.query << "\n"
+				<< "  reference: dist " << expected.dist << ", count " << expected.count
+				<< ", barcode " << expected.barcode << "\n"
+				<< "  bktree: dist " << got.dist << ", count " << got.count
+				<< ", barcode " << got.barcode;
+			fail("matcher bktree pruning", detail.str());
+		}
+	}
+	std::cout << "Pruning: " << cases.size() << " queries on the last base.\n";
+}
+
+void differential::check_matchers() {
+	unsigned long done = 0;
+	unsigned long rounds = 0;
+	unsigned long compared = 0;
+	while (done < queries) {
+		dict_config dict;
+		make_dictionary(dict);
+		int cutoff = rng->below(4);
+		bool remove_last = rng->below(2) == 0 && dict.len > 1;
+		bool n_wildcard = rng->below(3) == 0;
+		// The splitters take the safe cutoff from the dictionary; half of
+		// the rounds check that shortcut, the others count every tie.
+		int safe_cutoff = -1;
+		if (rng->below(2) == 0) {
+			int dmin = min_distance(dict.barcodes, remove_last);
+			safe_cutoff = dmin > 0 ? (dmin - 1) / 2 : -1;
+		}
+
+		std::vector<std::unique_ptr<matcher_engine>> engines;
+		engines.push_back(std::unique_ptr<matcher_engine>(
+			new bktree_engine(dict.barcodes, safe_cutoff)));
+		engines.push_back(std::unique_ptr<matcher_engine>(new whitelist_engine(dict.barcodes)));
+		engines.push_back(std::unique_ptr<matcher_engine>(new brute_force_engine(dict.barcodes)));
+
+		std::ostringstream desc_str;
+		desc_str << "round " << rounds << ", " << dict.barcodes.size() << " barcodes of "
+			<< dict.len << (dict.clustered ? " clustered" : "") << ", cutoff " << cutoff
+			<< ", remove_last " << remove_last << ", n_wildcard " << n_wildcard
+			<< ", safe_cutoff " << safe_cutoff;
+		context = desc_str.str();
+
+		std::vector<matcher_engine*> active;
+		for (auto& engine : engines) {
+			if (engine->supports(cutoff, remove_last, n_wildcard)) {
+				engine->prepare(cutoff, remove_last, n_wildcard);
+				active.push_back(engine.get());
+			}
+		}
+
+		unsigned long count = std::min(round_queries, queries - done);
+		for (unsigned long q = 0; q < count; q++) {
+			std::string query = make_query(dict);
+			ref_result expected = ref_classify(dict.barcodes, query, cutoff, n_wildcard,
+				remove_last);
+			for (auto engine : active) {
+				match_result got = engine->classify(query);
+				compared++;
+				bool same = got.count == expected.count && got.barcode == expected.barcode &&
+					(expected.count == 0 || got.dist == expected.dist);
+				if (!same) {
+					std::ostringstream detail;
+					detail << "  query " << query << "\n"
+						<< "  reference: dist " << expected.dist << ", count " << expected.count
+						<< ", barcode " << expected.barcode << "\n"
+						<< "  " << engine->name() << ": dist " << got.dist << ", count "
+						<< got.count << ", barcode " << got.barcode;
+					fail(std::string("matcher ") + engine->name(), detail.str());
+				}
+			}
+		}
+		done += count;
+		rounds++;
+	}
+	std::cout << "Matchers: " << done << " queries over " << rounds << " dictionaries, "
+		<< compared << " engine decisions compared.\n";
+}
+
+// Reader and writer
+
+std::string differential::make_fastq_text(int round) {
+	std::string text;
+	// The first rounds are the corner cases, then random texts.
+	if (round == 0) {
+		return text;
+	}
+	if (round == 1) {
+		return "\n";
+	}
+	bool crlf = rng->below(5) == 0;
+	const std::string end = crlf ? "\r\n" : "\n";
+	int records = rng->below(200);
+	for (int r = 0; r < records; r++) {
+		// Now and then a read longer than any of the stream buffers
+		int len = rng->below(100) == 0 ? 40000 + rng->below(60000) : rng->below(300);
+		std::string qual(len, 'I');
+		for (int i = 0; i < len; i++) {
+			qual[i] = (char) (33 + rng->below(42));
+		}
+		text += "@read" + std::to_string(r) + " 1:N:0:" + random_bases(8) + end;
+		text += random_bases(len) + end;
+		text += "+" + end;
+		text += qual + end;
+		if (rng->below(50) == 0) {
+			text += end;
+		}
+	}
+	if (!text.empty() && rng->below(4) == 0) {
+		// No newline after the last line
+		text.resize(text.size() - 1);
+	}
+	return text;
+}
+
+// What std::getline gives for the text: a last line without a newline is
+// still a line, a newline at the very end does not start one.
+std::vector<std::string> differential::ref_lines(const std::string& text) {
+	std::vector<std::string> lines;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t nl = text.find('\n', pos);
+		if (nl == std::string::npos) {
+			lines.push_back(text.substr(pos));
+			break;
+		}
+		lines.push_back(text.substr(pos, nl - pos));
+		pos = nl + 1;
+	}
+	return lines;
+}
+
+void differential::write_plain(const std::string& path, const std::string& text) {
+	std::ofstream out(path, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+	out.write(text.data(), text.size());
+}
+
+// The text split over several gzip members, as written by concatenating
+// gzip files or by block compressors.
+void differential::write_gzip(const std::string& path, const std::string& text, int members) {
+	remove(path.c_str());
+	size_t begin = 0;
+	for (int m = 0; m < members; m++) {
+		size_t end = m == members - 1 ? text.size() : begin + rng->below(text.size() - begin + 1);
+		gzFile gz = gzopen(path.c_str(), "ab");
+		if (end > begin) {
+			gzwrite(gz, text.data() + begin, end - begin);
+		}
+		gzclose(gz);
+		begin = end;
+	}
+}
+
+bool differential::read_gzip(const std::string& path, std::string& text) {
+	gzFile gz = gzopen(path.c_str(), "rb");
+	if (!gz) {
+		return false;
+	}
+	char buf[1 << 16];
+	int n;
+	while ((n = gzread(gz, buf, sizeof(buf))) > 0) {
+		text.append(buf, n);
+	}
+	return n == 0 && gzclose(gz) == Z_OK;
+}
+
+std::string differential::read_plain(const std::string& path) {
+	std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+	std::ostringstream content;
+	content << in.rdbuf();
+	return content.str();
+}
+
+void differential::check_io() {
+	struct stat st = {0};
+	if (stat(workdir.c_str(), &st) == -1) {
+		mkdir(workdir.c_str(), 0755);
+	}
+	std::string in_plain = workdir + "/in.fastq";
+	std::string in_gz = workdir + "/in.fastq.gz";
+	std::string out_plain = workdir + "/out.fastq";
+	std::string out_gz = workdir + "/out.fastq.gz";
+
+	unsigned long lines_total = 0;
+	for (int round = 0; round < io_rounds; round++) {
+		std::string text = make_fastq_text(round);
+		std::vector<std::string> expected = ref_lines(text);
+		lines_total += expected.size();
+		// Every byte of the text, and no newline after a last line without one
+		unsigned long expected_bytes = text.size();
+
+		int members = text.empty() ? 1 : 1 + rng->below(3);
+		write_plain(in_plain, text);
+		write_gzip(in_gz, text, members);
+		for (auto path : {in_plain, in_gz}) {
+			context = "io round " + std::to_string(round) + ", " + path + ", " +
+				std::to_string(text.size()) + " bytes, " + std::to_string(members) + " members";
+			fastq_reader reader(path);
+			std::vector<std::string> got;
+			std::string line;
+			while (reader.getline(line)) {
+				got.push_back(line);
+			}
+			size_t common = std::min(got.size(), expected.size());
+			size_t first = 0;
+			while (first < common && got[first] == expected[first]) {
+				first++;
+			}
+			if (first < common || got.size() != expected.size()) {
+				fail("fastq_reader", "  " + std::to_string(got.size()) + " lines, expected " +
+					std::to_string(expected.size()) + ", first difference at line " +
+					std::to_string(first));
+			} else if (reader.get_bytes_read() != expected_bytes) {
+				fail("fastq_reader bytes", "  " + std::to_string(reader.get_bytes_read()) +
+					" bytes read, expected " + std::to_string(expected_bytes));
+			}
+		}
+
+		// The writer ends every line with a newline.
+		std::string written;
+		for (auto const& line : expected) {
+			written += line + "\n";
+		}
+		for (auto path : {out_plain, out_gz}) {
+			context = "io round " + std::to_string(round) + ", " + path;
+			{
+				fastq_writer writer(path);
+				for (auto line : expected) {
+					writer.putline(line);
+				}
+			}
+			std::string back;
+			bool ok = true;
+			if (path == out_gz) {
+				ok = read_gzip(path, back);
+			} else {
+				back = read_plain(path);
+			}
+			if (!ok || back != written) {
+				fail("fastq_writer", "  " + std::to_string(back.size()) + " bytes back, expected " +
+					std::to_string(written.size()) + (ok ? "" : ", gzip stream not valid"));
+			}
+		}
+	}
+	for (auto path : {in_plain, in_gz, out_plain, out_gz}) {
+		remove(path.c_str());
+	}
+	rmdir(workdir.c_str());
+	std::cout << "Reader and writer: " << io_rounds << " texts, " << lines_total
+		<< " lines, plain and gzip.\n";
+}
+
+void differential::check_trace() {
+	struct stat st = {0};
+	if (stat(workdir.c_str(), &st) == -1) {
+		mkdir(workdir.c_str(), 0755);
+	}
+	const std::string path = workdir + "/trace.json";
+	const int recorders = 8;
+	int reused = 0;
+	uintptr_t previous = 0;
+	for (int i = 0; i < recorders; i++) {
+		context = "trace recorder " + std::to_string(i);
+		std::unique_ptr<trace_recorder> recorder(new trace_recorder());
+		if ((uintptr_t) recorder.get() == previous) {
+			reused++;
+		}
+		previous = (uintptr_t) recorder.get();
+		const std::string label = "recorder " + std::to_string(i);
+		{
+			trace_scope scope(recorder.get(), "check", label);
+		}
+		recorder->write(path);
+		if (read_plain(path).find("\"" + label + "\"") == std::string::npos) {
+			fail("trace_recorder", "  the event of " + label + " is not in its trace");
+		}
+	}
+	remove(path.c_str());
+	rmdir(workdir.c_str());
+	std::cout << "Trace recorders: " << recorders << " one after the other, " << reused
+		<< " at the address of the one before.\n";
+}
+
+bool differential::run() {
+	if (run_matchers) {
+		check_pruning();
+		check_matchers();
+	}
+	if (run_io) {
+		check_io();
+		check_trace();
+	}
+	if (failures > 0) {
+		std::cout << failures << " failures.\n";
+		return false;
+	}
+	std::cout << "All checks passed.\n";
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	differential diff;
+	bool all_set = true;
+	try {
+		all_set = diff.parse_args(argc, argv);
+	} catch (std::exception& e) {
+		std::cerr << "error: " << e.what() << "\n";
+		return 1;
+	}
+	if (!all_set) {
+		diff.print_help();
+		return 1;
+	}
+	return diff.run() ? 0 : 1;
+}
@@ -0,0 +1,576 @@
+#!/usr/bin/env python3
+
+# End to end checks of the built tools on small synthetic inputs, for the
+# behaviours that only show in a whole run: what goes to which file, what
+# the logs say, and how a run stops and resumes. Every case writes its
+# data to its own directory under the work directory. The exit status is 1
+# if any case failed.
+
+import argparse
+import gzip
+import json
+import os
+import os.path
+import random
+import re
+import resource
+import shutil
+import struct
+import subprocess
+import sys
+import threading
+import time
+import traceback
+
+parser = argparse.ArgumentParser(description = "Run the end to end checks", formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('--bindir', '-b', dest = 'bindir', type = str, default = '.', help = "Directory of the built tools")
+parser.add_argument('--workdir', '-w', dest = 'workdir', type = str, default = 'test_out', help = "Scratch directory for data and outputs")
+parser.add_argument('--cases', dest = 'cases', type = str, default = None, help = "Comma separated case names to run, default all")
+parser.add_argument('--keep', dest = 'keep', action = 'store_true', default = False, help = "Keep the data and outputs")
+
+args = parser.parse_args()
+
+ldelim = '/'
+BASES = "ACGT"
+
+
+def tool(name):
+    return os.path.abspath(args.bindir) + ldelim + name
+
+
+def run(cmd, workdir, ok = True):
+    # Output and status of the command; a failure is an error unless ok is False.
+    proc = subprocess.run(cmd, cwd = workdir, stdout = subprocess.PIPE, stderr = subprocess.STDOUT,
+        universal_newlines = True)
+    if ok and proc.returncode != 0:
+        raise AssertionError("%s exited with %d:\n%s" % (" ".join(cmd), proc.returncode, proc.stdout))
+    return proc
+
+
+def random_bases(rng, n):
+    return "".join(rng.choice(BASES) for _ in range(n))
+
+
+def mutate(rng, seq, positions):
+    seq = list(seq)
+    for pos in positions:
+        seq[pos] = rng.choice([b for b in BASES if b != seq[pos]])
+    return "".join(seq)
+
+
+def write_fastq(path, records, final_newline = True):
+    # records are (name, seq, qual) triples
+    text = "".join("@%s\n%s\n+\n%s\n" % rec for rec in records)
+    with open(path, "w") as out:
+        out.write(text if final_newline else text[:-1])
+
+
+def read_fastq(path):
+    with open(path) as f:
+        lines = f.read().split("\n")
+    return [lines[i:i + 4] for i in range(0, len(lines) - 3, 4)]
+
+
+def build_dict(workdir, barcodes, name = "dict", analysis = False):
+    # The distance analysis is quadratic, most cases do without it.
+    listing = workdir + ldelim + name + ".txt"
+    with open(listing, "w") as out:
+        for i, bc in enumerate(barcodes):
+            out.write("%d\t%s\n" % (i + 1, bc))
+    dict_file = workdir + ldelim + name + ".dict"
+    run([tool("dict_builder"), "-i", listing, "-o", dict_file] + ([] if analysis else ["--no-analysis"]), workdir)
+    return dict_file
+
+
+def log_counts(path):
+    # Barcode -> "Total read for this barcode" of a frequency log
+    counts = {}
+    barcode = None
+    with open(path) as log:
+        for line in log:
+            if line.startswith("Barcode: "):
+                barcode = line.split()[1].rstrip("-*")
+            elif line.startswith("Total read for this barcode: "):
+                counts[barcode] = int(line.split()[5])
+    return counts
+
+
+def distant_barcodes(rng, count, length, min_distance):
+    barcodes = []
+    while len(barcodes) < count:
+        bc = random_bases(rng, length)
+        if all(sum(a != b for a, b in zip(bc, other)) >= min_distance for other in barcodes):
+            barcodes.append(bc)
+    return barcodes
+
+
+def bam_read_names(path):
+    # Names of the records of an unaligned BAM, from the concatenated BGZF
+    # blocks, which gzip reads as members.
+    with gzip.open(path, "rb") as bam:
+        data = bam.read()
+    assert data[:4] == b"BAM\1"
+    pos = 8 + struct.unpack("<i", data[4:8])[0]
+    refs = struct.unpack("<i", data[pos:pos + 4])[0]
+    assert refs == 0
+    pos += 4
+    names = []
+    while pos < len(data):
+        size = struct.unpack("<i", data[pos:pos + 4])[0]
+        name_len = data[pos + 12]
+        names.append(data[pos + 36:pos + 36 + name_len - 1].decode())
+        pos += 4 + size
+    return names
+
+
+# Cases
+
+def case_long_barcodes(workdir):
+    # Barcodes longer than the packed encoding holds are matched as strings.
+    rng = random.Random(36)
+    barcodes = [random_bases(rng, 36) for _ in range(8)]
+    dict_file = build_dict(workdir, barcodes)
+    r1 = []
+    r2 = []
+    expected = {}
+    for i in range(400):
+        bc = rng.choice(barcodes)
+        # At most one mismatch, within -m 1
+        read_bc = mutate(rng, bc, [rng.randrange(36)]) if i % 3 == 0 else bc
+        seq = random_bases(rng, 6) + read_bc + random_bases(rng, 8)
+        r1.append(("r%d" % i, seq, "I" * len(seq)))
+        r2.append(("r%d" % i, random_bases(rng, 30), "I" * 30))
+        expected[bc] = expected.get(bc, 0) + 1
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    run([tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "6", "--bc-size", "36", "--umi-size", "0"], workdir)
+    counts = log_counts(workdir + "/out/s_frequency_logfile.txt")
+    for bc in barcodes:
+        got = counts.get(bc, 0)
+        assert got == expected.get(bc, 0), "%s: %d reads, expected %d" % (bc, got, expected.get(bc, 0))
+        if expected.get(bc, 0) > 0:
+            assert len(read_fastq(workdir + "/out/s_%s_R1.fastq" % bc)) == expected[bc]
+
+
+def count_fifo_records(path, expected, counts, key):
+    # Reads 8 lines per record pair from the FIFO, until expected pairs came
+    # or the writer closed it.
+    with open(path) as fifo:
+        lines = 0
+        for _ in fifo:
+            lines += 1
+            counts[key] = lines // 8
+            if counts[key] >= expected:
+                break
+        for _ in fifo:
+            pass
+
+
+def case_stalled_stream(workdir):
+    # A FIFO whose reader never shows up until the end holds up neither the
+    # other streams nor the run, as long as its reads fit the stream budget.
+    rng = random.Random(46)
+    barcodes = ["ACGTACGT", "TTGGCCAA", "GACTGACT"]
+    dict_file = build_dict(workdir, barcodes)
+    per_barcode = {"ACGTACGT": 20, "TTGGCCAA": 6000, "GACTGACT": 100}
+    order = [bc for bc, n in per_barcode.items() for _ in range(n)]
+    rng.shuffle(order)
+    r1 = []
+    r2 = []
+    for i, bc in enumerate(order):
+        seq = bc + random_bases(rng, 92)
+        r1.append(("r%d" % i, seq, "I" * len(seq)))
+        r2.append(("r%d" % i, random_bases(rng, 100), "I" * 100))
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    slow = workdir + "/slow.fifo"
+    fast = workdir + "/fast.fifo"
+    os.mkfifo(slow)
+    os.mkfifo(fast)
+    with open(workdir + "/streams.txt", "w") as spec:
+        spec.write("ACGTACGT fifo:%s\nTTGGCCAA fifo:%s\n" % (slow, fast))
+    # 1 MB in all: the fast stream gets several times its half of it.
+    cmd = [tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "8", "--umi-size", "0",
+        "--allowed-mb", "1", "--stream", "streams.txt"]
+    log = open(workdir + "/run.log", "w")
+    proc = subprocess.Popen(cmd, cwd = workdir, stdout = log, stderr = subprocess.STDOUT)
+    counts = {}
+    try:
+        fast_reader = threading.Thread(target = count_fifo_records,
+            args = (fast, per_barcode["TTGGCCAA"], counts, "fast"), daemon = True)
+        fast_reader.start()
+        deadline = time.time() + 60
+        while counts.get("fast", 0) < per_barcode["TTGGCCAA"] and time.time() < deadline:
+            assert proc.poll() is None, "bc_splitter exited with the slow FIFO unopened"
+            time.sleep(0.1)
+        assert counts.get("fast", 0) == per_barcode["TTGGCCAA"], \
+            "%d of %d reads came through the fast FIFO" % (counts.get("fast", 0), per_barcode["TTGGCCAA"])
+        count_fifo_records(slow, per_barcode["ACGTACGT"], counts, "slow")
+        assert counts["slow"] == per_barcode["ACGTACGT"]
+        fast_reader.join(60)
+        proc.wait(60)
+    finally:
+        if proc.poll() is None:
+            proc.kill()
+            proc.wait()
+        log.close()
+    with open(workdir + "/run.log") as f:
+        assert proc.returncode == 0, "bc_splitter exited with %d:\n%s" % (proc.returncode, f.read())
+    assert len(read_fastq(workdir + "/out/s_GACTGACT_R1.fastq")) == per_barcode["GACTGACT"]
+
+
+def case_many_bam_outputs(workdir):
+    # More BAM outputs than the process may have files open, over several
+    # flushes, each flush ending a BGZF block of every file it wrote to.
+    rng = random.Random(48)
+    barcodes = distant_barcodes(rng, 300, 8, 3)
+    dict_file = build_dict(workdir, barcodes)
+    r1 = []
+    r2 = []
+    expected = {}
+    for i in range(12000):
+        bc = barcodes[i % len(barcodes)]
+        seq = bc + random_bases(rng, 92)
+        r1.append(("r%d" % i, seq, "I" * len(seq)))
+        r2.append(("r%d" % i, random_bases(rng, 100), "I" * 100))
+        expected.setdefault(bc, []).append("r%d" % i)
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    cmd = [tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "8", "--umi-size", "0",
+        "--allowed-mb", "1", "--bam"]
+    limit = lambda: resource.setrlimit(resource.RLIMIT_NOFILE, (64, 64))
+    proc = subprocess.run(cmd, cwd = workdir, stdout = subprocess.PIPE, stderr = subprocess.STDOUT,
+        universal_newlines = True, preexec_fn = limit)
+    assert proc.returncode == 0, "bc_splitter exited with %d:\n%s" % (proc.returncode, proc.stdout)
+    for bc in barcodes:
+        names = bam_read_names(workdir + "/out/s_%s.bam" % bc)
+        assert names == [n for name in expected[bc] for n in (name, name)], bc
+
+
+def case_resume_without_final_newline(workdir):
+    # The checkpoint at the end of an input that has no final newline is
+    # within the file, so a resume from it finds nothing left to split.
+    rng = random.Random(44)
+    barcodes = ["ACGTACGT", "TTGGCCAA"]
+    dict_file = build_dict(workdir, barcodes)
+    r1 = []
+    r2 = []
+    for i in range(3000):
+        seq = barcodes[i % 2] + random_bases(rng, 92)
+        r1.append(("r%d" % i, seq, "I" * len(seq)))
+        r2.append(("r%d" % i, random_bases(rng, 100), "I" * 100))
+    write_fastq(workdir + "/r1.fastq", r1, final_newline = False)
+    write_fastq(workdir + "/r2.fastq", r2, final_newline = False)
+    cmd = [tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "8", "--umi-size", "0",
+        "--allowed-mb", "1"]
+    run(cmd + ["--checkpoint"], workdir)
+    run(cmd + ["--resume"], workdir)
+    counts = log_counts(workdir + "/out/s_frequency_logfile.txt")
+    for bc in barcodes:
+        assert counts.get(bc, 0) == 1500, "%s: %d reads after the resume" % (bc, counts.get(bc, 0))
+        assert len(read_fastq(workdir + "/out/s_%s_R1.fastq" % bc)) == 1500
+
+
+def read_fastq_gz(path):
+    with gzip.open(path, "rt") as f:
+        lines = f.read().split("\n")
+    return [lines[i:i + 4] for i in range(0, len(lines) - 3, 4)]
+
+
+def case_index_unmatched(workdir):
+    # No-match and ambiguous read pairs share the unmatched files of
+    # index_splitter, over several flushes, and both kinds are all there.
+    rng = random.Random(37)
+    barcodes = ["AAAAAAAA", "AAAAAATT", "CCGGTTAC"]
+    dict_file = build_dict(workdir, barcodes)
+    r1 = []
+    r2 = []
+    i1 = []
+    unmatched = []
+    for i in range(6000):
+        kind = i % 3
+        if kind == 0:
+            index = "CCGGTTAC"
+        elif kind == 1:
+            # One off both AAAAAAAA and AAAAAATT
+            index = "AAAAAAAT"
+        else:
+            index = "GTGTGTGT"
+            unmatched.append("r%d" % i)
+        if kind == 1:
+            unmatched.append("r%d" % i)
+        r1.append(("r%d" % i, random_bases(rng, 100), "I" * 100))
+        r2.append(("r%d" % i, random_bases(rng, 100), "I" * 100))
+        i1.append(("r%d" % i, index, "I" * 8))
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    write_fastq(workdir + "/i1.fastq", i1)
+    os.makedirs(workdir + "/out")
+    run([tool("index_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-i", "i1.fastq", "-p", "s", "-o", "out/split", "--allowed-mb", "1"], workdir)
+    for part in ["1", "2", "barcode_1"]:
+        records = read_fastq_gz(workdir + "/out/split/s.unmatched.%s.fastq.gz" % part)
+        # The index read is appended to the names
+        names = sorted(re.match(r"@(r\d+)", rec[0]).group(1) for rec in records)
+        assert names == sorted(unmatched), "s.unmatched.%s.fastq.gz: %d reads, expected %d" % \
+            (part, len(names), len(unmatched))
+
+
+def case_index_from_header(workdir):
+    # The index comes from the first field of "1:N:0:<i7>+<i5>" in the read
+    # 1 headers. The headers go out as they were, there is no index read to
+    # write, and a read 2 header with another index stops the run.
+    rng = random.Random(50)
+    barcodes = ["ACGTACGT", "TTGGCCAA", "GACTGACT"]
+    dict_file = build_dict(workdir, barcodes)
+    r1 = []
+    r2 = []
+    expected = {}
+    for i in range(300):
+        bc = barcodes[i % 3]
+        r1.append(("read%d 1:N:0:%s+AAAA" % (i, bc), random_bases(rng, 50), "I" * 50))
+        r2.append(("read%d 2:N:0:%s+AAAA" % (i, bc), random_bases(rng, 50), "I" * 50))
+        expected.setdefault(bc, []).append(i)
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    os.makedirs(workdir + "/out")
+    cmd = [tool("index_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "--index-from-header", "--check-header-index"]
+    run(cmd + ["-o", "out/split"], workdir)
+    outputs = os.listdir(workdir + "/out/split")
+    assert not [name for name in outputs if "barcode_1" in name], outputs
+    for bc in barcodes:
+        for part, reads in (("1", r1), ("2", r2)):
+            records = read_fastq_gz(workdir + "/out/split/s.%s.unmapped.%s.fastq.gz" % (bc, part))
+            assert [rec[0] for rec in records] == ["@" + reads[i][0] for i in expected[bc]], \
+                "%s read %s: headers changed or reads missing" % (bc, part)
+
+    # The BAM has the index in BC but no made up qualities in QT.
+    run(cmd + ["-o", "out/bam", "--bam"], workdir)
+    with gzip.open(workdir + "/out/bam/s.%s.unmapped.bam" % barcodes[0], "rb") as bam:
+        data = bam.read()
+    assert b"BCZ" + barcodes[0].encode() in data and b"QTZ" not in data
+
+    # Another index in one read 2 header
+    bad = list(r2)
+    bad[123] = ("read123 2:N:0:GGGGGGGG+AAAA", bad[123][1], bad[123][2])
+    write_fastq(workdir + "/r2_bad.fastq", bad)
+    proc = run([arg if arg != "r2.fastq" else "r2_bad.fastq" for arg in cmd] + ["-o", "out/bad"],
+        workdir, ok = False)
+    assert proc.returncode != 0 and "read123" in proc.stdout, proc.stdout
+
+    # The options it does not go with
+    for extra in (["-i", "r1.fastq"], ["--qual-assign"], ["--interleave-index"]):
+        proc = run(cmd + ["-o", "out/conflict"] + extra, workdir, ok = False)
+        assert "Error:" in proc.stdout and not os.path.exists(workdir + "/out/conflict"), extra
+
+
+def case_batch_memory(workdir):
+    # The samples of a batch split at the same time share --allowed-mb, and
+    # a glob in the manifest is expanded before the workers start.
+    rng = random.Random(41)
+    barcodes = ["ACGTACGT", "TTGGCCAA"]
+    dict_file = build_dict(workdir, barcodes)
+    manifest = []
+    for sample in ["a", "b", "c"]:
+        for read in ["r1", "r2", "i1"]:
+            records = []
+            for i in range(200):
+                seq = barcodes[i % 2] if read == "i1" else random_bases(rng, 50)
+                records.append(("r%d" % i, seq, "I" * len(seq)))
+            write_fastq(workdir + "/%s.%s.fastq" % (sample, read), records)
+        spec = "%s.%%s.f*q" if sample == "c" else "%s.%%s.fastq"
+        manifest.append("s%s %s %s %s\n" % (sample, spec % sample % "i1", spec % sample % "r1",
+            spec % sample % "r2"))
+    with open(workdir + "/manifest.txt", "w") as out:
+        out.write("".join(manifest))
+    run([tool("index_splitter"), "-d", dict_file, "--manifest", "manifest.txt", "-o", "out",
+        "--threads", "2", "--allowed-mb", "10"], workdir)
+    for sample in ["sa", "sb", "sc"]:
+        with open(workdir + "/out/%s_metrics.json" % sample) as f:
+            metrics = json.load(f)
+        assert metrics["buffer"]["allowed_bytes"] == 5 * 1024 * 1024, sample
+        for bc in barcodes:
+            records = read_fastq_gz(workdir + "/out/%s.%s.unmapped.1.fastq.gz" % (sample, bc))
+            assert len(records) == 100, "%s %s: %d reads" % (sample, bc, len(records))
+
+
+def case_lane_order(workdir):
+    # Lanes come out 4096 read pairs of each in turn, lane 1 first, not one
+    # lane after the other.
+    rng = random.Random(42)
+    dict_file = build_dict(workdir, ["ACGTACGT"])
+    lanes = {1: 5000, 2: 7000, 3: 100}
+    for lane, count in lanes.items():
+        r1 = []
+        r2 = []
+        for i in range(count):
+            seq = "ACGTACGT" + random_bases(rng, 40)
+            r1.append(("l%d_%d" % (lane, i), seq, "I" * len(seq)))
+            r2.append(("l%d_%d" % (lane, i), random_bases(rng, 40), "I" * 40))
+        write_fastq(workdir + "/L%d_R1.fastq" % lane, r1)
+        write_fastq(workdir + "/L%d_R2.fastq" % lane, r2)
+    run([tool("bc_splitter"), "-d", dict_file, "--file1", "L*_R1.fastq", "--file2", "L*_R2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "8", "--umi-size", "0"], workdir)
+    expected = []
+    for start in range(0, max(lanes.values()), 4096):
+        for lane, count in lanes.items():
+            expected += ["l%d_%d" % (lane, i) for i in range(start, min(count, start + 4096))]
+    names = [re.match(r"@(l\d+_\d+)", rec[0]).group(1)
+        for rec in read_fastq(workdir + "/out/s_ACGTACGT_R1.fastq")]
+    assert len(names) == len(expected), "%d reads, expected %d" % (len(names), len(expected))
+    first = next((i for i in range(len(names)) if names[i] != expected[i]), None)
+    assert first is None, "read %d is %s, expected %s" % (first, names[first], expected[first])
+
+
+def case_quality_rescue_log(workdir):
+    # Reads matched only by --qual-assign are counted on their own, in the
+    # total of their barcode, and the distance histogram stays that of the
+    # search, up to the cutoff plus one.
+    rng = random.Random(26)
+    dict_file = build_dict(workdir, ["AAAAAAAA", "AAAAAATT", "GGGGCCCC"])
+    reads = []
+    # Exact matches
+    reads += [("AAAAAAAA", "IIIIIIII")] * 50
+    # One off both AAAAAAAA and AAAAAATT, the mismatch against AAAAAAAA a
+    # poor base call
+    reads += [("AAAAAAAT", "IIIIIII#")] * 20
+    # Three off AAAAAAAA, all of them poor base calls
+    reads += [("CCCAAAAA", "###IIIII")] * 10
+    r1 = []
+    r2 = []
+    for i, (bc, qual) in enumerate(reads):
+        tail = random_bases(rng, 40)
+        r1.append(("r%d" % i, bc + tail, qual + "I" * 40))
+        r2.append(("r%d" % i, random_bases(rng, 40), "I" * 40))
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    run([tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "8", "--umi-size", "0",
+        "-m", "1", "--qual-assign"], workdir)
+    rescued = {}
+    barcode = None
+    with open(workdir + "/out/s_frequency_logfile.txt") as log:
+        for line in log:
+            if line.startswith("Barcode: "):
+                barcode = line.split()[1].rstrip("-*")
+            elif line.startswith("Quality rescued: "):
+                rescued[barcode] = int(line.split()[2])
+    assert rescued.get("AAAAAAAA") == 30, "AAAAAAAA: %s rescued reads in the log" % rescued.get("AAAAAAAA")
+    assert rescued.get("AAAAAATT") == 0 and rescued.get("GGGGCCCC") == 0, rescued
+    counts = log_counts(workdir + "/out/s_frequency_logfile.txt")
+    assert counts["AAAAAAAA"] == 80, "AAAAAAAA: %d reads" % counts["AAAAAAAA"]
+    with open(workdir + "/out/s_metrics.json") as f:
+        metrics = json.load(f)
+    histogram = {int(k): v for k, v in metrics["distance_histogram"].items()}
+    assert max(histogram) <= 2, "distances %s above the cutoff plus one" % sorted(histogram)
+    assert histogram[0] == 50 and histogram[1] == 20 and histogram[2] == 10, histogram
+    assert metrics["higher_mismatch"]["AAAAAAAA"] == 0, metrics["higher_mismatch"]
+    assert metrics["quality_rescued"]["AAAAAAAA"] == 30, metrics["quality_rescued"]
+    assert metrics["reads"]["quality_rescued"] == 30
+
+
+def case_discover_uniform(workdir):
+    # Barcodes all read the same number of times give a flat rank curve
+    # with no knee, and every one of them is kept. With a tail of one-off
+    # error barcodes the knee still keeps only the real ones.
+    rng = random.Random(30)
+    barcodes = distant_barcodes(rng, 20, 8, 3)
+
+    def discover(name, seqs):
+        r1 = [("r%d" % i, bc + random_bases(rng, 40), "I" * 48) for i, bc in enumerate(seqs)]
+        write_fastq(workdir + "/" + name + ".fastq", r1)
+        proc = run([tool("bc_splitter"), "--file1", name + ".fastq", "--discover", name + ".txt",
+            "--bc-start", "0", "--bc-size", "8", "--umi-size", "0"], workdir)
+        with open(workdir + "/" + name + ".txt") as f:
+            return proc.stdout, [line.split("\t")[1].strip() for line in f if line.strip()]
+
+    out, found = discover("uniform", [bc for bc in barcodes for _ in range(50)])
+    assert sorted(found) == sorted(barcodes), "%d of %d barcodes kept:\n%s" % (len(found), len(barcodes), out)
+    assert "no knee" in out, out
+    tail = set()
+    while len(tail) < 300:
+        bc = random_bases(rng, 8)
+        if bc not in barcodes:
+            tail.add(bc)
+    out, found = discover("tail", [bc for bc in barcodes for _ in range(200)] + sorted(tail))
+    assert sorted(found) == sorted(barcodes), "%d barcodes kept, expected %d:\n%s" % (len(found), len(barcodes), out)
+
+
+def case_safe_cutoff(workdir):
+    # A dictionary built with the distance analysis tells the splitter how
+    # many mismatches cannot be ambiguous, and reads up to that many off
+    # their barcode all go to it.
+    rng = random.Random(28)
+    barcodes = distant_barcodes(rng, 12, 10, 5)
+    dict_file = build_dict(workdir, barcodes, analysis = True)
+    dmin = min(sum(a != b for a, b in zip(x, y)) for i, x in enumerate(barcodes) for y in barcodes[i + 1:])
+    safe = (dmin - 1) // 2
+    r1 = []
+    r2 = []
+    for i in range(600):
+        bc = barcodes[i % len(barcodes)]
+        seq = mutate(rng, bc, rng.sample(range(10), i % (safe + 1))) + random_bases(rng, 40)
+        r1.append(("r%d" % i, seq, "I" * len(seq)))
+        r2.append(("r%d" % i, random_bases(rng, 40), "I" * 40))
+    write_fastq(workdir + "/r1.fastq", r1)
+    write_fastq(workdir + "/r2.fastq", r2)
+    proc = run([tool("bc_splitter"), "-d", dict_file, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out", "--bc-start", "0", "--bc-size", "10", "--umi-size", "0",
+        "-m", str(safe)], workdir)
+    expected = "Dictionary minimum distance is %d, mismatch up to %d cannot be ambiguous." % (dmin, safe)
+    assert expected in proc.stdout, proc.stdout
+    counts = log_counts(workdir + "/out/s_frequency_logfile.txt")
+    for bc in barcodes:
+        assert counts.get(bc) == 50, "%s: %s reads, expected 50" % (bc, counts.get(bc))
+    # Without the analysis the dictionary knows no distance and says nothing.
+    plain = build_dict(workdir, barcodes, name = "plain")
+    proc = run([tool("bc_splitter"), "-d", plain, "--file1", "r1.fastq", "--file2", "r2.fastq",
+        "-p", "s", "-o", "out_plain", "--bc-start", "0", "--bc-size", "10", "--umi-size", "0",
+        "-m", str(safe)], workdir)
+    assert "cannot be ambiguous" not in proc.stdout, proc.stdout
+
+
+CASES = [
+    ("long_barcodes", case_long_barcodes),
+    ("stalled_stream", case_stalled_stream),
+    ("many_bam_outputs", case_many_bam_outputs),
+    ("resume_without_final_newline", case_resume_without_final_newline),
+    ("index_unmatched", case_index_unmatched),
+    ("index_from_header", case_index_from_header),
+    ("batch_memory", case_batch_memory),
+    ("lane_order", case_lane_order),
+    ("quality_rescue_log", case_quality_rescue_log),
+    ("discover_uniform", case_discover_uniform),
+    ("safe_cutoff", case_safe_cutoff),
+]
+
+
+def main():
+    selected = args.cases.split(",") if args.cases else [name for name, _ in CASES]
+    failed = []
+    for name, case in CASES:
+        if name not in selected:
+            continue
+        workdir = os.path.abspath(args.workdir) + ldelim + name
+        shutil.rmtree(workdir, ignore_errors = True)
+        os.makedirs(workdir)
+        try:
+            case(workdir)
+            print("ok      " + name)
+        except Exception:
+            failed.append(name)
+            print("FAILED  " + name)
+            traceback.print_exc(file = sys.stdout)
+        if not args.keep and name not in failed:
+            shutil.rmtree(workdir, ignore_errors = True)
+    print("%d of %d cases passed." % (len(selected) - len(failed), len(selected)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
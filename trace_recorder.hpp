@@ -0,0 +1,209 @@
+#ifndef _TRACE_RECORDER_HPP
+#define _TRACE_RECORDER_HPP
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include "run_metrics.hpp"
+
+// Timeline of what the splitters do, written at the end as a Chrome trace
+// (chrome://tracing, Perfetto). Every thread records into its own ring
+// buffer, so recording takes no lock; a ring that fills up keeps the most
+// recent events. The rings are read once the recording threads are done.
+class trace_recorder {
+    public:
+    typedef std::chrono::steady_clock clock;
+
+    static const int MAX_ARGS = 6;
+    static const size_t LABEL_SIZE = 40;
+    // Events kept per thread, about 130 bytes each
+    static const size_t RING_EVENTS = 1 << 16;
+
+    struct event {
+        const char* name;
+        uint64_t ts_ns;
+        uint64_t dur_ns;
+        char label[LABEL_SIZE];
+        // Names of the numeric args, a static array of nargs names
+        const char* const* arg_names;
+        uint64_t args[MAX_ARGS];
+        int nargs;
+    };
+
+    trace_recorder() : id(++last_id()) {
+        origin = clock::now();
+    }
+
+    trace_recorder(const trace_recorder&) = delete;
+    trace_recorder& operator = (const trace_recorder&) = delete;
+
+    // A span from begin to end on the calling thread. label is shown as
+    // the "label" arg, e.g. the barcode of a flush.
+    void complete(const char* name, clock::time_point begin, clock::time_point end,
+        const std::string& label = "", const char* const* arg_names = nullptr,
+        const uint64_t* args = nullptr, int nargs = 0) {
+
+        ring& r = local_ring();
+        event& e = r.events[r.head % RING_EVENTS];
+        r.head++;
+        e.name = name;
+        e.ts_ns = begin > origin ?
+            std::chrono::duration_cast<std::chrono::nanoseconds>(begin - origin).count() : 0;
+        e.dur_ns = end > begin ?
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() : 0;
+        size_t len = std::min(label.size(), LABEL_SIZE - 1);
+        memcpy(e.label, label.data(), len);
+        e.label[len] = '\0';
+        e.arg_names = arg_names;
+        e.nargs = nargs < MAX_ARGS ? nargs : MAX_ARGS;
+        for (int i = 0; i < e.nargs; i++) {
+            e.args[i] = args[i];
+        }
+    }
+
+    // Names the calling thread in the viewer.
+    void name_thread(const std::string& name) {
+        local_ring().name = name;
+    }
+
+    // Events lost to full rings.
+    unsigned long dropped() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        unsigned long count = 0;
+        for (auto const& r : rings) {
+            if (r->head > RING_EVENTS) {
+                count += r->head - RING_EVENTS;
+            }
+        }
+        return count;
+    }
+
+    // Only once no thread records any more.
+    void write(const std::string& path) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::ofstream out(path);
+        json_writer json(out);
+        json.begin_object();
+        json.field("displayTimeUnit", "ms");
+        json.begin_array("traceEvents");
+        for (size_t tid = 0; tid < rings.size(); tid++) {
+            const ring& r = *rings[tid];
+            json.begin_object();
+            json.field("name", "thread_name");
+            json.field("ph", "M");
+            json.field("pid", 1);
+            json.field("tid", tid);
+            json.begin_object("args");
+            json.field("name", r.name.empty() ? "thread " + std::to_string(tid) : r.name);
+            json.end_object();
+            json.end_object();
+
+            uint64_t first = r.head > RING_EVENTS ? r.head - RING_EVENTS : 0;
+            for (uint64_t i = first; i < r.head; i++) {
+                const event& e = r.events[i % RING_EVENTS];
+                json.begin_object();
+                json.field("name", e.name);
+                json.field("ph", "X");
+                json.field("pid", 1);
+                json.field("tid", tid);
+                json.field("ts", micros(e.ts_ns));
+                json.field("dur", micros(e.dur_ns));
+                if (e.label[0] != '\0' || e.nargs > 0) {
+                    json.begin_object("args");
+                    if (e.label[0] != '\0') {
+                        json.field("label", e.label);
+                    }
+                    for (int a = 0; a < e.nargs; a++) {
+                        json.field(e.arg_names[a], e.args[a]);
+                    }
+                    json.end_object();
+                }
+                json.end_object();
+            }
+        }
+        json.end_array();
+        json.end_object();
+    }
+
+    private:
+    struct ring {
+        std::vector<event> events;
+        uint64_t head = 0;
+        std::string name;
+    };
+
+    // Microseconds with the nanoseconds kept, as the format expects.
+    struct micros {
+        micros(uint64_t ns) : ns(ns) {
+        }
+        friend std::ostream& operator << (std::ostream& out, const micros& m) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%llu.%03llu", (unsigned long long) (m.ns / 1000),
+                (unsigned long long) (m.ns % 1000));
+            return out << buf;
+        }
+        uint64_t ns;
+    };
+
+    // The ring of the calling thread, registered on its first event. The
+    // cache is keyed by the id of the recorder, not its address, which a
+    // later recorder may get once this one is gone.
+    ring& local_ring() {
+        thread_local uint64_t owner = 0;
+        thread_local ring* cached = nullptr;
+        if (owner != id) {
+            std::unique_ptr<ring> r(new ring());
+            r->events.resize(RING_EVENTS);
+            std::lock_guard<std::mutex> lock(mtx);
+            cached = r.get();
+            rings.push_back(std::move(r));
+            owner = id;
+        }
+        return *cached;
+    }
+
+    // Ids of the recorders of the process, from 1
+    static std::atomic<uint64_t>& last_id() {
+        static std::atomic<uint64_t> value(0);
+        return value;
+    }
+
+    const uint64_t id;
+    clock::time_point origin;
+    mutable std::mutex mtx;
+    std::vector<std::unique_ptr<ring>> rings;
+};
+
+// Records the lifetime of the scope as a span, when there is a recorder.
+class trace_scope {
+    public:
+    trace_scope(trace_recorder* recorder, const char* name, const std::string& label = "") :
+        recorder(recorder), name(name), label(recorder ? label : std::string()) {
+        if (recorder) {
+            begin = trace_recorder::clock::now();
+        }
+    }
+
+    ~trace_scope() {
+        if (recorder) {
+            recorder->complete(name, begin, trace_recorder::clock::now(), label);
+        }
+    }
+
+    private:
+    trace_recorder* recorder;
+    const char* name;
+    std::string label;
+    trace_recorder::clock::time_point begin;
+};
+#endif
@@ -0,0 +1,67 @@
+#ifndef _TREE_MATCH_HPP
+#define _TREE_MATCH_HPP
+#include <string>
+#include <vector>
+
+#include "BKTree.h"
+#include "packed_barcode.hpp"
+
+// The splitters' decision for one barcode against the dictionary tree: the
+// closest entry within the cutoff, its distance and the number of entries
+// at that distance (1 is a match, more a tie). The outputs are left alone
+// when nothing is within the cutoff, so the caller initializes them.
+//
+// Wildcard Ns are mismatches to every entry in the tree, so the search
+// radius grows by their number and the exact distance is taken here.
+// Within safe_cutoff the search finds at most one entry, so the tie
+// counting is skipped; wildcard Ns widen the search and void that
+// guarantee. A barcode without a packed encoding (packed_str.len 0) is
+// compared as a string.
+inline void match_in_tree(const BKTree<std::string>& tree, const std::string& barcode_str,
+    const packed_barcode& packed_str, int cutoff, int safe_cutoff, bool n_wildcard,
+    int& smallest_dist, std::string& smallest_barcode, int& smallest_count,
+    bool remove_last = false) {
+
+    bool packed = packed_str.len > 0;
+    int n_count = packed ? packed_str.n_count() : string_n_count(barcode_str);
+    auto distance_to = [&](const std::string& val) {
+        return packed ? packed_distance(packed_barcode::encode(val), packed_str, n_wildcard,
+            remove_last) : string_distance(val, barcode_str, n_wildcard, remove_last);
+    };
+    std::vector<std::string> results;
+    if (n_wildcard) {
+        results = tree.find(barcode_str, cutoff + n_count, remove_last);
+    } else {
+        results = tree.find(barcode_str, cutoff, remove_last);
+    }
+
+    if (cutoff <= safe_cutoff && (!n_wildcard || n_count == 0)) {
+        if (!results.empty()) {
+            smallest_barcode = results[0];
+            smallest_dist = distance_to(smallest_barcode);
+            smallest_count = 1;
+        }
+        return;
+    }
+
+    std::vector<int> dist_vec;
+    for (auto const& val : results) {
+        int ldist = distance_to(val);
+        if (ldist > cutoff) {
+            continue;
+        }
+        if (ldist < smallest_dist) {
+            smallest_dist = ldist;
+            smallest_barcode = val;
+        }
+
+        dist_vec.push_back(ldist);
+    }
+
+    for (auto const& temp_dist : dist_vec) {
+        if (temp_dist == smallest_dist) {
+            smallest_count++;
+        }
+    }
+}
+#endif
@@ -0,0 +1,331 @@
+#ifndef _WHITELIST_INDEX_HPP
+#define _WHITELIST_INDEX_HPP
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "packed_barcode.hpp"
+
+// Dictionary for large barcode whitelists (hundreds of thousands to
+// millions of entries, as used for single cell barcodes).
+//
+// The barcodes are kept as a sorted array of packed 2-bit codes, and that
+// array is all that goes to disk. For matching with up to k mismatches the
+// barcode is cut into k + 2 segments. A barcode within k mismatches of the
+// read agrees exactly on at least two of them, so there is one seed table
+// per pair of segments, hashing the two segments to the entries that carry
+// them. The seed tables are rebuilt at load time for the cutoff in use.
+//
+// File layout (host byte order): "BCWL", format version, barcode length,
+// reserved word, number of entries, then the sorted codes.
+
+class whitelist_index {
+    public:
+    static const uint32_t FORMAT_VERSION = 1;
+    static const int MAX_MISMATCH = 3;
+
+    static bool is_whitelist_file(const std::string& path) {
+        std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+        char magic[4] = {0};
+        in.read(magic, 4);
+        return in && memcmp(magic, MAGIC, 4) == 0;
+    }
+
+    // Encode the barcodes in parallel, sort every chunk in its own thread
+    // and merge the chunks. Duplicates are dropped.
+    void build(const std::vector<std::string>& barcodes, int threads) {
+        codes.clear();
+        if (barcodes.empty()) {
+            return;
+        }
+        bc_len = barcodes[0].length();
+        if (threads < 1) {
+            threads = 1;
+        }
+        size_t chunk = (barcodes.size() + threads - 1) / threads;
+        std::vector<std::vector<uint64_t>> parts(threads);
+        std::vector<std::string> errors(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                size_t begin = std::min(barcodes.size(), t * chunk);
+                size_t end = std::min(barcodes.size(), begin + chunk);
+                std::vector<uint64_t>& part = parts[t];
+                part.reserve(end - begin);
+                try {
+                    for (size_t i = begin; i < end; i++) {
+                        if ((int) barcodes[i].length() != bc_len) {
+                            throw std::invalid_argument("Whitelist barcodes have different length.\n" +
+                                barcodes[0] + "\n" + barcodes[i] + "\n");
+                        }
+                        packed_barcode pb = packed_barcode::encode(barcodes[i]);
+                        if (pb.nmask != 0) {
+                            throw std::invalid_argument("Whitelist barcode with a base other than"
+                                " A, C, G or T: " + barcodes[i] + "\n");
+                        }
+                        part.push_back(pb.bits);
+                    }
+                    std::sort(part.begin(), part.end());
+                } catch (std::exception& e) {
+                    errors[t] = e.what();
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (auto const& error : errors) {
+            if (!error.empty()) {
+                throw std::invalid_argument(error);
+            }
+        }
+
+        codes.reserve(barcodes.size());
+        for (auto const& part : parts) {
+            size_t mid = codes.size();
+            codes.insert(codes.end(), part.begin(), part.end());
+            std::inplace_merge(codes.begin(), codes.begin() + mid, codes.end());
+        }
+        codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+    }
+
+    void save(const std::string& path) const {
+        std::ofstream out(path, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+        uint32_t header[3] = {FORMAT_VERSION, (uint32_t) bc_len, 0};
+        uint64_t count = codes.size();
+        out.write(MAGIC, 4);
+        out.write((const char*) header, sizeof(header));
+        out.write((const char*) &count, sizeof(count));
+        out.write((const char*) codes.data(), count * sizeof(uint64_t));
+        if (!out) {
+            throw std::runtime_error("Cannot write the whitelist to " + path);
+        }
+    }
+
+    void load(const std::string& path) {
+        std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+        char magic[4] = {0};
+        uint32_t header[3] = {0, 0, 0};
+        uint64_t count = 0;
+        in.read(magic, 4);
+        in.read((char*) header, sizeof(header));
+        in.read((char*) &count, sizeof(count));
+        if (!in || memcmp(magic, MAGIC, 4) != 0) {
+            throw std::invalid_argument("Not a whitelist dictionary: " + path);
+        }
+        if (header[0] != FORMAT_VERSION) {
+            throw std::invalid_argument("Unsupported whitelist format version in " + path);
+        }
+        bc_len = header[1];
+        codes.resize(count);
+        in.read((char*) codes.data(), count * sizeof(uint64_t));
+        if (!in) {
+            throw std::invalid_argument("Truncated whitelist dictionary: " + path);
+        }
+    }
+
+    // Build the seed tables for matching with up to max_mismatch
+    // mismatches, one thread per table.
+    void build_seeds(int max_mismatch) {
+        if (max_mismatch < 0 || max_mismatch > MAX_MISMATCH) {
+            throw std::invalid_argument("The whitelist supports up to " +
+                std::to_string(MAX_MISMATCH) + " mismatches.");
+        }
+        cutoff = max_mismatch;
+        tables.clear();
+        seg_masks.clear();
+        if (cutoff == 0) {
+            return;
+        }
+        int seg_count = cutoff + 2;
+        if (bc_len < seg_count) {
+            throw std::invalid_argument("Barcodes are too short for this many mismatches.");
+        }
+        for (int s = 0; s < seg_count; s++) {
+            int begin = s * bc_len / seg_count;
+            int end = (s + 1) * bc_len / seg_count;
+            uint64_t mask = 0;
+            for (int i = begin; i < end; i++) {
+                mask |= 3ULL << (2 * i);
+            }
+            seg_masks.push_back(mask);
+        }
+        for (int a = 0; a < seg_count; a++) {
+            for (int b = a + 1; b < seg_count; b++) {
+                seed_table table;
+                table.seg_a = a;
+                table.seg_b = b;
+                table.mask = seg_masks[a] | seg_masks[b];
+                tables.push_back(table);
+            }
+        }
+
+        bucket_bits = 1;
+        while ((1ULL << bucket_bits) < codes.size()) {
+            bucket_bits++;
+        }
+        std::vector<std::thread> workers;
+        for (auto& table : tables) {
+            workers.emplace_back([this, &table]() { fill_table(table); });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Same decision as the splitters make on the tree search results:
+    // returns the index of the closest entry within the cutoff, with the
+    // number of entries at that distance in smallest_count. -1 if none.
+    int find_best(const packed_barcode& query, int& smallest_dist, int& smallest_count) const {
+        smallest_dist = cutoff + 1;
+        smallest_count = 0;
+        if (query.len != bc_len) {
+            std::string msg = "The size of the barcode from file1 does not match with\n"
+                " one from the dictionary.\n" + query.decode() + "\n";
+            throw std::invalid_argument(msg);
+        }
+
+        if (cutoff == 0) {
+            if (query.nmask != 0) {
+                return -1;
+            }
+            auto it = std::lower_bound(codes.begin(), codes.end(), query.bits);
+            if (it == codes.end() || *it != query.bits) {
+                return -1;
+            }
+            smallest_dist = 0;
+            smallest_count = 1;
+            return it - codes.begin();
+        }
+
+        // Segments holding an N never agree exactly.
+        uint64_t n_slots = query.nmask | (query.nmask << 1);
+        int best_idx = -1;
+        for (size_t t = 0; t < tables.size(); t++) {
+            const seed_table& table = tables[t];
+            if (n_slots & table.mask) {
+                continue;
+            }
+            uint64_t bucket = bucket_of(query.bits & table.mask);
+            for (uint32_t k = table.offsets[bucket]; k < table.offsets[bucket + 1]; k++) {
+                uint32_t id = table.ids[k];
+                uint64_t x = codes[id] ^ query.bits;
+                if (x & table.mask) {
+                    continue;
+                }
+                // An entry is reached through every pair of segments it
+                // agrees on; only the first such pair counts it.
+                if (first_table(x | n_slots) != t) {
+                    continue;
+                }
+                packed_barcode entry;
+                entry.bits = codes[id];
+                entry.len = bc_len;
+                int dist = packed_distance(query, entry);
+                if (dist > cutoff) {
+                    continue;
+                }
+                if (dist < smallest_dist) {
+                    smallest_dist = dist;
+                    smallest_count = 1;
+                    best_idx = id;
+                } else if (dist == smallest_dist) {
+                    smallest_count++;
+                }
+            }
+        }
+        return best_idx;
+    }
+
+    // Closest entry by a linear scan, for reports rather than per read
+    // matching. ties is the number of entries at that distance.
+    int nearest(const packed_barcode& query, int& smallest_dist, int& ties) const {
+        int best_idx = -1;
+        smallest_dist = bc_len + 1;
+        ties = 0;
+        packed_barcode entry;
+        entry.len = bc_len;
+        for (size_t id = 0; id < codes.size(); id++) {
+            entry.bits = codes[id];
+            int dist = packed_distance(query, entry);
+            if (dist < smallest_dist) {
+                smallest_dist = dist;
+                best_idx = id;
+                ties = 1;
+            } else if (dist == smallest_dist) {
+                ties++;
+            }
+        }
+        return best_idx;
+    }
+
+    std::string get_barcode(size_t idx) const {
+        packed_barcode pb;
+        pb.bits = codes[idx];
+        pb.len = bc_len;
+        return pb.decode();
+    }
+
+    size_t size() const {
+        return codes.size();
+    }
+
+    int length() const {
+        return bc_len;
+    }
+
+    private:
+    struct seed_table {
+        int seg_a;
+        int seg_b;
+        uint64_t mask;
+        // Entries of bucket b are ids[offsets[b]] .. ids[offsets[b + 1] - 1].
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> ids;
+    };
+
+    uint64_t bucket_of(uint64_t key) const {
+        return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bucket_bits);
+    }
+
+    void fill_table(seed_table& table) const {
+        size_t buckets = 1ULL << bucket_bits;
+        table.offsets.assign(buckets + 1, 0);
+        for (auto const& code : codes) {
+            table.offsets[bucket_of(code & table.mask) + 1]++;
+        }
+        for (size_t b = 0; b < buckets; b++) {
+            table.offsets[b + 1] += table.offsets[b];
+        }
+        std::vector<uint32_t> fill(table.offsets.begin(), table.offsets.end() - 1);
+        table.ids.resize(codes.size());
+        for (size_t id = 0; id < codes.size(); id++) {
+            table.ids[fill[bucket_of(codes[id] & table.mask)]++] = id;
+        }
+    }
+
+    // Index of the first table whose two segments are both clean in diff.
+    size_t first_table(uint64_t diff) const {
+        for (size_t t = 0; t < tables.size(); t++) {
+            if (!(diff & tables[t].mask)) {
+                return t;
+            }
+        }
+        return tables.size();
+    }
+
+    static constexpr const char* MAGIC = "BCWL";
+
+    int bc_len = 0;
+    int cutoff = 0;
+    int bucket_bits = 1;
+    std::vector<uint64_t> codes;
+    std::vector<uint64_t> seg_masks;
+    std::vector<seed_table> tables;
+};
+#endif